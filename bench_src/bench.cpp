@@ -0,0 +1,260 @@
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "huffman.h"
+
+// Times each stage of the coder on generated corpora and prints one
+// JSON object per line:
+//   {"corpus": ..., "stage": ..., "bytes": ..., "seconds": ...,
+//    "mb_per_s": ..., "ns_per_byte": ..., "ratio": ...}
+// The corpora come from a fixed seed, so runs compare byte for byte.
+// Usage: bench [-s BYTES] [-r REPEATS] [-j THREADS]
+
+namespace {
+    typedef std::vector<unsigned char> Bytes;
+    typedef std::chrono::steady_clock Clock;
+
+    const std::uint64_t SEED = 20240601;
+    // the tiny corpus is coded as separate messages of up to this size
+    const std::size_t TINY_MESSAGE_SIZE = 200;
+
+    Bytes uniform_corpus(std::size_t size) {
+        std::mt19937_64 random(SEED);
+        Bytes data(size);
+        for (unsigned char& byte: data) {
+            byte = static_cast<unsigned char>(random());
+        }
+        return data;
+    }
+
+    // byte k drawn with probability proportional to 1 / (k + 1)
+    Bytes zipf_corpus(std::size_t size) {
+        std::mt19937_64 random(SEED + 1);
+        std::vector<double> weights(HuffmanArchiver::NUM_OF_BYTES);
+        for (std::size_t i = 0; i < weights.size(); ++i) {
+            weights[i] = 1.0 / (i + 1);
+        }
+        std::discrete_distribution<unsigned> distribution(weights.begin(),
+                                                          weights.end());
+        Bytes data(size);
+        for (unsigned char& byte: data) {
+            byte = static_cast<unsigned char>(distribution(random));
+        }
+        return data;
+    }
+
+    // words of a small vocabulary, zipf-distributed, split into lines
+    Bytes text_corpus(std::size_t size) {
+        std::mt19937_64 random(SEED + 2);
+        std::vector<std::string> words;
+        std::vector<double> weights;
+        for (std::size_t i = 0; i < 2000; ++i) {
+            std::string word;
+            std::size_t length = 2 + random() % 9;
+            for (std::size_t j = 0; j < length; ++j) {
+                word.push_back("etaoinshrdlucmfwypvbgkqjxz"[
+                        std::min<std::size_t>(random() % 26, random() % 26)]);
+            }
+            words.push_back(word);
+            weights.push_back(1.0 / (i + 1));
+        }
+        std::discrete_distribution<std::size_t> distribution(weights.begin(),
+                                                             weights.end());
+        Bytes data;
+        data.reserve(size + 16);
+        std::size_t line = 0;
+        while (data.size() < size) {
+            const std::string& word = words[distribution(random)];
+            data.insert(data.end(), word.begin(), word.end());
+            line += word.size() + 1;
+            data.push_back((line > 70) ? '\n' : ' ');
+            line = (line > 70) ? 0 : line;
+        }
+        data.resize(size);
+        return data;
+    }
+
+    // runs of one byte, a few thousand bytes long each
+    Bytes runs_corpus(std::size_t size) {
+        std::mt19937_64 random(SEED + 3);
+        Bytes data;
+        data.reserve(size + 8192);
+        while (data.size() < size) {
+            data.insert(data.end(), 1024 + random() % 8192,
+                        static_cast<unsigned char>(random() % 4));
+        }
+        data.resize(size);
+        return data;
+    }
+
+    // 16-bit little-endian samples of a slow wave with noise, as a
+    // sensor would record them
+    Bytes samples_corpus(std::size_t size) {
+        std::mt19937_64 random(SEED + 4);
+        std::normal_distribution<double> noise(0, 40);
+        Bytes data(size);
+        for (std::size_t i = 0; i + 1 < size; i += 2) {
+            unsigned sample = static_cast<unsigned>(
+                    30000 + 6000 * std::sin(i / 1000.0) + noise(random));
+            data[i] = static_cast<unsigned char>(sample);
+            data[i + 1] = static_cast<unsigned char>(sample >> 8);
+        }
+        return data;
+    }
+
+    struct Corpus {
+        std::string name;
+        Bytes data;
+        // code it as separate messages of this size, 0 for one archive
+        std::size_t message_size;
+        std::size_t symbol_size = 1;
+    };
+
+    // the fastest of `repeats` runs, in seconds
+    template <typename Stage>
+    double best_time(std::size_t repeats, Stage stage) {
+        double best = HUGE_VAL;
+        for (std::size_t i = 0; i < repeats; ++i) {
+            Clock::time_point start = Clock::now();
+            stage();
+            std::chrono::duration<double> elapsed = Clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+        return best;
+    }
+
+    void report(const std::string& corpus, const std::string& stage,
+                std::size_t bytes, double seconds, double ratio) {
+        std::cout << "{\"corpus\": \"" << corpus << "\", "
+                  << "\"stage\": \"" << stage << "\", "
+                  << "\"bytes\": " << bytes << ", "
+                  << "\"seconds\": " << seconds << ", "
+                  << "\"mb_per_s\": " << bytes / seconds / 1e6 << ", "
+                  << "\"ns_per_byte\": " << seconds * 1e9 / bytes << ", "
+                  << "\"ratio\": " << ratio << "}\n";
+    }
+
+    // stops the compiler from dropping work whose result goes unused
+    volatile std::uint64_t sink;
+
+    void run(const Corpus& corpus, std::size_t repeats,
+             HuffmanArchiver::Options options) {
+        options.symbol_size = corpus.symbol_size;
+        const Bytes& data = corpus.data;
+        const std::size_t message_size =
+                corpus.message_size ? corpus.message_size : data.size();
+        const std::size_t messages =
+                (data.size() + message_size - 1) / message_size;
+
+        double frequencies_time = best_time(repeats, [&]() {
+            HuffmanArchiver::Frequencies frequencies;
+            frequencies.add(data.data(), data.size(), options.threads);
+            sink = frequencies[data[0]];
+        });
+
+        HuffmanArchiver::Frequencies frequencies;
+        frequencies.add(data.data(), data.size());
+        double codes_time = best_time(repeats, [&]() {
+            HuffmanArchiver::CodeLengths lengths(frequencies,
+                                                 options.max_code_length);
+            HuffmanArchiver::Codes codes(lengths);
+            sink = codes.code(data[0]);
+        });
+
+        std::vector<Bytes> archives(messages);
+        double encode_time = best_time(repeats, [&]() {
+            for (std::size_t i = 0; i < messages; ++i) {
+                std::size_t offset = i * message_size;
+                archives[i].clear();
+                HuffmanArchiver::encode(
+                        data.data() + offset,
+                        std::min(message_size, data.size() - offset),
+                        archives[i], options);
+            }
+        });
+        std::size_t archive_size = 0;
+        for (const Bytes& archive: archives) {
+            archive_size += archive.size();
+        }
+
+        Bytes output(message_size);
+        double decode_time = best_time(repeats, [&]() {
+            for (const Bytes& archive: archives) {
+                HuffmanArchiver::decode(archive.data(), archive.size(),
+                                        output.data(), output.size(), options);
+            }
+            sink = output[0];
+        });
+
+        const double ratio = double(data.size()) / archive_size;
+        report(corpus.name, "frequencies", data.size(), frequencies_time, ratio);
+        report(corpus.name, "codes", data.size(), codes_time, ratio);
+        report(corpus.name, "encode", data.size(), encode_time, ratio);
+        report(corpus.name, "decode", data.size(), decode_time, ratio);
+    }
+
+    std::size_t parse_number(const char* arg) {
+        std::size_t pos = 0;
+        std::size_t value = 0;
+        try {
+            value = std::stoul(arg, &pos);
+        } catch (const std::logic_error&) {
+            pos = 0;
+        }
+        if (pos == 0 || arg[pos] != '\0') {
+            throw std::invalid_argument(std::string("not a number: ") + arg);
+        }
+        return value;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        std::size_t size = 16 << 20;
+        std::size_t repeats = 5;
+        HuffmanArchiver::Options options;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "s:r:j:")) != -1) {
+            if (opt == 's') {
+                size = parse_number(optarg);
+            } else if (opt == 'r') {
+                repeats = parse_number(optarg);
+            } else if (opt == 'j') {
+                options.threads = parse_number(optarg);
+            } else {
+                std::cerr << "usage: bench [-s BYTES] [-r REPEATS] [-j THREADS]\n";
+                return 1;
+            }
+        }
+        if (size == 0 || repeats == 0) {
+            throw std::invalid_argument("size and repeats must be positive");
+        }
+
+        const Corpus corpora[] = {
+            {"uniform", uniform_corpus(size), 0},
+            {"zipf", zipf_corpus(size), 0},
+            {"text", text_corpus(size), 0},
+            {"runs", runs_corpus(size), 0},
+            {"samples", samples_corpus(size), 0},
+            {"samples16", samples_corpus(size), 0, 2},
+            {"tiny", text_corpus(std::min<std::size_t>(size, 1 << 20)),
+             TINY_MESSAGE_SIZE}
+        };
+        for (const Corpus& corpus: corpora) {
+            run(corpus, repeats, options);
+        }
+    } catch (const std::exception& excep) {
+        std::cerr << excep.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
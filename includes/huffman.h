@@ -2,10 +2,19 @@
 
 #include <istream>
 #include <ostream>
+#include <stdexcept>
 #include <vector>
+#include <memory>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 
+namespace HuffmanImpl {
+    class DecodeTable;
+    class TableCacheShard;
+    struct SpanScratch;
+}
+
 namespace HuffmanArchiver {
     
     class IO_error : public std::runtime_error {
@@ -13,14 +22,207 @@ namespace HuffmanArchiver {
     };
 
     const std::size_t NUM_OF_BYTES = 256;
+
+    // legacy archives: 8-byte size, raw frequency table, data
     const std::size_t FREQUENCY_TABLE_SIZE = 2048;
     const std::size_t SYSTEM_INFO_SIZE = 8;
     const std::uint64_t HEADER_SIZE = SYSTEM_INFO_SIZE + FREQUENCY_TABLE_SIZE;
 
+    // Newer archives start with SIGNATURE and a format version byte.
+    // Read as a legacy size the signature would mean more than 2^59 bytes,
+    // so the two can't be confused.
+    const std::size_t SIGNATURE_SIZE = 8;
+    const unsigned char SIGNATURE[SIGNATURE_SIZE] = 
+            {0x89, 'H', 'U', 'F', '\r', '\n', 0x1A, '\n'};
+    
+    // signature, version, 8-byte size, code lengths, data
+    const unsigned char FORMAT_CANONICAL = 1;
+    // Signature, version, flags, block size, then blocks coded one by one,
+    // each with its own code lengths, and an end mark. Written in one pass.
+    const unsigned char FORMAT_BLOCKS = 2;
+    // signature, version, dictionary id, size as a varint, data coded
+    // with the dictionary's codes
+    const unsigned char FORMAT_DICTIONARY = 3;
+    // the version byte of a saved dictionary, which no archive uses
+    const unsigned char DICTIONARY_FILE = 0x80;
+
+    const std::size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+    const std::size_t MAX_BLOCK_SIZE = 1 << 28;
+
+    // a block split into several bit streams decodes them side by side
+    const std::size_t MAX_STREAMS = 8;
+    const std::size_t DEFAULT_STREAMS = 4;
+
+    // code tables a block may pick from by the byte before each byte
+    const std::size_t MAX_CONTEXT_GROUPS = 16;
+
+    // a couple of percent isn't worth decoding over a plain copy
+    const std::size_t DEFAULT_STORE_MARGIN = 2;
+
+    // decode tables a TableCache keeps unless told otherwise
+    const std::size_t DEFAULT_TABLE_CACHE_SIZE = 256;
+
+    // short enough for any input to decode with one or two table lookups
+    const std::size_t DEFAULT_MAX_CODE_LENGTH = 15;
+
+    class Dictionary;
+    class TableCache;
+
+    // Where an encode or decode call spent its time. Calls given one
+    // through Options::stats add to it; builds with HUFFMAN_STATS=0
+    // leave it alone. Phase times are summed over threads and never
+    // overlap on one: time spent on I/O while coding counts as I/O.
+    struct Stats {
+        double total_seconds = 0;
+        double count_seconds = 0; // byte frequencies
+        double build_seconds = 0; // code lengths, codes, decode tables
+        double code_seconds = 0;  // packing and unpacking bits
+        double io_seconds = 0;    // stream reads and writes
+        std::uint64_t bytes_read = 0;
+        std::uint64_t bytes_written = 0;
+        std::uint64_t read_calls = 0;
+        std::uint64_t write_calls = 0;
+        // Over the bytes encoded with codes built for them: how many,
+        // the bits their codewords took, the bits an ideal code would
+        // have taken, and the longest codeword. 16-bit symbols count
+        // as their two bytes.
+        std::uint64_t symbols = 0;
+        std::uint64_t code_bits = 0;
+        double entropy_bits = 0;
+        std::size_t max_code_length = 0;
+        // decode tables found in Options::table_cache, and built for it
+        std::uint64_t table_hits = 0;
+        std::uint64_t table_misses = 0;
+    };
+
+    struct Options {
+        // from 8 (enough for every byte value) to Codes::MAX_CODE_LENGTH
+        std::size_t max_code_length = DEFAULT_MAX_CODE_LENGTH;
+        // up to MAX_BLOCK_SIZE; 0 writes FORMAT_CANONICAL, which reads 
+        // the input twice and needs it seekable
+        std::size_t block_size = DEFAULT_BLOCK_SIZE;
+        // bit streams per block, from 1 to MAX_STREAMS
+        std::size_t streams = DEFAULT_STREAMS;
+        // percent of a block coding must save, or the block is stored
+        // as it is; up to 100
+        std::size_t store_margin = DEFAULT_STORE_MARGIN;
+        // blocks coded at once; 0 uses every hardware thread
+        std::size_t threads = 1;
+        // encodes FORMAT_DICTIONARY archives with it, whatever the block
+        // size; decoding them needs the same dictionary
+        const Dictionary* dictionary = nullptr;
+        // ends FORMAT_BLOCKS archives with an index of their blocks,
+        // which decode_range needs; block archives only
+        bool index = false;
+        // CRC32C of each block and of the whole data, checked while
+        // decoding; block archives only
+        bool checksum = false;
+        // Up to MAX_CONTEXT_GROUPS sets of codes per block, picked by
+        // the previous byte, for blocks where that beats one set; such
+        // blocks take one bit stream. 0 or 1 for plain codes; block
+        // archives only.
+        std::size_t context_groups = 0;
+        // Bytes per symbol: 1, or 2 for data made of 16-bit values (low
+        // byte first), whose blocks are then coded a value at a time
+        // where that beats bytes. Block archives only.
+        std::size_t symbol_size = 1;
+        // Decoding takes the tables of Huffman blocks and canonical
+        // archives from it, building only those it lacks. Legacy
+        // archives, context and 16-bit blocks build their own.
+        TableCache* table_cache = nullptr;
+        // filled in by calls that get it, see Stats
+        Stats* stats = nullptr;
+    };
+
     void encode(std::istream& in, std::ostream& out, 
                 std::uint64_t& in_size, std::uint64_t& out_size);
     void decode(std::istream& in, std::ostream& out,
                 std::uint64_t& in_size, std::uint64_t& out_sizse);
+
+    // header_size tells how much of the archive is not encoded data
+    void encode(std::istream& in, std::ostream& out, 
+                std::uint64_t& in_size, std::uint64_t& out_size,
+                std::uint64_t& header_size, 
+                const Options& options = Options());
+    void decode(std::istream& in, std::ostream& out,
+                std::uint64_t& in_size, std::uint64_t& out_size,
+                std::uint64_t& header_size,
+                const Options& options = Options());
+
+    // Decodes `length` bytes starting `offset` bytes into the data of an
+    // archive written with Options::index, reading only the blocks they
+    // fall in. `in` must be seekable. A range past the end of the data
+    // throws std::out_of_range.
+    void decode_range(std::istream& in, std::uint64_t offset,
+                      std::uint64_t length, std::ostream& out);
+    // in_size counts the archive bytes read
+    void decode_range(std::istream& in, std::uint64_t offset,
+                      std::uint64_t length, std::ostream& out,
+                      std::uint64_t& in_size, std::uint64_t& header_size);
+
+    // The same archives coded between memory buffers.
+    // Room for max_compressed_size bytes is always enough to encode into;
+    // decompressed_size reads what an archive holds from its headers.
+    std::size_t max_compressed_size(std::size_t size,
+                                    const Options& options = Options());
+    std::uint64_t decompressed_size(const unsigned char* archive,
+                                    std::size_t size);
+
+    // return the bytes written to `dest`, throw IO_error if they don't fit
+    std::size_t encode(const unsigned char* data, std::size_t size,
+                       unsigned char* dest, std::size_t capacity,
+                       const Options& options = Options());
+    std::size_t decode(const unsigned char* archive, std::size_t size,
+                       unsigned char* dest, std::size_t capacity,
+                       const Options& options = Options());
+    // append to `out`
+    void encode(const unsigned char* data, std::size_t size,
+                std::vector<unsigned char>& out,
+                const Options& options = Options());
+    void decode(const unsigned char* archive, std::size_t size,
+                std::vector<unsigned char>& out,
+                const Options& options = Options());
+
+    // Encode buffer after buffer like the calls above, keeping the
+    // memory that takes from one call to the next. With one thread a
+    // call allocates nothing once earlier ones have seen blocks as
+    // big and as many. Not for use by several threads at once.
+    class EncoderContext {
+    public:
+        // throws std::invalid_argument for options encode can't use
+        explicit EncoderContext(const Options& options = Options());
+        ~EncoderContext();
+        EncoderContext(const EncoderContext&) = delete;
+        EncoderContext& operator=(const EncoderContext&) = delete;
+
+        std::size_t encode(const unsigned char* data, std::size_t size,
+                           unsigned char* dest, std::size_t capacity);
+        // allocates when `out` has to grow
+        void encode(const unsigned char* data, std::size_t size,
+                    std::vector<unsigned char>& out);
+    private:
+        Options options;
+        std::unique_ptr<HuffmanImpl::SpanScratch> scratch;
+        // archives for a `dest` too small to hold the worst case
+        std::vector<unsigned char> staging;
+    };
+
+    // The same for decoding; legacy archives still allocate.
+    class DecoderContext {
+    public:
+        explicit DecoderContext(const Options& options = Options());
+        ~DecoderContext();
+        DecoderContext(const DecoderContext&) = delete;
+        DecoderContext& operator=(const DecoderContext&) = delete;
+
+        std::size_t decode(const unsigned char* archive, std::size_t size,
+                           unsigned char* dest, std::size_t capacity);
+        void decode(const unsigned char* archive, std::size_t size,
+                    std::vector<unsigned char>& out);
+    private:
+        Options options;
+        std::unique_ptr<HuffmanImpl::SpanScratch> scratch;
+    };
     
     class Frequencies { 
     public:
@@ -32,25 +234,142 @@ namespace HuffmanArchiver {
         std::uint64_t operator[](std::size_t ind) const;
         std::uint64_t& operator[](std::size_t ind);
         void add(std::istream& in);
+        void add(const unsigned char* data, std::size_t size);
+        // splits large inputs across `threads` threads, 0 for all of them
+        void add(const unsigned char* data, std::size_t size, 
+                 std::size_t threads);
         void save(std::ostream& out) const;
         void load_saved(std::istream& in);
     private: 
         uint64_t arr[NUM_OF_BYTES];
     };
     
-    using Codeword = typename std::vector<bool>; 
-    
+    // Lengths of canonical codes; all a decoder needs to rebuild them.
+    // Unused bytes get length 0.
+    class CodeLengths {
+    public:
+        CodeLengths();
+        // optimal lengths, limited to max_length if plain Huffman is longer
+        CodeLengths(const Frequencies& frequencies, 
+                    std::size_t max_length = DEFAULT_MAX_CODE_LENGTH);
+        ~CodeLengths() = default;
+        CodeLengths(const CodeLengths&) = default;
+        CodeLengths& operator=(const CodeLengths&) = default;
+
+        std::uint8_t operator[](std::size_t ind) const;
+        std::uint8_t& operator[](std::size_t ind);
+        std::size_t max_length() const;
+        // a byte per length, runs of unused bytes squeezed into one byte
+        void save(std::ostream& out) const;
+        // `dest` needs room for NUM_OF_BYTES bytes; returns bytes written
+        std::size_t save(unsigned char* dest) const;
+        void load_saved(std::istream& in);
+        // returns how many bytes of `data` it took
+        std::size_t load_saved(const unsigned char* data, std::size_t size);
+        std::size_t saved_size() const;
+    private:
+        std::uint8_t arr[NUM_OF_BYTES];
+    };
+
+    // the code sits in the lowest `length` bits, first bit highest
+    struct Codeword {
+        std::uint64_t code;
+        std::size_t length;
+    };
+
+    // Codes and lengths are kept in two flat arrays, so looking one up
+    // touches a couple of cache lines and never allocates.
+    // A length of 0 means the byte has no code.
     class Codes {
     public:
+        static const std::size_t MAX_CODE_LENGTH = 64;
+
+        Codes();
         Codes(const Frequencies& frequencies);
+        // canonical codes: shorter first, equal lengths in byte order
+        Codes(const CodeLengths& lengths);
         ~Codes() = default;
         Codes(const Codes&) = default;
         Codes& operator=(const Codes&) = default;
 
         Codeword operator[](std::size_t ind) const;
-        Codeword& operator[](std::size_t ind);
+        std::uint64_t code(std::size_t ind) const;
+        std::size_t length(std::size_t ind) const;
+        void set(std::size_t ind, const Codeword& codeword);
+    private:
+        std::uint64_t code_arr[NUM_OF_BYTES];
+        std::uint8_t length_arr[NUM_OF_BYTES];
+    };
+
+    inline Codeword Codes::operator[](std::size_t ind) const {
+        return Codeword{code_arr[ind], length_arr[ind]};
+    }
+
+    inline std::uint64_t Codes::code(std::size_t ind) const {
+        return code_arr[ind];
+    }
+
+    inline std::size_t Codes::length(std::size_t ind) const {
+        return length_arr[ind];
+    }
+
+    // Codes trained on sample data, shared by many small archives that
+    // then only carry its id. Every byte value gets a code, so anything
+    // can be encoded with it, just less tightly than with its own codes.
+    class Dictionary {
+    public:
+        // equal codes for all bytes
+        Dictionary();
+        Dictionary(const Frequencies& samples, 
+                   std::size_t max_length = DEFAULT_MAX_CODE_LENGTH);
+        ~Dictionary() = default;
+        Dictionary(const Dictionary&) = default;
+        Dictionary& operator=(const Dictionary&) = default;
+
+        // a hash of the code lengths
+        std::uint32_t id() const;
+        const CodeLengths& lengths() const;
+        const Codes& codes() const;
+        const HuffmanImpl::DecodeTable& table() const;
+
+        // signature, DICTIONARY_FILE, id, code lengths
+        void save(std::ostream& out) const;
+        void load_saved(std::istream& in);
     private:
-        Codeword arr[NUM_OF_BYTES];
+        void set_lengths(const CodeLengths& lengths);
+
+        CodeLengths code_lengths;
+        Codes code_table;
+        std::shared_ptr<const HuffmanImpl::DecodeTable> decode_table;
+        std::uint32_t dict_id;
+    };
+
+    // Decode tables kept for archives coded with the same code lengths,
+    // as many small archives of similar data are, so decoding them
+    // builds a table once. Holds up to `capacity` tables, dropping the
+    // least recently used; lookups from several threads only wait for
+    // one another when they land in the same of its shards.
+    class TableCache {
+    public:
+        // throws std::invalid_argument for a capacity of 0
+        explicit TableCache(std::size_t capacity = DEFAULT_TABLE_CACHE_SIZE);
+        ~TableCache();
+        TableCache(const TableCache&) = delete;
+        TableCache& operator=(const TableCache&) = delete;
+
+        // the table for `lengths` and `lookup_bits`, built on a miss
+        std::shared_ptr<const HuffmanImpl::DecodeTable> table(
+                const CodeLengths& lengths, unsigned lookup_bits);
+        std::uint64_t hits() const;
+        std::uint64_t misses() const;
+        // tables held now
+        std::size_t size() const;
+        // drops every table, keeps the counts
+        void clear();
+    private:
+        std::vector<std::unique_ptr<HuffmanImpl::TableCacheShard>> shards;
+        std::atomic<std::uint64_t> hit_count;
+        std::atomic<std::uint64_t> miss_count;
     };
 
     void encode(const Codes& codes, std::istream& in, std::ostream& out, 
@@ -59,4 +378,11 @@ namespace HuffmanArchiver {
     void decode(const Codes& codes, std::istream& in, 
                 std::ostream& out, std::uint64_t bytes_encoded,
                 std::uint64_t& in_size, std::uint64_t& out_size);
+
+    // Same result as decode above, but resolves several bits per step
+    // through lookup tables instead of walking the tree bit by bit.
+    // Reads the input in chunks, so `in` may be left past the encoded data.
+    void decode_fast(const Codes& codes, std::istream& in,
+                     std::ostream& out, std::uint64_t bytes_encoded,
+                     std::uint64_t& in_size, std::uint64_t& out_size);
 } 
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <cstdint>
+#include "huffman.h"
+
+namespace HuffmanImpl {
+
+    // Many files coded in one process, for inputs too small to be worth
+    // a process each.
+
+    struct BatchJob {
+        std::string input;
+        std::string output;
+    };
+
+    struct BatchResult {
+        std::uint64_t in_size = 0;
+        std::uint64_t out_size = 0;
+        std::uint64_t header_size = 0;
+        double seconds = 0;
+        // empty when the file went through
+        std::string error;
+    };
+
+    // where a file goes when nothing says otherwise: `input`.huf when
+    // encoding, `input` without .huf (or with .out added) when decoding
+    std::string default_output(const std::string& input, bool encode);
+
+    // One job per line: the input, then a tab and the output, which
+    // may be left out. Empty lines are skipped.
+    std::vector<BatchJob> read_manifest(std::istream& in, bool encode);
+    // Every regular file under `dir` (only .huf ones when decoding).
+    // With an `out_dir` the outputs go to the same relative paths there,
+    // directories created as needed.
+    std::vector<BatchJob> list_directory(const std::string& dir,
+                                         const std::string& out_dir,
+                                         bool encode);
+
+    // Runs the jobs on `workers` threads (0 for every hardware thread),
+    // each with at most two files open. Files whose input and output
+    // fit in `memory` / workers bytes are coded between buffers the
+    // worker keeps for the next file; bigger ones are streamed.
+    // Failures are reported per file, and options.stats gets the sum.
+    std::vector<BatchResult> run_batch(const std::vector<BatchJob>& jobs,
+                                       bool encode,
+                                       const HuffmanArchiver::Options& options,
+                                       std::size_t workers, std::size_t memory);
+}
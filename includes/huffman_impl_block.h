@@ -0,0 +1,148 @@
+#pragma once
+
+#include <vector>
+#include <istream>
+#include <ostream>
+#include "huffman.h"
+#include "huffman_impl_table.h"
+#include "huffman_impl_lengths.h"
+#include "huffman_impl_context.h"
+#include "huffman_impl_wide.h"
+
+namespace HuffmanImpl {
+
+    enum BlockType : unsigned char {
+        BLOCK_END = 0,
+        BLOCK_HUFFMAN = 1,
+        // Body: code lengths, stream count, the byte sizes of all
+        // streams but the last (4 bytes each), then the streams.
+        // Stream i codes the i-th of `count` equal slices of the block.
+        BLOCK_HUFFMAN_STREAMS = 2,
+        // the bytes as they are, for data coding wouldn't shrink enough
+        BLOCK_STORED = 3,
+        // a single byte repeated raw_size times
+        BLOCK_RLE = 4,
+        // Body: a saved ContextModel, then a single stream of order-1
+        // codes.
+        BLOCK_CONTEXT = 5,
+        // Body: saved WideCodes, the last byte if raw_size is odd, then
+        // streams as in BLOCK_HUFFMAN_STREAMS (a single one allowed) of
+        // codes for the 16-bit symbols before it.
+        BLOCK_WIDE = 6
+    };
+
+    // type, raw size, body size; the end mark is just its type byte
+    struct BlockHeader {
+        unsigned char type;
+        std::uint32_t raw_size;
+        std::uint32_t body_size;
+    };
+
+    // signature, version, flags, block size
+    const std::size_t ARCHIVE_HEADER_SIZE = HuffmanArchiver::SIGNATURE_SIZE + 6;
+    const std::size_t BLOCK_HEADER_SIZE = 9;
+
+    // An archive with FLAG_INDEX set ends, after the end mark, with the
+    // offset of every block header (8 bytes each) and a trailer: block
+    // count, decoded size, INDEX_MAGIC. Every block but the last holds
+    // exactly block size bytes, so the trailer alone tells a reader
+    // which entries to fetch for any range.
+    const unsigned char FLAG_INDEX = 1;
+    const std::size_t INDEX_TRAILER_SIZE = 20;
+    const std::uint32_t INDEX_MAGIC = 0x58444948; // "HIDX"
+
+    // With FLAG_CHECKSUM every block body is followed by the CRC32C of
+    // the block's decoded bytes, and the end mark by that of all of
+    // them (before any index).
+    const unsigned char FLAG_CHECKSUM = 2;
+    const std::size_t CHECKSUM_SIZE = 4;
+    const unsigned char KNOWN_FLAGS = FLAG_INDEX | FLAG_CHECKSUM;
+
+    // where a block sits in an archive held in memory
+    struct BlockRef {
+        BlockHeader header;
+        std::size_t body_offset;
+        std::uint64_t raw_offset;
+    };
+
+    // throws std::invalid_argument for settings encode can't work with
+    void check_options(const HuffmanArchiver::Options& options);
+
+    void put_archive_header(unsigned char* dest,
+                            const HuffmanArchiver::Options& options);
+    // Lists the blocks of a FORMAT_BLOCKS archive, checking that they fit.
+    // Returns the archive size up to and including the end mark and index.
+    std::size_t index_blocks(const unsigned char* archive, std::size_t size,
+                             std::vector<BlockRef>& blocks);
+
+    std::size_t index_size(std::size_t blocks);
+    // writes index_size(offsets.size()) bytes
+    void put_index(unsigned char* dest, const std::vector<std::uint64_t>& offsets,
+                   std::uint64_t raw_size);
+
+    // the most a body may take for blocks of `block_size` bytes
+    std::size_t max_body_size(std::size_t block_size);
+
+    // Huffman codes never take more than 8 bits a byte on average,
+    // each extra stream may waste a byte on padding
+    std::size_t max_encoded_block_size(std::size_t size);
+
+    // The memory coding a block needs besides its input and output.
+    // A thread coding block after block can keep one for all of them,
+    // and then only allocates for blocks bigger than any before.
+    struct BlockScratch {
+        LengthScratch lengths;
+        DecodeTable table;
+        ContextModel model;
+        ContextScratch context;
+        std::vector<DecodeTable> context_tables;
+        WideCodes wide;
+        // when set, decoding takes tables from it instead of `table`
+        HuffmanArchiver::TableCache* cache = nullptr;
+        std::shared_ptr<const DecodeTable> cached;
+    };
+
+    // the table for codes of `lengths`, from scratch.cache if there is
+    // one, else rebuilt in scratch.table; good until the next call
+    const DecodeTable& lengths_table(BlockScratch& scratch,
+                                     const HuffmanArchiver::CodeLengths& lengths,
+                                     unsigned lookup_bits);
+
+    // Writes a whole block (header, body and, with options.checksum,
+    // checksum) for `size` bytes of `data` to `dest`, which has room
+    // for max_encoded_block_size(size) bytes. Returns the block size;
+    // `tables` gets how much of it is header, tables and checksum.
+    std::size_t encode_block(const unsigned char* data, std::size_t size,
+                             const HuffmanArchiver::Options& options,
+                             unsigned char* dest, std::size_t& tables);
+    std::size_t encode_block(const unsigned char* data, std::size_t size,
+                             const HuffmanArchiver::Options& options,
+                             unsigned char* dest, std::size_t& tables,
+                             BlockScratch& scratch);
+    // Decodes header.raw_size bytes into `dest`, checking them against
+    // the block's `checksum` if there is one.
+    // Returns how many bytes of the body were tables.
+    std::size_t decode_block(const BlockHeader& header,
+                             const unsigned char* body, unsigned char* dest,
+                             const unsigned char* checksum,
+                             BlockScratch& scratch);
+
+    // Both code up to options.threads blocks at once; the archive 
+    // doesn't depend on the number of threads.
+    void encode_blocks(std::istream& in, std::ostream& out,
+                       const HuffmanArchiver::Options& options,
+                       std::uint64_t& in_size, std::uint64_t& out_size,
+                       std::uint64_t& header_size);
+    // expects the signature and version to be already read
+    void decode_blocks(std::istream& in, std::ostream& out,
+                       const HuffmanArchiver::Options& options,
+                       std::uint64_t& in_size, std::uint64_t& out_size,
+                       std::uint64_t& header_size);
+    // Decodes `length` bytes from `offset` on, reading only the blocks
+    // that hold them; `in` must be seekable and the archive indexed.
+    // Throws std::out_of_range for a range past the end of the data.
+    // in_size counts the archive bytes read.
+    void decode_range(std::istream& in, std::uint64_t offset,
+                      std::uint64_t length, std::ostream& out,
+                      std::uint64_t& in_size, std::uint64_t& header_size);
+}
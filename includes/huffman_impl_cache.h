@@ -0,0 +1,55 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+#include "huffman.h"
+
+namespace HuffmanImpl {
+
+    class DecodeTable;
+
+    // what a decode table is built from, with a hash of it
+    struct TableKey {
+        TableKey(const HuffmanArchiver::CodeLengths& lengths,
+                 unsigned lookup_bits);
+
+        std::uint64_t hash;
+        unsigned lookup_bits;
+        std::uint8_t lengths[HuffmanArchiver::NUM_OF_BYTES];
+    };
+
+    bool operator==(const TableKey& a, const TableKey& b);
+
+    // The part of a TableCache behind one lock: up to `capacity`
+    // tables, the least recently used dropped first.
+    class TableCacheShard {
+    public:
+        using Table = std::shared_ptr<const DecodeTable>;
+
+        explicit TableCacheShard(std::size_t capacity);
+        TableCacheShard(const TableCacheShard&) = delete;
+        TableCacheShard& operator=(const TableCacheShard&) = delete;
+
+        // null when there's no table for `key`
+        Table find(const TableKey& key);
+        // Keeps `table` for `key`, unless another thread got there
+        // first; returns the table kept.
+        Table insert(const TableKey& key, const Table& table);
+        std::size_t size() const;
+        void clear();
+    private:
+        struct Item {
+            TableKey key;
+            Table table;
+        };
+
+        mutable std::mutex mutex;
+        std::size_t capacity;
+        // most recently used first
+        std::list<Item> items;
+        std::unordered_map<std::uint64_t, std::list<Item>::iterator> by_hash;
+    };
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "huffman.h"
+#include "huffman_impl_lengths.h"
+
+namespace HuffmanImpl {
+
+    class HuffmanFastBitWriter;
+    class HuffmanFastBitReader;
+    class DecodeTable;
+
+    // Order-1 codes: each byte is coded with the codes of the group its
+    // predecessor belongs to, the first byte as if it followed a zero.
+    // Previous bytes that predict alike share a group, so a block pays
+    // for a few code tables rather than one per byte value.
+    struct ContextModel {
+        unsigned char groups[HuffmanArchiver::NUM_OF_BYTES];
+        std::vector<HuffmanArchiver::Frequencies> frequencies;
+        std::vector<HuffmanArchiver::CodeLengths> lengths;
+        // what the block takes coded with them
+        std::uint64_t bits = 0;
+    };
+
+    // the group count, then the group of each previous byte, two a byte
+    const std::size_t CONTEXT_MAP_SIZE = 1 + HuffmanArchiver::NUM_OF_BYTES / 2;
+
+    // What building and writing models works in, kept by callers that
+    // code block after block so it is allocated only once.
+    struct ContextScratch {
+        // a byte that followed some context, and how often
+        struct Count {
+            unsigned char symbol;
+            std::uint32_t count;
+        };
+
+        std::vector<Count> follows[HuffmanArchiver::NUM_OF_BYTES];
+        std::vector<std::uint32_t> counts;
+        std::vector<std::size_t> seen;
+        std::vector<std::uint64_t> sums;
+        std::vector<double> costs;
+        std::vector<HuffmanArchiver::Codeword> codewords;
+    };
+
+    // Splits the byte values into at most `max_groups` groups by what
+    // follows them in `data` and builds codes for each into `model`.
+    // Allocates nothing once `model` and the scratch have seen as many
+    // groups and as many kinds of pairs.
+    void build_context_model(const unsigned char* data, std::size_t size,
+                             std::size_t max_groups,
+                             std::size_t max_code_length, ContextModel& model,
+                             ContextScratch& scratch, LengthScratch& lengths);
+
+    std::size_t saved_size(const ContextModel& model);
+    // both return the bytes taken
+    std::size_t save_context_model(const ContextModel& model,
+                                   unsigned char* dest);
+    std::size_t load_context_model(const unsigned char* data, std::size_t size,
+                                   ContextModel& model);
+
+    void write_context_codes(HuffmanFastBitWriter& writer,
+                             const ContextModel& model,
+                             const unsigned char* data, std::size_t size,
+                             ContextScratch& scratch);
+    // Decodes exactly `count` bytes into `dest`, with the first of
+    // `tables` (added if there are too few) rebuilt for the model.
+    void read_context_codes(HuffmanFastBitReader& reader,
+                            const ContextModel& model,
+                            std::vector<DecodeTable>& tables,
+                            unsigned char* dest, std::size_t count);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace HuffmanImpl {
+
+    // CRC32C (Castagnoli), the one iSCSI and ext4 use. Runs on the
+    // SSE4.2 crc32 instruction when the CPU has it, on tables otherwise.
+
+    // the checksum of what `crc` covered followed by `size` bytes of
+    // `data`; start from 0
+    std::uint32_t crc32c(std::uint32_t crc, const unsigned char* data,
+                         std::size_t size);
+    // the checksum of A followed by B, from those of A and B and the
+    // size of B, without going over the data again
+    std::uint32_t crc32c_combine(std::uint32_t crc_a, std::uint32_t crc_b,
+                                 std::uint64_t size_b);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include "huffman.h"
+
+namespace HuffmanImpl {
+
+    // signature, version, dictionary id; the size follows as a varint
+    const std::size_t DICTIONARY_PREFIX_SIZE = HuffmanArchiver::SIGNATURE_SIZE + 5;
+
+    // the dictionary an archive with `id` needs, from the options
+    const HuffmanArchiver::Dictionary& find_dictionary(
+            const HuffmanArchiver::Options& options, std::uint32_t id);
+
+    // a dictionary's codes may take more than 8 bits a byte
+    std::size_t max_dictionary_archive_size(
+            std::size_t size, const HuffmanArchiver::Dictionary& dictionary);
+
+    // writes a whole FORMAT_DICTIONARY archive, returns its size
+    std::size_t encode_with_dictionary(
+            const unsigned char* data, std::size_t size, unsigned char* dest,
+            const HuffmanArchiver::Dictionary& dictionary,
+            std::uint64_t& header_size);
+}
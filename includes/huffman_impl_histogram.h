@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace HuffmanImpl {
+
+    class ThreadPool;
+
+    // Adds how often each byte value occurs in `data` to `counts`.
+    // Consecutive bytes go to different tables, so runs of one value
+    // don't keep incrementing the same counter.
+    void count_bytes(const unsigned char* data, std::size_t size,
+                     std::uint64_t* counts);
+    // the same, with slices of `data` counted on the pool's threads
+    void count_bytes(const unsigned char* data, std::size_t size,
+                     std::uint64_t* counts, ThreadPool& pool);
+}
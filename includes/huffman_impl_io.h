@@ -3,24 +3,57 @@
 #include <ios>
 #include <istream>
 #include <ostream>
+#include <vector>
 #include "huffman.h"
 
 namespace HuffmanImpl {
+
+    // reads up to `size` bytes, returns how many were read; 0 means eof
+    std::size_t read_chunk(std::istream& in, unsigned char* dest,
+                           std::size_t size);
+
+    // little-endian integers of `bytes` bytes, for archive headers
+    void write_le(std::ostream& out, std::uint64_t value, std::size_t bytes);
+    std::uint64_t read_le(std::istream& in, std::size_t bytes);
+    void put_le(unsigned char* dest, std::uint64_t value, std::size_t bytes);
+    std::uint64_t get_le(const unsigned char* data, std::size_t bytes);
+
+    // 7 bits a byte, lowest first, the high bit set on all but the last
+    const std::size_t MAX_VARINT_SIZE = 10;
+    // both return the bytes taken
+    std::size_t put_varint(unsigned char* dest, std::uint64_t value);
+    std::size_t get_varint(const unsigned char* data, std::size_t size,
+                           std::uint64_t& value);
+    std::uint64_t read_varint(std::istream& in);
     
+    // the state both bit-at-a-time classes share, on the stream type
+    // they use, so neither needs a virtual call or a cast
+    template <typename Stream>
     class HuffmanBitIO {
     public:
-        HuffmanBitIO(std::ios& stream_param);
-        virtual ~HuffmanBitIO() = 0;
-        
+        HuffmanBitIO(Stream& stream_param);
+
         std::uint64_t get_byte_cnt() const;
     protected:
-        std::ios& stream;
+        ~HuffmanBitIO() = default;
+
+        Stream& stream;
         unsigned char buf;
         int pos;
         std::uint64_t byte_cnt;
     };
 
-    class HuffmanBitWriter : public HuffmanBitIO {
+    template <typename Stream>
+    HuffmanBitIO<Stream>::HuffmanBitIO(Stream& stream_param)
+            : stream(stream_param), buf(0), pos(0), byte_cnt(0) {
+    }
+
+    template <typename Stream>
+    std::uint64_t HuffmanBitIO<Stream>::get_byte_cnt() const {
+        return byte_cnt;
+    }
+
+    class HuffmanBitWriter : public HuffmanBitIO<std::ostream> {
     public:
         HuffmanBitWriter(std::ostream& out_stream);
         HuffmanBitWriter(const HuffmanBitWriter&) = delete;
@@ -32,7 +65,7 @@ namespace HuffmanImpl {
         void flush();
     };
 
-    class HuffmanBitReader : public HuffmanBitIO {
+    class HuffmanBitReader : public HuffmanBitIO<std::istream> {
     public:
         HuffmanBitReader(std::istream& in_stream);
         HuffmanBitReader(const HuffmanBitReader&) = delete;
@@ -42,4 +75,187 @@ namespace HuffmanImpl {
 
         bool read(bool& value);
     };
+
+    // Packs codes into a 64-bit register and moves them out 32 bits at
+    // a time into a buffer that goes to the stream in big chunks.
+    // Produces exactly the same bytes as HuffmanBitWriter.
+    class HuffmanFastBitWriter {
+    public:
+        static const std::size_t BUFFER_SIZE = 1 << 16;
+
+        HuffmanFastBitWriter(std::ostream& out_stream);
+        // writes straight into `dest`, which must have 4 bytes to spare
+        HuffmanFastBitWriter(unsigned char* dest, std::size_t capacity);
+        HuffmanFastBitWriter(const HuffmanFastBitWriter&) = delete;
+        HuffmanFastBitWriter(HuffmanFastBitWriter&&) = delete;
+        HuffmanFastBitWriter& operator=(const HuffmanFastBitWriter&) = delete;
+        ~HuffmanFastBitWriter() = default;
+
+        // writes the lowest `length` (1..64) bits of `code`, highest first
+        void write(std::uint64_t code, unsigned length);
+        // the same for `length` up to 32
+        void write_short(std::uint64_t code, unsigned length);
+        // pads the last byte with zeros and hands everything to the stream
+        void flush();
+
+        std::uint64_t get_byte_cnt() const;
+    private:
+        void put(std::uint64_t code, unsigned length);
+        void drain();
+
+        std::ostream* stream;
+        std::vector<unsigned char> buffer;
+        unsigned char* begin;
+        unsigned char* pos;
+        unsigned char* limit;
+        std::uint64_t bits;
+        unsigned bit_cnt;
+        std::uint64_t byte_cnt;
+    };
+
+    inline void HuffmanFastBitWriter::put(std::uint64_t code, unsigned length) {
+        bits |= code << (64 - bit_cnt - length);
+        bit_cnt += length;
+        if (bit_cnt >= 32) {
+            pos[0] = static_cast<unsigned char>(bits >> 56);
+            pos[1] = static_cast<unsigned char>(bits >> 48);
+            pos[2] = static_cast<unsigned char>(bits >> 40);
+            pos[3] = static_cast<unsigned char>(bits >> 32);
+            pos += 4;
+            bits <<= 32;
+            bit_cnt -= 32;
+            if (pos == limit) {
+                drain();
+            }
+        }
+    }
+
+    inline void HuffmanFastBitWriter::write(std::uint64_t code,
+                                            unsigned length) {
+        if (length > 32) {
+            put(code >> 32, length - 32);
+            length = 32;
+        }
+        put(code & 0xFFFFFFFFu, length);
+    }
+
+    inline void HuffmanFastBitWriter::write_short(std::uint64_t code,
+                                                  unsigned length) {
+        put(code, length);
+    }
+
+    // Writes the codewords of `size` bytes of `data`, all of which must
+    // have one. Codes of up to 16 bits go in two at a time, codes of up
+    // to 32 without the check for splitting; each case has its own loop.
+    void write_codes(HuffmanFastBitWriter& writer,
+                     const HuffmanArchiver::Codes& codes, std::size_t max_length,
+                     const unsigned char* data, std::size_t size);
+
+    // Reads whole chunks of the stream and keeps up to 64 bits
+    // ready to be looked at, so the decoder can resolve several
+    // bits per step. Reads ahead of the bits actually consumed.
+    class HuffmanFastBitReader {
+    public:
+        static const std::size_t BUFFER_SIZE = 1 << 16;
+
+        HuffmanFastBitReader(std::istream& in_stream);
+        HuffmanFastBitReader(const unsigned char* data, std::size_t size);
+        HuffmanFastBitReader(const HuffmanFastBitReader&) = delete;
+        HuffmanFastBitReader(HuffmanFastBitReader&&) = delete;
+        HuffmanFastBitReader& operator=(const HuffmanFastBitReader&) = delete;
+        ~HuffmanFastBitReader() = default;
+
+        // The part of the reader a decode loop works on. Held in locals,
+        // it stays in registers even though the loop stores bytes.
+        struct State {
+            const unsigned char* pos;
+            std::uint64_t bits;
+            unsigned bit_cnt;
+        };
+
+        // guarantees at least 57 bits to peek (zeros past the end of stream)
+        void refill();
+        // the same for a saved state, which needs 8 bytes available
+        static void refill(State& state);
+        // bytes read ahead but not yet in the bit register
+        std::size_t available() const;
+        State save() const;
+        void restore(const State& state);
+        std::uint64_t peek(unsigned count) const;
+        void consume(unsigned count);
+        // throws if more bits were consumed than the stream had
+        void check_bounds() const;
+
+        std::uint64_t get_byte_cnt() const;
+    private:
+        bool load();
+
+        std::istream* stream;
+        std::vector<unsigned char> buffer;
+        const unsigned char* pos;
+        const unsigned char* end;
+        std::uint64_t bits;
+        unsigned bit_cnt;
+        std::uint64_t consumed_cnt;
+        std::uint64_t loaded_cnt;
+        bool exhausted;
+    };
+
+    inline void HuffmanFastBitReader::refill(State& state) {
+        // Takes a whole word at once. Bits past the last whole byte land
+        // in `bits` early, but they are the very bits the next refill
+        // puts there, so OR-ing them again changes nothing.
+        std::uint64_t word = 0;
+        for (int i = 0; i < 8; ++i) {
+            word = (word << 8) | state.pos[i];
+        }
+        state.bits |= word >> state.bit_cnt;
+        unsigned bytes = (63 - state.bit_cnt) >> 3;
+        state.pos += bytes;
+        state.bit_cnt += bytes * 8;
+    }
+
+    inline void HuffmanFastBitReader::refill() {
+        if (end - pos >= 8) {
+            State state{pos, bits, bit_cnt};
+            refill(state);
+            pos = state.pos;
+            bits = state.bits;
+            bit_cnt = state.bit_cnt;
+            return;
+        }
+        while (bit_cnt <= 56) {
+            if (pos == end && !load()) {
+                return;
+            }
+            bits |= static_cast<std::uint64_t>(*pos++) << (56 - bit_cnt);
+            bit_cnt += 8;
+        }
+    }
+
+    inline std::size_t HuffmanFastBitReader::available() const {
+        return end - pos;
+    }
+
+    inline HuffmanFastBitReader::State HuffmanFastBitReader::save() const {
+        return State{pos, bits, bit_cnt};
+    }
+
+    inline void HuffmanFastBitReader::restore(const State& state) {
+        consumed_cnt += 8 * std::uint64_t(state.pos - pos) + 
+                        bit_cnt - state.bit_cnt;
+        pos = state.pos;
+        bits = state.bits;
+        bit_cnt = state.bit_cnt;
+    }
+
+    inline std::uint64_t HuffmanFastBitReader::peek(unsigned count) const {
+        return bits >> (64 - count);
+    }
+
+    inline void HuffmanFastBitReader::consume(unsigned count) {
+        bits <<= count;
+        bit_cnt -= count;
+        consumed_cnt += count;
+    }
 }
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "huffman.h"
+
+namespace HuffmanImpl {
+
+    // The lists package_merge works through, kept by callers that build
+    // codes for block after block so they are allocated only once.
+    struct LengthScratch {
+        // a leaf (a byte) or a package of two items of the previous list
+        struct Item {
+            std::uint64_t weight;
+            int symbol;
+            std::size_t first;
+            std::size_t second;
+        };
+
+        std::vector<Item> pool;
+        std::vector<std::size_t> leaves;
+        std::vector<std::size_t> list;
+        std::vector<std::size_t> packages;
+        std::vector<std::size_t> merged;
+    };
+
+    // Optimal code lengths no longer than `max_length` for the used bytes,
+    // found with package-merge. Unused bytes get length 0.
+    // Needs 2^max_length to cover the number of used bytes.
+    void package_merge(const HuffmanArchiver::Frequencies& frequencies,
+                       std::size_t max_length, std::uint8_t* lengths);
+    void package_merge(const HuffmanArchiver::Frequencies& frequencies,
+                       std::size_t max_length, std::uint8_t* lengths,
+                       LengthScratch& scratch);
+
+    // Sets `lengths` to CodeLengths(frequencies, max_length): Huffman's,
+    // or package-merge's when those are too long. Allocates nothing
+    // but what package-merge needs beyond `scratch`.
+    void code_lengths(const HuffmanArchiver::Frequencies& frequencies,
+                      std::size_t max_length,
+                      HuffmanArchiver::CodeLengths& lengths,
+                      LengthScratch& scratch);
+}
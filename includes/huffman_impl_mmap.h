@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+namespace HuffmanImpl {
+
+    // A whole file mapped into memory, either an existing one for reading
+    // or a new one of a given size for writing.
+    class MappedFile {
+    public:
+        // whether `path` is a regular file (or, if `may_be_missing`, 
+        // doesn't exist yet), i.e. something that can be mapped
+        static bool mappable(const std::string& path, bool may_be_missing);
+
+        explicit MappedFile(const std::string& path);
+        // creates or truncates the file with all `size` bytes allocated on
+        // disk; until close() it's cut back to nothing when destroyed
+        MappedFile(const std::string& path, std::size_t size);
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile();
+
+        unsigned char* data();
+        const unsigned char* data() const;
+        std::size_t size() const;
+
+        // unmaps a file mapped for writing and cuts it to `final_size`
+        void close(std::size_t final_size);
+
+    private:
+        void unmap();
+
+        int fd;
+        unsigned char* ptr;
+        std::size_t length;
+        bool writable;
+    };
+}
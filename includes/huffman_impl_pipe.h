@@ -0,0 +1,43 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+
+namespace HuffmanImpl {
+
+    class StatsCollector;
+
+    // A thread of its own for reading or writing, so the next blocks
+    // can be read and the last ones written while these are coded.
+    // Runs one job at a time.
+    class IoThread {
+    public:
+        IoThread();
+        IoThread(const IoThread&) = delete;
+        IoThread& operator=(const IoThread&) = delete;
+        // waits for the job still running, if any
+        ~IoThread();
+
+        // the job started before must have been waited for
+        void start(std::function<void()> job);
+        // waits for the job started last; rethrows what it threw
+        void wait();
+
+    private:
+        void work();
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        std::function<void()> job;
+        bool busy;
+        bool stopping;
+        std::exception_ptr error;
+        // the caller's, taken over for the job
+        StatsCollector* stats;
+        std::thread thread;
+    };
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+
+namespace HuffmanImpl {
+
+    class StatsCollector;
+
+    // Fixed set of worker threads that run the same task over a range
+    // of indices. The calling thread works too, so a pool of one thread
+    // runs everything inline.
+    class ThreadPool {
+    public:
+        // 0 picks the number of hardware threads
+        ThreadPool(std::size_t threads);
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        ~ThreadPool();
+
+        std::size_t size() const;
+        // calls task(i) for every i below count and waits for all of them;
+        // rethrows the first exception a task threw
+        void run(std::size_t count, const std::function<void(std::size_t)>& task);
+
+    private:
+        void work();
+        void take_tasks(std::unique_lock<std::mutex>& lock);
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void(std::size_t)>* current;
+        std::size_t next;
+        std::size_t count;
+        std::size_t unfinished;
+        std::size_t generation;
+        std::exception_ptr error;
+        bool stopping;
+        // the caller's, taken over by the workers while they run its tasks
+        StatsCollector* stats;
+    };
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "huffman.h"
+#include "huffman_impl_block.h"
+
+namespace HuffmanImpl {
+
+    // Whole archives coded between memory buffers, no streams involved.
+
+    // The memory the calls below need besides their input and output.
+    // Callers coding buffer after buffer keep one (see EncoderContext);
+    // on one thread the calls then allocate nothing once it has grown
+    // to the blocks and block counts they see, except to build context
+    // models or to decode legacy archives.
+    struct SpanScratch {
+        BlockScratch block;
+        std::vector<std::uint64_t> offsets;
+        std::vector<BlockRef> blocks;
+        std::vector<std::size_t> tables;
+    };
+
+    // the most encode_span can write for `size` bytes
+    std::size_t max_archive_size(std::size_t size,
+                                 const HuffmanArchiver::Options& options);
+    // `dest` needs room for max_archive_size(size, options) bytes;
+    // returns the archive size
+    std::size_t encode_span(const unsigned char* data, std::size_t size,
+                            unsigned char* dest,
+                            const HuffmanArchiver::Options& options,
+                            std::uint64_t& header_size);
+    std::size_t encode_span(const unsigned char* data, std::size_t size,
+                            unsigned char* dest,
+                            const HuffmanArchiver::Options& options,
+                            std::uint64_t& header_size, SpanScratch& scratch);
+
+    // what an archive of any format decodes to, read from its headers
+    std::uint64_t decoded_size(const unsigned char* archive, std::size_t size);
+    std::uint64_t decoded_size(const unsigned char* archive, std::size_t size,
+                               SpanScratch& scratch);
+    // `dest` needs room for decoded_size(archive, size) bytes;
+    // returns how much of the archive was used
+    std::size_t decode_span(const unsigned char* archive, std::size_t size,
+                            unsigned char* dest,
+                            const HuffmanArchiver::Options& options,
+                            std::uint64_t& header_size);
+    std::size_t decode_span(const unsigned char* archive, std::size_t size,
+                            unsigned char* dest,
+                            const HuffmanArchiver::Options& options,
+                            std::uint64_t& header_size, SpanScratch& scratch);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include "huffman.h"
+
+// Builds without HUFFMAN_STATS (or with it set to 0) leave out every
+// counter and timer below; Options::stats then stays untouched.
+#ifndef HUFFMAN_STATS
+#define HUFFMAN_STATS 1
+#endif
+
+#if HUFFMAN_STATS
+
+namespace HuffmanImpl {
+
+    struct WideCodes;
+
+    enum Phase {
+        PHASE_COUNT,
+        PHASE_BUILD,
+        PHASE_CODE,
+        PHASE_IO,
+        NUM_OF_PHASES
+    };
+
+    // What one encode or decode call has done so far, gathered from
+    // every thread working on it.
+    class StatsCollector {
+    public:
+        StatsCollector();
+        StatsCollector(const StatsCollector&) = delete;
+        StatsCollector& operator=(const StatsCollector&) = delete;
+
+        void add_time(Phase phase, std::chrono::steady_clock::duration time);
+        void add_read(std::size_t bytes);
+        void add_write(std::size_t bytes);
+        // the data about to be coded with `lengths` built for it
+        void add_codes(const HuffmanArchiver::Frequencies& frequencies,
+                       const HuffmanArchiver::CodeLengths& lengths);
+        // the same for 16-bit symbols, each counted as its two bytes
+        void add_codes(const WideCodes& wide);
+        // a table looked up in Options::table_cache
+        void add_table_lookup(bool hit);
+        // adds everything to `stats`
+        void report(HuffmanArchiver::Stats& stats,
+                    std::chrono::steady_clock::duration total) const;
+
+    private:
+        mutable std::mutex mutex;
+        std::chrono::steady_clock::duration times[NUM_OF_PHASES];
+        HuffmanArchiver::Stats counts;
+    };
+
+    // the collector of the call running on this thread, if any
+    StatsCollector* active_stats();
+
+    // Collects into `stats` (if not null) for as long as it lives, unless
+    // an outer call on this thread already does.
+    class StatsScope {
+    public:
+        explicit StatsScope(HuffmanArchiver::Stats* stats);
+        StatsScope(const StatsScope&) = delete;
+        StatsScope& operator=(const StatsScope&) = delete;
+        ~StatsScope();
+
+        // the collector of this scope, null when an outer call collects
+        StatsCollector* collecting();
+
+    private:
+        HuffmanArchiver::Stats* stats;
+        StatsCollector collector;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // makes `collector` active on this thread for as long as it lives,
+    // so pool threads report to the call that gave them work
+    class StatsBinding {
+    public:
+        explicit StatsBinding(StatsCollector* collector);
+        StatsBinding(const StatsBinding&) = delete;
+        StatsBinding& operator=(const StatsBinding&) = delete;
+        ~StatsBinding();
+
+    private:
+        StatsCollector* previous;
+    };
+
+    // Adds the time it lives to `phase`. Timers nest: an inner one
+    // pauses the outer, so no time is counted twice on a thread.
+    class PhaseTimer {
+    public:
+        explicit PhaseTimer(Phase phase_param);
+        PhaseTimer(const PhaseTimer&) = delete;
+        PhaseTimer& operator=(const PhaseTimer&) = delete;
+        ~PhaseTimer();
+
+    private:
+        void stop();
+
+        StatsCollector* collector;
+        Phase phase;
+        PhaseTimer* outer;
+        std::chrono::steady_clock::time_point start;
+    };
+}
+
+#define HUFFMAN_STATS_CONCAT(a, b) a##b
+#define HUFFMAN_STATS_NAME(line) HUFFMAN_STATS_CONCAT(huffman_phase_timer_, line)
+#define HUFFMAN_STATS_PHASE(phase) \
+    HuffmanImpl::PhaseTimer HUFFMAN_STATS_NAME(__LINE__)(HuffmanImpl::phase)
+#define HUFFMAN_STATS_SCOPE(stats) \
+    HuffmanImpl::StatsScope huffman_stats_scope(stats)
+#define HUFFMAN_STATS_CALL(method, ...) \
+    do { \
+        if (HuffmanImpl::StatsCollector* huffman_stats = \
+                    HuffmanImpl::active_stats()) { \
+            huffman_stats->method(__VA_ARGS__); \
+        } \
+    } while (false)
+// as above, but only for a HUFFMAN_STATS_SCOPE of this function that
+// is not nested in another call
+#define HUFFMAN_STATS_SCOPE_CALL(method, ...) \
+    do { \
+        if (HuffmanImpl::StatsCollector* huffman_stats = \
+                    huffman_stats_scope.collecting()) { \
+            huffman_stats->method(__VA_ARGS__); \
+        } \
+    } while (false)
+
+#else
+
+#define HUFFMAN_STATS_PHASE(phase)
+#define HUFFMAN_STATS_SCOPE(stats)
+#define HUFFMAN_STATS_CALL(method, ...) do { } while (false)
+#define HUFFMAN_STATS_SCOPE_CALL(method, ...) do { } while (false)
+
+#endif
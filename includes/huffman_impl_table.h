@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "huffman.h"
+
+namespace HuffmanImpl {
+
+    class HuffmanFastBitReader;
+
+    class DecodeTable {
+    public:
+        // Wider primary tables resolve more per lookup but take longer
+        // to build; each width has its own compiled decode loops.
+        static const unsigned MIN_LOOKUP_BITS = 8;
+        static const unsigned MAX_LOOKUP_BITS = 12;
+        static const unsigned DEFAULT_LOOKUP_BITS = 11;
+
+        // the width that pays off for `count` bytes coded with codes
+        // of up to `max_length` bits
+        static unsigned lookup_bits_for(std::uint64_t count, 
+                                        std::size_t max_length);
+
+        // empty until rebuilt
+        DecodeTable();
+        // without `pairs` every lookup gives at most one byte
+        DecodeTable(const HuffmanArchiver::Codes& codes,
+                    unsigned lookup_bits = DEFAULT_LOOKUP_BITS,
+                    bool pairs = true);
+        ~DecodeTable() = default;
+        DecodeTable(const DecodeTable&) = default;
+        DecodeTable& operator=(const DecodeTable&) = default;
+
+        // the table the constructor makes, in the memory this one has,
+        // which only grows when the new table needs more
+        void rebuild(const HuffmanArchiver::Codes& codes,
+                     unsigned lookup_bits = DEFAULT_LOOKUP_BITS,
+                     bool pairs = true);
+
+        // decodes exactly `count` bytes into `dest`
+        void decode(HuffmanFastBitReader& reader,
+                    unsigned char* dest, std::size_t count) const;
+        // Decodes `count` bytes cut into `streams` equal slices, each
+        // from its own reader, taking a step in every stream per round
+        // so the lookups don't wait for one another.
+        void decode(HuffmanFastBitReader* const* readers, std::size_t streams,
+                    unsigned char* dest, std::size_t count) const;
+        // Pairs codewords across order-1 tables, a first byte's entry in
+        // one table taking the second from the table the byte picks.
+        // The tables must have the same width and no pairs of their own.
+        static void pair_contexts(DecodeTable* tables, std::size_t count,
+                                  const unsigned char* groups);
+        // Decodes `count` bytes coded with order-1 codes, each with
+        // tables[groups[previous byte]] (see ContextModel), paired up
+        // by pair_contexts.
+        static void decode_contexts(const DecodeTable* tables,
+                                    const unsigned char* groups,
+                                    HuffmanFastBitReader& reader,
+                                    unsigned char* dest, std::size_t count);
+
+    private:
+        // A single lookup either emits one or two whole codewords
+        // (first_length == length for one, first_length < length for two)
+        // or, when first_length == 0, refers to the subtable `value`.
+        struct Entry {
+            std::uint16_t value;
+            std::uint8_t length;
+            std::uint8_t first_length;
+        };
+
+        struct Subtable {
+            std::uint32_t offset;
+            unsigned bits;
+        };
+
+        static const std::uint16_t NO_SUBTABLE = 0xFFFF;
+
+        // one lookup, one or two bytes; `dest` needs room for two
+        unsigned char* step(HuffmanFastBitReader& reader,
+                            unsigned char* dest) const;
+        unsigned char decode_long(HuffmanFastBitReader& reader,
+                                  Entry entry) const;
+        // picks the decode_rounds instance for N streams and this width
+        template <std::size_t N>
+        void dispatch_rounds(HuffmanFastBitReader* const* readers,
+                             unsigned char** pos,
+                             unsigned char* const* ends) const;
+        template <std::size_t N, unsigned LOOKUP_BITS>
+        void decode_rounds(HuffmanFastBitReader* const* readers,
+                           unsigned char** pos, 
+                           unsigned char* const* ends) const;
+
+        // `symbols` in the order of their codes, so the ones sharing a
+        // subtable follow one another
+        void build(std::size_t subtable, const std::uint16_t* symbols,
+                   const std::uint16_t* symbols_end, std::size_t depth,
+                   const HuffmanArchiver::Codes& codes);
+        void pair_up();
+        // entry `ind` of the primary table as it was before pairing
+        Entry single(std::size_t ind) const;
+
+        unsigned lookup_bits;
+        std::vector<Entry> entries;
+        std::vector<Subtable> subtables;
+    };
+}
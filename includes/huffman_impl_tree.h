@@ -1,47 +1,50 @@
 #pragma once
 
-#include <memory>
+#include <vector>
+#include <cstdint>
 #include "huffman.h"
 
 namespace HuffmanImpl {
 
+    // Nodes live in one array and refer to their children by index.
+    // Trees merged from leaves never need more than MAX_NODES of them;
+    // a tree rebuilt from incomplete codes may, and just grows the array.
     class HuffmanTree {
     public:
-        HuffmanTree(unsigned char byte, uint64_t frequency_val);
-        HuffmanTree(const HuffmanTree& left, const HuffmanTree& right);
+        typedef std::uint16_t Index;
+        static const std::size_t MAX_NODES = 2 * HuffmanArchiver::NUM_OF_BYTES - 1;
+
+        HuffmanTree();
         HuffmanTree(const HuffmanArchiver::Codes& codes);
         ~HuffmanTree() = default;
         HuffmanTree(const HuffmanTree& other) = default;
         HuffmanTree(HuffmanTree&& other) = default;
         HuffmanTree& operator=(const HuffmanTree& other) = default;
 
-        uint64_t get_frequency() const;
+        Index add_leaf(unsigned char byte, uint64_t frequency_val);
+        // the newest node becomes the root
+        Index merge(Index left, Index right);
+
+        uint64_t get_frequency(Index node) const;
         void compute_codes(HuffmanArchiver::Codes& codes) const;
 
     private:
-        class Node {
-            friend class TreeWalker;
-            friend class HuffmanTree;
-        public:
-            Node(std::shared_ptr<Node> left_child, 
-                 std::shared_ptr<Node> right_child);
-            Node(unsigned char byte, uint64_t frequency_val);
-            ~Node() = default;
-            Node(const Node&) = delete;
-            Node(Node&&) = default;
-            Node& operator=(const Node&) = delete;
-            
-            void recursive_delete();
-            void compute_codes(HuffmanArchiver::Codes& codes, 
-                               std::vector<bool>& vec) const;
-        private:
-            std::shared_ptr<Node> left;
-            std::shared_ptr<Node> right;
-            unsigned char c;
+        static const Index NO_CHILD = 0xFFFF;
+
+        struct Node {
             uint64_t frequency;
+            Index left;
+            Index right;
+            unsigned char c;
+
+            bool is_leaf() const;
         };
 
-        std::shared_ptr<Node> root;
+        void compute_codes(Index node, HuffmanArchiver::Codes& codes,
+                           HuffmanArchiver::Codeword prefix) const;
+
+        std::vector<Node> nodes;
+        Index root;
 
     public:
         class TreeWalker {
@@ -56,13 +59,18 @@ namespace HuffmanImpl {
             bool is_leaf() const;
             unsigned char get_byte() const;
         private:
-            std::shared_ptr<Node> root;
-            std::shared_ptr<Node> cur;
+            const Node* nodes;
+            Index root;
+            Index cur;
         };
 
+        // orders node indices by frequency, for heaps of subtrees
         class Greater {
         public:
-            bool operator()(const HuffmanTree& a, const HuffmanTree& b) const;
+            Greater(const HuffmanTree& tree);
+            bool operator()(Index a, Index b) const;
+        private:
+            const HuffmanTree* tree;
         };
     };
 }
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "huffman.h"
+
+namespace HuffmanImpl {
+
+    class HuffmanFastBitReader;
+    class HuffmanFastBitWriter;
+
+    // Blocks coded with Options::symbol_size 2 take their bytes in pairs,
+    // low byte first, each pair a symbol of its own.
+    const std::size_t NUM_OF_WIDE_SYMBOLS = 1 << 16;
+    // room for codes of all 2^16 symbols, and never more than two lookups
+    const std::size_t WIDE_MAX_CODE_LENGTH = 20;
+
+    // Decodes codes of up to WIDE_MAX_CODE_LENGTH bits with a primary
+    // table and, for the longer codes, a second lookup in a subtable
+    // per primary prefix.
+    class WideDecodeTable {
+    public:
+        WideDecodeTable();
+
+        // canonical codes (see WideCodes) of the `count` used `symbols`
+        void rebuild(const std::uint16_t* symbols, std::size_t count,
+                     const std::uint8_t* lengths, const std::uint32_t* codes,
+                     unsigned lookup_bits);
+        // decodes exactly `count` symbols, 2 * count bytes, into `dest`
+        void decode(HuffmanFastBitReader& reader,
+                    unsigned char* dest, std::size_t count) const;
+        // `count` symbols cut into `streams` equal slices, each from its
+        // own reader, decoded side by side
+        void decode(HuffmanFastBitReader* const* readers, std::size_t streams,
+                    unsigned char* dest, std::size_t count) const;
+    private:
+        // Every lookup takes two steps: to entry `next` plus the
+        // `sub_bits` after the primary ones, then to a symbol and the
+        // length of its whole code. A primary entry for a short code
+        // leads back to itself. Length 0 marks bits no code starts with.
+        struct Entry {
+            std::uint32_t next;
+            std::uint16_t symbol;
+            std::uint8_t length;
+            std::uint8_t sub_bits;
+        };
+
+        // the entry for the code at the top of `bits`, which holds at
+        // least WIDE_MAX_CODE_LENGTH of them
+        static Entry lookup(const Entry* entries, unsigned lookup_bits,
+                            std::uint64_t bits);
+        template <std::size_t N>
+        void decode_rounds(HuffmanFastBitReader* const* readers,
+                           unsigned char** pos,
+                           unsigned char* const* ends) const;
+
+        unsigned lookup_bits;
+        // codes a refill leaves room for
+        unsigned steps;
+        std::vector<Entry> entries;
+    };
+
+    // The codes of one block of 16-bit symbols. Counts, lengths and codes
+    // are indexed by symbol, but only the `used` ones are ever looked at
+    // or reset, so a block with few distinct symbols does little work
+    // and the memory is allocated once for every block to come.
+    struct WideCodes {
+        std::vector<std::uint32_t> counts;
+        std::vector<std::uint8_t> lengths;
+        std::vector<std::uint32_t> codes;
+        // in symbol order once lengths are known
+        std::vector<std::uint16_t> used;
+        // Huffman's tree over the used symbols, leaves first
+        std::vector<std::uint16_t> order;
+        std::vector<std::uint64_t> weights;
+        std::vector<std::uint32_t> parents;
+        WideDecodeTable table;
+    };
+
+    // counts the `count` symbols of `data` (2 * count bytes)
+    void count_wide(const unsigned char* data, std::size_t count,
+                    WideCodes& wide);
+    // Huffman lengths for the counted symbols, cut down to
+    // WIDE_MAX_CODE_LENGTH when longer, and their canonical codes.
+    // Returns the bits the counted symbols take with them.
+    std::uint64_t build_wide_codes(WideCodes& wide);
+
+    // The number of used symbols, then a varint for each in symbol
+    // order: the gap since the one before times 32, plus its length.
+    // A run of symbols takes a byte each.
+    std::size_t saved_wide_size(const WideCodes& wide);
+    std::size_t save_wide_codes(const WideCodes& wide, unsigned char* dest);
+    // Reads what save_wide_codes wrote and builds the codes and
+    // wide.table for `count` symbols. Returns how many bytes it took.
+    std::size_t load_wide_codes(const unsigned char* data, std::size_t size,
+                                std::size_t count, WideCodes& wide);
+
+    void write_wide_codes(HuffmanFastBitWriter& writer, const WideCodes& wide,
+                          const unsigned char* data, std::size_t count);
+}
@@ -1,35 +1,135 @@
 #include <queue>
+#include <cstring>
 #include <algorithm>
 #include "huffman.h"
 #include "huffman_impl_io.h"
 #include "huffman_impl_tree.h"
+#include "huffman_impl_table.h"
+#include "huffman_impl_lengths.h"
+#include "huffman_impl_block.h"
+#include "huffman_impl_span.h"
+#include "huffman_impl_histogram.h"
+#include "huffman_impl_dictionary.h"
+#include "huffman_impl_pool.h"
+#include "huffman_impl_cache.h"
+#include "huffman_impl_stats.h"
 
 using std::uint64_t;
 using std::size_t;
 using HuffmanImpl::HuffmanTree;
-using HuffmanImpl::HuffmanBitWriter;
+using HuffmanImpl::HuffmanFastBitWriter;
 using HuffmanImpl::HuffmanBitReader;
+using HuffmanImpl::HuffmanFastBitReader;
+using HuffmanImpl::DecodeTable;
+using HuffmanImpl::TableCacheShard;
+using HuffmanImpl::TableKey;
 
 namespace HuffmanArchiver {
 
+    namespace {
+        using TreeQueue = std::priority_queue<HuffmanTree::Index, 
+                std::vector<HuffmanTree::Index>, HuffmanTree::Greater>;
+
+        // pops in the order the first archives were written with
+        void merge_all(HuffmanTree& tree, TreeQueue& priority_q) {
+            while (priority_q.size() != 1) {
+                HuffmanTree::Index first = priority_q.top();
+                priority_q.pop();
+
+                HuffmanTree::Index second = priority_q.top();
+                priority_q.pop();
+
+                priority_q.push(tree.merge(first, second));
+            }
+        }
+
+        // a saved length is either a length itself or, with this bit set,
+        // a run of up to 128 unused bytes
+        const int UNUSED_RUN = 0x80;
+
+        // `dest` needs room for NUM_OF_BYTES bytes; returns bytes written
+        size_t pack_lengths(const std::uint8_t* arr, unsigned char* dest) {
+            size_t pos = 0;
+            size_t i = 0;
+            while (i < NUM_OF_BYTES) {
+                if (arr[i] != 0) {
+                    dest[pos++] = arr[i++];
+                    continue;
+                }
+                size_t run = 0;
+                while (i < NUM_OF_BYTES && arr[i] == 0 && run < 128) {
+                    ++run;
+                    ++i;
+                }
+                dest[pos++] = UNUSED_RUN | (run - 1);
+            }
+            return pos;
+        }
+
+        template <class NextByte>
+        void unpack_lengths(std::uint8_t* arr, NextByte next_byte) {
+            size_t i = 0;
+            while (i < NUM_OF_BYTES) {
+                int byte = next_byte();
+                if (byte & UNUSED_RUN) {
+                    size_t run = (byte & ~UNUSED_RUN) + 1;
+                    if (i + run > NUM_OF_BYTES) {
+                        throw HuffmanArchiver::IO_error("wrong header: bad code lengths");
+                    }
+                    std::fill(arr + i, arr + i + run, 0);
+                    i += run;
+                } else {
+                    if (byte == 0 || byte > int(Codes::MAX_CODE_LENGTH)) {
+                        throw HuffmanArchiver::IO_error("wrong header: bad code lengths");
+                    }
+                    arr[i++] = byte;
+                }
+            }
+        }
+
+        void decode_by_table(const DecodeTable& table, std::istream& in,
+                             std::ostream& out, uint64_t bytes_encoded,
+                             uint64_t& in_size, uint64_t& out_size) {
+            HUFFMAN_STATS_PHASE(PHASE_CODE);
+            HuffmanFastBitReader reader(in);
+            std::vector<unsigned char> buffer(HuffmanFastBitReader::BUFFER_SIZE);
+
+            out_size = bytes_encoded;
+
+            while (bytes_encoded) {
+                size_t chunk = std::min<uint64_t>(bytes_encoded, buffer.size());
+                table.decode(reader, buffer.data(), chunk);
+
+                HUFFMAN_STATS_PHASE(PHASE_IO);
+                out.write(reinterpret_cast<char*>(buffer.data()), chunk);
+                if (out.fail()) {
+                    throw HuffmanArchiver::IO_error("write error");
+                }
+                HUFFMAN_STATS_CALL(add_write, chunk);
+                bytes_encoded -= chunk;
+            }
+            reader.check_bounds();
+            in_size = reader.get_byte_cnt();
+        }
+    }
+
     void encode(const Codes& codes, std::istream& in, std::ostream& out,
                 uint64_t& in_size, uint64_t& out_size) {
-        HuffmanBitWriter writer(out);
-        unsigned char c; 
+        HUFFMAN_STATS_PHASE(PHASE_CODE);
+        HuffmanFastBitWriter writer(out);
+        std::vector<unsigned char> buffer(HuffmanFastBitWriter::BUFFER_SIZE);
         in_size = 0;
 
-        try {
-            while (in.read(reinterpret_cast<char*>(&c), 1)) {
-                writer.write(codes[c]);
-                in_size++;
-            } 
-        } catch (const std::istream::failure& excep) { // in case the library user gives us streams with exceptions turned on
-            if (!in.eof()) {
-                throw excep;
+        size_t got;
+        while ((got = HuffmanImpl::read_chunk(in, buffer.data(), buffer.size()))) {
+            for (size_t i = 0; i < got; ++i) {
+                size_t length = codes.length(buffer[i]);
+                if (length == 0) {
+                    throw HuffmanArchiver::IO_error("no code for input byte");
+                }
+                writer.write(codes.code(buffer[i]), length);
             }
-        }
-        if (!in.eof()) {
-            throw HuffmanArchiver::IO_error("read error");
+            in_size += got;
         }
 
         writer.flush();
@@ -62,46 +162,297 @@ namespace HuffmanArchiver {
         in_size = reader.get_byte_cnt();
     }
 
+    void decode_fast(const Codes& codes, std::istream& in,
+                     std::ostream& out, uint64_t bytes_encoded,
+                     uint64_t& in_size, uint64_t& out_size) {
+        DecodeTable table(codes, DecodeTable::lookup_bits_for(
+                bytes_encoded, Codes::MAX_CODE_LENGTH));
+        decode_by_table(table, in, out, bytes_encoded,
+                        in_size, out_size);
+    }
+
     void encode(std::istream& in, std::ostream& out,
                 uint64_t& in_size, uint64_t& out_size) {
-        for (size_t i = 0; i < SYSTEM_INFO_SIZE; ++i) { // seekp doesn't work for sstream at eof
-            char c = 0;
-            out.write(&c, 1);
+        uint64_t header_size;
+        encode(in, out, in_size, out_size, header_size);
+    }
+
+    void decode(std::istream& in, std::ostream& out,
+                uint64_t& in_size, uint64_t& out_size) {
+        uint64_t header_size;
+        decode(in, out, in_size, out_size, header_size);
+    }
+
+    void encode(std::istream& in, std::ostream& out,
+                uint64_t& in_size, uint64_t& out_size,
+                uint64_t& header_size, const Options& options) {
+        HUFFMAN_STATS_SCOPE(options.stats);
+        HuffmanImpl::check_options(options);
+        if (options.dictionary != nullptr) { // small inputs, read whole
+            std::vector<unsigned char> data;
+            while (true) {
+                size_t old_size = data.size();
+                data.resize(old_size + HuffmanFastBitReader::BUFFER_SIZE);
+                size_t got = HuffmanImpl::read_chunk(in, data.data() + old_size,
+                                                     HuffmanFastBitReader::BUFFER_SIZE);
+                data.resize(old_size + got);
+                if (got == 0) {
+                    break;
+                }
+            }
+            std::vector<unsigned char> archive(HuffmanImpl::max_archive_size(
+                    data.size(), options));
+            out_size = HuffmanImpl::encode_span(data.data(), data.size(),
+                                                archive.data(), options,
+                                                header_size);
+            HUFFMAN_STATS_PHASE(PHASE_IO);
+            out.write(reinterpret_cast<const char*>(archive.data()), out_size);
+            if (out.fail()) {
+                throw HuffmanArchiver::IO_error("write error");
+            }
+            HUFFMAN_STATS_CALL(add_write, out_size);
+            in_size = data.size();
+            return;
         }
-        if (out.fail()) {
-            throw HuffmanArchiver::IO_error("write error");
+        if (options.block_size != 0) {
+            HuffmanImpl::encode_blocks(in, out, options, 
+                                       in_size, out_size, header_size);
+            return;
         }
 
         Frequencies frequencies;
         frequencies.add(in);
-        frequencies.save(out);
 
-        Codes codes(frequencies);
+        CodeLengths lengths(frequencies, options.max_code_length);
+        Codes codes(lengths);
+        HUFFMAN_STATS_CALL(add_codes, frequencies, lengths);
+
+        uint64_t size = 0;
+        for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
+            size += frequencies[i];
+        }
+
+        out.write(reinterpret_cast<const char*>(SIGNATURE), SIGNATURE_SIZE);
+        out.put(FORMAT_CANONICAL);
+        if (out.fail()) {
+            throw HuffmanArchiver::IO_error("write error");
+        }
+        HuffmanImpl::write_le(out, size, 8);
+        lengths.save(out);
+        header_size = SIGNATURE_SIZE + 1 + 8 + lengths.saved_size();
 
         in.clear();
         in.seekg(0);
         encode(codes, in, out, in_size, out_size);
-        out_size += HEADER_SIZE;
-
-        out.seekp(0);
-        out.write(reinterpret_cast<char*>(&in_size), SYSTEM_INFO_SIZE);
+        out_size += header_size;
     }
 
     void decode(std::istream& in, std::ostream& out,
-                uint64_t& in_size, uint64_t& out_size) {
-        uint64_t size;
-        in.read(reinterpret_cast<char*>(&size), 8);
+                uint64_t& in_size, uint64_t& out_size,
+                uint64_t& header_size, const Options& options) {
+        HUFFMAN_STATS_SCOPE(options.stats);
+        unsigned char signature[SIGNATURE_SIZE];
+        in.read(reinterpret_cast<char*>(signature), SIGNATURE_SIZE);
         if (in.fail()) {
             throw HuffmanArchiver::IO_error("wrong header / read error");
         }
 
-        Frequencies frequencies;
-        frequencies.load_saved(in);
-        
-        Codes codes(frequencies);
+        if (!std::equal(signature, signature + SIGNATURE_SIZE, SIGNATURE)) {
+            uint64_t size; // legacy archive, it started with the size
+            std::memcpy(&size, signature, SYSTEM_INFO_SIZE);
+
+            Frequencies frequencies;
+            frequencies.load_saved(in);
+
+            Codes codes(frequencies);
+
+            decode_fast(codes, in, out, size, in_size, out_size);
+            header_size = HEADER_SIZE;
+            in_size += header_size;
+            return;
+        }
+
+        int version = in.get();
+        if (version == FORMAT_BLOCKS) {
+            HuffmanImpl::decode_blocks(in, out, options,
+                                       in_size, out_size, header_size);
+            return;
+        }
+        if (version == FORMAT_DICTIONARY) {
+            const Dictionary& dictionary = HuffmanImpl::find_dictionary(
+                    options, HuffmanImpl::read_le(in, 4));
+            uint64_t size = HuffmanImpl::read_varint(in);
+            unsigned char size_bytes[HuffmanImpl::MAX_VARINT_SIZE];
+            
+            decode_by_table(dictionary.table(), in, out, size, 
+                            in_size, out_size);
+            header_size = HuffmanImpl::DICTIONARY_PREFIX_SIZE + 
+                          HuffmanImpl::put_varint(size_bytes, size);
+            in_size += header_size;
+            return;
+        }
+        if (version != FORMAT_CANONICAL) {
+            throw HuffmanArchiver::IO_error("unsupported format version");
+        }
+        uint64_t size = HuffmanImpl::read_le(in, 8);
+
+        CodeLengths lengths;
+        lengths.load_saved(in);
+
+        if (options.table_cache != nullptr) {
+            decode_by_table(*options.table_cache->table(lengths,
+                                    DecodeTable::lookup_bits_for(
+                                            size, lengths.max_length())),
+                            in, out, size, in_size, out_size);
+        } else {
+            decode_fast(Codes(lengths), in, out, size, in_size, out_size);
+        }
+        header_size = SIGNATURE_SIZE + 1 + 8 + lengths.saved_size();
+        in_size += header_size;
+    }
+
+    void decode_range(std::istream& in, uint64_t offset, uint64_t length,
+                      std::ostream& out) {
+        uint64_t in_size, header_size;
+        decode_range(in, offset, length, out, in_size, header_size);
+    }
+
+    void decode_range(std::istream& in, uint64_t offset, uint64_t length,
+                      std::ostream& out, uint64_t& in_size,
+                      uint64_t& header_size) {
+        unsigned char signature[SIGNATURE_SIZE];
+        in.read(reinterpret_cast<char*>(signature), SIGNATURE_SIZE);
+        if (in.fail()) {
+            throw HuffmanArchiver::IO_error("wrong header / read error");
+        }
+        if (!std::equal(signature, signature + SIGNATURE_SIZE, SIGNATURE) ||
+                in.get() != FORMAT_BLOCKS) {
+            throw HuffmanArchiver::IO_error("archive has no index");
+        }
+        HuffmanImpl::decode_range(in, offset, length, out, in_size, header_size);
+    }
+
+    size_t max_compressed_size(size_t size, const Options& options) {
+        HuffmanImpl::check_options(options);
+        return HuffmanImpl::max_archive_size(size, options);
+    }
+
+    uint64_t decompressed_size(const unsigned char* archive, size_t size) {
+        return HuffmanImpl::decoded_size(archive, size);
+    }
+
+    size_t encode(const unsigned char* data, size_t size,
+                  unsigned char* dest, size_t capacity,
+                  const Options& options) {
+        uint64_t header_size;
+        size_t bound = max_compressed_size(size, options);
+        if (capacity >= bound) {
+            return HuffmanImpl::encode_span(data, size, dest, 
+                                            options, header_size);
+        }
+        std::vector<unsigned char> archive(bound);
+        archive.resize(HuffmanImpl::encode_span(data, size, archive.data(),
+                                                options, header_size));
+        if (archive.size() > capacity) {
+            throw HuffmanArchiver::IO_error("output buffer too small");
+        }
+        std::copy(archive.begin(), archive.end(), dest);
+        return archive.size();
+    }
+
+    size_t decode(const unsigned char* archive, size_t size,
+                  unsigned char* dest, size_t capacity,
+                  const Options& options) {
+        uint64_t result = decompressed_size(archive, size);
+        if (result > capacity) {
+            throw HuffmanArchiver::IO_error("output buffer too small");
+        }
+        uint64_t header_size;
+        HuffmanImpl::decode_span(archive, size, dest, options, header_size);
+        return result;
+    }
+
+    void encode(const unsigned char* data, size_t size,
+                std::vector<unsigned char>& out, const Options& options) {
+        size_t old_size = out.size();
+        out.resize(old_size + max_compressed_size(size, options));
+        uint64_t header_size;
+        out.resize(old_size + HuffmanImpl::encode_span(data, size, 
+                                                       out.data() + old_size,
+                                                       options, header_size));
+    }
+
+    void decode(const unsigned char* archive, size_t size,
+                std::vector<unsigned char>& out, const Options& options) {
+        size_t old_size = out.size();
+        out.resize(old_size + decompressed_size(archive, size));
+        uint64_t header_size;
+        HuffmanImpl::decode_span(archive, size, out.data() + old_size,
+                                 options, header_size);
+    }
+
+    EncoderContext::EncoderContext(const Options& options_param)
+        : options(options_param), scratch(new HuffmanImpl::SpanScratch()) {
+        HuffmanImpl::check_options(options);
+    }
+
+    EncoderContext::~EncoderContext() = default;
+
+    size_t EncoderContext::encode(const unsigned char* data, size_t size,
+                                  unsigned char* dest, size_t capacity) {
+        uint64_t header_size;
+        size_t bound = HuffmanImpl::max_archive_size(size, options);
+        if (capacity >= bound) {
+            return HuffmanImpl::encode_span(data, size, dest, options,
+                                            header_size, *scratch);
+        }
+        if (staging.size() < bound) {
+            staging.resize(bound);
+        }
+        size_t written = HuffmanImpl::encode_span(data, size, staging.data(),
+                                                  options, header_size, *scratch);
+        if (written > capacity) {
+            throw HuffmanArchiver::IO_error("output buffer too small");
+        }
+        std::copy(staging.begin(), staging.begin() + written, dest);
+        return written;
+    }
 
-        decode(codes, in, out, size, in_size, out_size);
-        in_size += HEADER_SIZE;
+    void EncoderContext::encode(const unsigned char* data, size_t size,
+                                std::vector<unsigned char>& out) {
+        size_t old_size = out.size();
+        out.resize(old_size + HuffmanImpl::max_archive_size(size, options));
+        uint64_t header_size;
+        out.resize(old_size + HuffmanImpl::encode_span(data, size,
+                                                       out.data() + old_size,
+                                                       options, header_size,
+                                                       *scratch));
+    }
+
+    DecoderContext::DecoderContext(const Options& options_param)
+        : options(options_param), scratch(new HuffmanImpl::SpanScratch()) {}
+
+    DecoderContext::~DecoderContext() = default;
+
+    size_t DecoderContext::decode(const unsigned char* archive, size_t size,
+                                  unsigned char* dest, size_t capacity) {
+        uint64_t result = HuffmanImpl::decoded_size(archive, size, *scratch);
+        if (result > capacity) {
+            throw HuffmanArchiver::IO_error("output buffer too small");
+        }
+        uint64_t header_size;
+        HuffmanImpl::decode_span(archive, size, dest, options,
+                                 header_size, *scratch);
+        return result;
+    }
+
+    void DecoderContext::decode(const unsigned char* archive, size_t size,
+                                std::vector<unsigned char>& out) {
+        size_t old_size = out.size();
+        out.resize(old_size + HuffmanImpl::decoded_size(archive, size, *scratch));
+        uint64_t header_size;
+        HuffmanImpl::decode_span(archive, size, out.data() + old_size,
+                                 options, header_size, *scratch);
     }
 
     Frequencies::Frequencies()
@@ -116,21 +467,26 @@ namespace HuffmanArchiver {
     }
 
     void Frequencies::add(std::istream& in) {
-        unsigned char c;
-        try {
-            while (in.read(reinterpret_cast<char*>(&c), 1)) {
-                arr[c]++;
-            }
-        } catch (const std::istream::failure& excep) {
-            if (!in.eof()) {
-                throw excep;
-            }
-        }
-        if (!in.eof()) {
-            throw HuffmanArchiver::IO_error("read error");
+        HUFFMAN_STATS_PHASE(PHASE_COUNT);
+        std::vector<unsigned char> buffer(HuffmanFastBitReader::BUFFER_SIZE);
+        while (size_t got = HuffmanImpl::read_chunk(in, buffer.data(), 
+                                                    buffer.size())) {
+            HuffmanImpl::count_bytes(buffer.data(), got, arr);
         }
     }
     
+    void Frequencies::add(const unsigned char* data, size_t size) {
+        HUFFMAN_STATS_PHASE(PHASE_COUNT);
+        HuffmanImpl::count_bytes(data, size, arr);
+    }
+
+    void Frequencies::add(const unsigned char* data, size_t size, 
+                          size_t threads) {
+        HUFFMAN_STATS_PHASE(PHASE_COUNT);
+        HuffmanImpl::ThreadPool pool(threads);
+        HuffmanImpl::count_bytes(data, size, arr, pool);
+    }
+
     void Frequencies::save(std::ostream& out) const {
         for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
             out.write(reinterpret_cast<const char*>(&arr[i]), 8);
@@ -149,33 +505,242 @@ namespace HuffmanArchiver {
         }
     }
 
-    Codes::Codes(const Frequencies& frequencies) {
+    Codes::Codes()
+        : code_arr(), length_arr() {}
+
+    Codes::Codes(const Frequencies& frequencies)
+        : code_arr(), length_arr() {
+        HUFFMAN_STATS_PHASE(PHASE_BUILD);
 
-        std::priority_queue<HuffmanTree, std::vector<HuffmanTree>, 
-                                         HuffmanTree::Greater> priority_q;
+        HuffmanTree tree;
+        TreeQueue priority_q{HuffmanTree::Greater(tree)};
         for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
-            priority_q.push(HuffmanTree(i, frequencies[i]));
+            priority_q.push(tree.add_leaf(i, frequencies[i]));
         }
 
-        while (priority_q.size() != 1) {
-            HuffmanTree first = priority_q.top();
-            priority_q.pop();
+        merge_all(tree, priority_q);
+        tree.compute_codes(*this);
+    }
+
+    Codes::Codes(const CodeLengths& lengths)
+        : code_arr(), length_arr() {
+        HUFFMAN_STATS_PHASE(PHASE_BUILD);
+        uint64_t length_cnt[MAX_CODE_LENGTH + 1] = {};
+        for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
+            if (lengths[i] > MAX_CODE_LENGTH) {
+                throw HuffmanArchiver::IO_error("wrong header: bad code lengths");
+            }
+            length_cnt[lengths[i]]++;
+        }
+        length_cnt[0] = 0;
 
-            HuffmanTree second = priority_q.top();
-            priority_q.pop();
+        uint64_t next_code[MAX_CODE_LENGTH + 1] = {};
+        uint64_t code = 0;
+        uint64_t free_cnt = 1; // unused codes of the current length, capped
+        for (size_t len = 1; len <= MAX_CODE_LENGTH; ++len) {
+            code = (code + length_cnt[len - 1]) << 1;
+            next_code[len] = code;
 
-            priority_q.push(HuffmanTree(first, second));
+            free_cnt = std::min<uint64_t>(free_cnt * 2, 2 * NUM_OF_BYTES);
+            if (length_cnt[len] > free_cnt) {
+                throw HuffmanArchiver::IO_error("wrong header: bad code lengths");
+            }
+            free_cnt -= length_cnt[len];
         }
 
-        HuffmanTree tree = priority_q.top();
-        tree.compute_codes(*this);
+        for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
+            if (lengths[i] != 0) {
+                set(i, Codeword{next_code[lengths[i]]++, lengths[i]});
+            }
+        }
+    }
+
+    CodeLengths::CodeLengths()
+        : arr() {}
+
+    CodeLengths::CodeLengths(const Frequencies& frequencies, size_t max_length)
+        : arr() {
+        HuffmanImpl::LengthScratch scratch;
+        HuffmanImpl::code_lengths(frequencies, max_length, *this, scratch);
     }
 
-    Codeword Codes::operator[](size_t ind) const {
+    size_t CodeLengths::max_length() const {
+        return *std::max_element(arr, arr + NUM_OF_BYTES);
+    }
+
+    std::uint8_t CodeLengths::operator[](size_t ind) const {
         return arr[ind];
     }
 
-    Codeword& Codes::operator[](size_t ind) {
+    std::uint8_t& CodeLengths::operator[](size_t ind) {
         return arr[ind];
     }
+
+    void CodeLengths::save(std::ostream& out) const {
+        unsigned char packed[NUM_OF_BYTES];
+        out.write(reinterpret_cast<const char*>(packed), pack_lengths(arr, packed));
+        if (out.fail()) {
+            throw HuffmanArchiver::IO_error("write error");
+        }
+    }
+
+    size_t CodeLengths::save(unsigned char* dest) const {
+        return pack_lengths(arr, dest);
+    }
+
+    void CodeLengths::load_saved(std::istream& in) {
+        unpack_lengths(arr, [&in]() {
+            int byte = in.get();
+            if (in.fail()) {
+                throw HuffmanArchiver::IO_error("wrong header / read error");
+            }
+            return byte;
+        });
+    }
+
+    size_t CodeLengths::load_saved(const unsigned char* data, size_t size) {
+        size_t pos = 0;
+        unpack_lengths(arr, [data, size, &pos]() {
+            if (pos == size) {
+                throw HuffmanArchiver::IO_error("wrong header / read error");
+            }
+            return int(data[pos++]);
+        });
+        return pos;
+    }
+
+    size_t CodeLengths::saved_size() const {
+        unsigned char packed[NUM_OF_BYTES];
+        return pack_lengths(arr, packed);
+    }
+
+    void Codes::set(size_t ind, const Codeword& codeword) {
+        code_arr[ind] = codeword.code;
+        length_arr[ind] = codeword.length;
+    }
+
+    Dictionary::Dictionary()
+        : Dictionary(Frequencies()) {}
+
+    Dictionary::Dictionary(const Frequencies& samples, size_t max_length)
+        : dict_id(0) {
+        if (max_length > Codes::MAX_CODE_LENGTH) {
+            throw std::invalid_argument("max code length out of range");
+        }
+        Frequencies counts = samples; // bytes never seen still get a code
+        for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
+            counts[i]++;
+        }
+        set_lengths(CodeLengths(counts, max_length));
+    }
+
+    std::uint32_t Dictionary::id() const {
+        return dict_id;
+    }
+
+    const CodeLengths& Dictionary::lengths() const {
+        return code_lengths;
+    }
+
+    const Codes& Dictionary::codes() const {
+        return code_table;
+    }
+
+    const DecodeTable& Dictionary::table() const {
+        return *decode_table;
+    }
+
+    void Dictionary::save(std::ostream& out) const {
+        out.write(reinterpret_cast<const char*>(SIGNATURE), SIGNATURE_SIZE);
+        out.put(DICTIONARY_FILE);
+        if (out.fail()) {
+            throw HuffmanArchiver::IO_error("write error");
+        }
+        HuffmanImpl::write_le(out, dict_id, 4);
+        code_lengths.save(out);
+    }
+
+    void Dictionary::load_saved(std::istream& in) {
+        unsigned char signature[SIGNATURE_SIZE + 1];
+        in.read(reinterpret_cast<char*>(signature), SIGNATURE_SIZE + 1);
+        if (in.fail() || 
+                !std::equal(signature, signature + SIGNATURE_SIZE, SIGNATURE) ||
+                signature[SIGNATURE_SIZE] != DICTIONARY_FILE) {
+            throw HuffmanArchiver::IO_error("not a dictionary");
+        }
+        std::uint32_t saved_id = HuffmanImpl::read_le(in, 4);
+        CodeLengths lengths;
+        lengths.load_saved(in);
+        set_lengths(lengths);
+        if (dict_id != saved_id) {
+            throw HuffmanArchiver::IO_error("corrupted dictionary");
+        }
+    }
+
+    void Dictionary::set_lengths(const CodeLengths& lengths) {
+        std::uint32_t hash = 2166136261u; // FNV-1a
+        for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
+            if (lengths[i] == 0) {
+                throw HuffmanArchiver::IO_error("corrupted dictionary");
+            }
+            hash = (hash ^ lengths[i]) * 16777619u;
+        }
+        code_lengths = lengths;
+        code_table = Codes(lengths);
+        decode_table = std::make_shared<const DecodeTable>(code_table);
+        dict_id = hash;
+    }
+
+    TableCache::TableCache(size_t capacity)
+        : hit_count(0), miss_count(0) {
+        if (capacity == 0) {
+            throw std::invalid_argument("table cache capacity must be positive");
+        }
+        const size_t count = std::min<size_t>(capacity, 16);
+        for (size_t i = 0; i < count; ++i) {
+            shards.emplace_back(new TableCacheShard(
+                    capacity / count + (i < capacity % count)));
+        }
+    }
+
+    TableCache::~TableCache() = default;
+
+    std::shared_ptr<const DecodeTable> TableCache::table(
+            const CodeLengths& lengths, unsigned lookup_bits) {
+        TableKey key(lengths, lookup_bits);
+        TableCacheShard& shard = *shards[(key.hash >> 32) % shards.size()];
+        std::shared_ptr<const DecodeTable> found = shard.find(key);
+        if (found) {
+            hit_count++;
+            HUFFMAN_STATS_CALL(add_table_lookup, true);
+            return found;
+        }
+        miss_count++;
+        HUFFMAN_STATS_CALL(add_table_lookup, false);
+        // built unlocked, so a slow build holds up nobody else
+        return shard.insert(key, std::make_shared<const DecodeTable>(
+                Codes(lengths), lookup_bits));
+    }
+
+    uint64_t TableCache::hits() const {
+        return hit_count;
+    }
+
+    uint64_t TableCache::misses() const {
+        return miss_count;
+    }
+
+    size_t TableCache::size() const {
+        size_t total = 0;
+        for (const std::unique_ptr<TableCacheShard>& shard: shards) {
+            total += shard->size();
+        }
+        return total;
+    }
+
+    void TableCache::clear() {
+        for (const std::unique_ptr<TableCacheShard>& shard: shards) {
+            shard->clear();
+        }
+    }
 }
@@ -0,0 +1,280 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "huffman_impl_batch.h"
+#include "huffman_impl_span.h"
+#include "huffman_impl_pool.h"
+
+using std::size_t;
+using std::uint64_t;
+namespace fs = std::filesystem;
+
+namespace HuffmanImpl {
+
+    namespace {
+        const std::string ARCHIVE_SUFFIX = ".huf";
+
+        // what a worker keeps from one file to the next, so that once
+        // warm it codes files of the sizes it has seen without allocating
+        struct Scratch {
+            std::vector<unsigned char> input;
+            std::vector<unsigned char> output;
+            SpanScratch span;
+            HuffmanArchiver::Stats stats;
+        };
+
+        // plain system calls, as streams and paths allocate on every file
+        void read_file(const std::string& path, std::vector<unsigned char>& data) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd == -1) {
+                throw HuffmanArchiver::IO_error("can't open input file");
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                ::close(fd);
+                throw HuffmanArchiver::IO_error("can't open input file");
+            }
+            data.resize(static_cast<size_t>(info.st_size));
+            size_t done = 0;
+            while (done < data.size()) {
+                ssize_t got = ::read(fd, data.data() + done, data.size() - done);
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    ::close(fd);
+                    throw HuffmanArchiver::IO_error("read error");
+                }
+                done += got;
+            }
+            ::close(fd);
+        }
+
+        void write_file(const std::string& path,
+                        const unsigned char* data, size_t size) {
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd == -1) {
+                throw HuffmanArchiver::IO_error("can't open output file");
+            }
+            size_t done = 0;
+            while (done < size) {
+                ssize_t put = ::write(fd, data + done, size - done);
+                if (put < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (put <= 0) {
+                    ::close(fd);
+                    throw HuffmanArchiver::IO_error("write error");
+                }
+                done += put;
+            }
+            if (::close(fd) != 0) {
+                throw HuffmanArchiver::IO_error("write error");
+            }
+        }
+
+        // for files too big for the worker's share of memory
+        void run_streams(const BatchJob& job, bool encode,
+                         const HuffmanArchiver::Options& options,
+                         BatchResult& result) {
+            std::ifstream in(job.input, std::ifstream::binary);
+            if (!in.is_open()) {
+                throw HuffmanArchiver::IO_error("can't open input file");
+            }
+            std::ofstream out(job.output, std::ofstream::binary);
+            if (!out.is_open()) {
+                throw HuffmanArchiver::IO_error("can't open output file");
+            }
+            if (encode) {
+                HuffmanArchiver::encode(in, out, result.in_size, result.out_size,
+                                        result.header_size, options);
+            } else {
+                HuffmanArchiver::decode(in, out, result.in_size, result.out_size,
+                                        result.header_size, options);
+            }
+            out.close();
+            if (out.fail()) {
+                throw HuffmanArchiver::IO_error("write error");
+            }
+        }
+
+        void run_job(const BatchJob& job, bool encode,
+                     const HuffmanArchiver::Options& options, size_t memory,
+                     Scratch& scratch, BatchResult& result) {
+            struct stat info;
+            if (stat(job.input.c_str(), &info) != 0) {
+                throw HuffmanArchiver::IO_error("can't open input file");
+            }
+            if (static_cast<uint64_t>(info.st_size) > memory / 2) {
+                run_streams(job, encode, options, result);
+                return;
+            }
+
+            read_file(job.input, scratch.input);
+            const unsigned char* data = scratch.input.data();
+            result.in_size = scratch.input.size();
+            if (encode) {
+                scratch.output.resize(max_archive_size(result.in_size, options));
+                result.out_size = encode_span(data, result.in_size,
+                                              scratch.output.data(), options,
+                                              result.header_size, scratch.span);
+            } else {
+                uint64_t decoded = decoded_size(data, result.in_size,
+                                                scratch.span);
+                if (decoded > memory - result.in_size) {
+                    run_streams(job, encode, options, result);
+                    return;
+                }
+                scratch.output.resize(decoded);
+                result.out_size = decoded;
+                decode_span(data, result.in_size, scratch.output.data(),
+                            options, result.header_size, scratch.span);
+            }
+            write_file(job.output, scratch.output.data(), result.out_size);
+        }
+
+        void add_stats(HuffmanArchiver::Stats& total,
+                       const HuffmanArchiver::Stats& part) {
+            total.total_seconds += part.total_seconds;
+            total.count_seconds += part.count_seconds;
+            total.build_seconds += part.build_seconds;
+            total.code_seconds += part.code_seconds;
+            total.io_seconds += part.io_seconds;
+            total.bytes_read += part.bytes_read;
+            total.bytes_written += part.bytes_written;
+            total.read_calls += part.read_calls;
+            total.write_calls += part.write_calls;
+            total.symbols += part.symbols;
+            total.code_bits += part.code_bits;
+            total.entropy_bits += part.entropy_bits;
+            total.max_code_length = std::max(total.max_code_length,
+                                             part.max_code_length);
+            total.table_hits += part.table_hits;
+            total.table_misses += part.table_misses;
+        }
+    }
+
+    std::string default_output(const std::string& input, bool encode) {
+        if (encode) {
+            return input + ARCHIVE_SUFFIX;
+        }
+        if (input.size() > ARCHIVE_SUFFIX.size() &&
+                input.compare(input.size() - ARCHIVE_SUFFIX.size(),
+                              ARCHIVE_SUFFIX.size(), ARCHIVE_SUFFIX) == 0) {
+            return input.substr(0, input.size() - ARCHIVE_SUFFIX.size());
+        }
+        return input + ".out";
+    }
+
+    std::vector<BatchJob> read_manifest(std::istream& in, bool encode) {
+        std::vector<BatchJob> jobs;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty()) {
+                continue;
+            }
+            size_t tab = line.find('\t');
+            BatchJob job;
+            job.input = line.substr(0, tab);
+            job.output = (tab == std::string::npos) ?
+                         default_output(job.input, encode) :
+                         line.substr(tab + 1);
+            jobs.push_back(job);
+        }
+        if (in.bad()) {
+            throw HuffmanArchiver::IO_error("can't read manifest");
+        }
+        return jobs;
+    }
+
+    std::vector<BatchJob> list_directory(const std::string& dir,
+                                         const std::string& out_dir,
+                                         bool encode) {
+        std::vector<BatchJob> jobs;
+        std::error_code error;
+        fs::recursive_directory_iterator it(dir, error), end;
+        for (; !error && it != end; it.increment(error)) {
+            if (!it->is_regular_file(error)) {
+                continue;
+            }
+            std::string input = it->path().string();
+            if (!encode && it->path().extension() != ARCHIVE_SUFFIX) {
+                continue;
+            }
+            BatchJob job;
+            job.input = input;
+            job.output = default_output(input, encode);
+            if (out_dir != "") {
+                fs::path target = fs::path(out_dir) /
+                        fs::path(job.output).lexically_relative(dir);
+                fs::create_directories(target.parent_path(), error);
+                job.output = target.string();
+            }
+            jobs.push_back(job);
+        }
+        if (error) {
+            throw HuffmanArchiver::IO_error("can't list " + dir + ": " +
+                                            error.message());
+        }
+        // the same order every run, whatever the file system's
+        std::sort(jobs.begin(), jobs.end(), [](const BatchJob& a,
+                                               const BatchJob& b) {
+            return a.input < b.input;
+        });
+        return jobs;
+    }
+
+    std::vector<BatchResult> run_batch(const std::vector<BatchJob>& jobs,
+                                       bool encode,
+                                       const HuffmanArchiver::Options& options,
+                                       size_t workers, size_t memory) {
+        ThreadPool pool(workers);
+        const size_t share = memory / pool.size();
+        std::vector<BatchResult> results(jobs.size());
+        std::vector<Scratch> scratch(pool.size());
+        std::atomic<size_t> next(0);
+        // files written alike share their decode tables
+        HuffmanArchiver::TableCache cache;
+
+        // one long task per worker, each taking files until none are left
+        pool.run(pool.size(), [&](size_t worker) {
+            HuffmanArchiver::Options file_options = options;
+            file_options.threads = 1;
+            if (!encode && options.table_cache == nullptr) {
+                file_options.table_cache = &cache;
+            }
+            if (options.stats != nullptr) {
+                file_options.stats = &scratch[worker].stats;
+            }
+            for (size_t i = next++; i < jobs.size(); i = next++) {
+                BatchResult& result = results[i];
+                std::chrono::steady_clock::time_point start =
+                        std::chrono::steady_clock::now();
+                try {
+                    run_job(jobs[i], encode, file_options, share,
+                            scratch[worker], result);
+                } catch (const std::exception& excep) {
+                    result.error = excep.what();
+                }
+                std::chrono::duration<double> elapsed =
+                        std::chrono::steady_clock::now() - start;
+                result.seconds = elapsed.count();
+            }
+        });
+
+        if (options.stats != nullptr) {
+            for (const Scratch& part: scratch) {
+                add_stats(*options.stats, part.stats);
+            }
+        }
+        return results;
+    }
+}
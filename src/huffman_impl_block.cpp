@@ -0,0 +1,831 @@
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <algorithm>
+#include "huffman_impl_block.h"
+#include "huffman_impl_io.h"
+#include "huffman_impl_table.h"
+#include "huffman_impl_pool.h"
+#include "huffman_impl_pipe.h"
+#include "huffman_impl_context.h"
+#include "huffman_impl_crc.h"
+#include "huffman_impl_stats.h"
+
+using std::size_t;
+using std::uint64_t;
+using HuffmanArchiver::Frequencies;
+using HuffmanArchiver::CodeLengths;
+using HuffmanArchiver::Codes;
+
+namespace HuffmanImpl {
+
+    namespace {
+        // reads until `size` bytes or the end of the stream
+        size_t read_full(std::istream& in, unsigned char* dest, size_t size) {
+            size_t total = 0;
+            while (total < size) {
+                size_t got = read_chunk(in, dest + total, size - total);
+                if (got == 0) {
+                    break;
+                }
+                total += got;
+            }
+            return total;
+        }
+
+        void write_bytes(std::ostream& out, const unsigned char* data,
+                         size_t size) {
+            HUFFMAN_STATS_PHASE(PHASE_IO);
+            out.write(reinterpret_cast<const char*>(data), size);
+            if (out.fail()) {
+                throw HuffmanArchiver::IO_error("write error");
+            }
+            HUFFMAN_STATS_CALL(add_write, size);
+        }
+
+        // the stream count and the sizes of all streams but the last
+        size_t stream_table_size(size_t streams) {
+            return 1 + 4 * (streams - 1);
+        }
+
+        const size_t MAX_STREAM_TABLE_SIZE = 1 + 4 * (HuffmanArchiver::MAX_STREAMS - 1);
+
+        // up to one block per pool thread, with room for their archive form
+        struct EncodeBatch {
+            std::vector<std::vector<unsigned char>> raws;
+            std::vector<size_t> raw_sizes;
+            std::vector<std::vector<unsigned char>> blocks;
+            std::vector<size_t> tables;
+            size_t filled = 0;
+            bool eof = false;
+        };
+
+        void read_batch(std::istream& in, EncodeBatch& batch, size_t width,
+                        size_t block_size) {
+            batch.raws.resize(width);
+            batch.raw_sizes.resize(width);
+            batch.blocks.resize(width);
+            batch.tables.resize(width);
+            batch.filled = 0;
+            while (batch.filled < width && !batch.eof) {
+                std::vector<unsigned char>& raw = batch.raws[batch.filled];
+                raw.resize(block_size);
+                size_t got = read_full(in, raw.data(), block_size);
+                batch.raw_sizes[batch.filled] = got;
+                batch.eof = (got < block_size);
+                if (got != 0) {
+                    ++batch.filled;
+                }
+            }
+        }
+
+        struct DecodeBatch {
+            std::vector<BlockHeader> headers;
+            std::vector<std::vector<unsigned char>> bodies;
+            std::vector<std::vector<unsigned char>> raws;
+            std::vector<size_t> tables;
+            size_t filled = 0;
+            // archive bytes taken, the end mark included
+            uint64_t read = 0;
+            bool end = false;
+        };
+
+        // collects the next few blocks, to be decoded side by side
+        // bodies keep the `checksum` bytes after them
+        void read_batch(std::istream& in, DecodeBatch& batch, size_t width,
+                        size_t block_size, size_t checksum) {
+            batch.headers.resize(width);
+            batch.bodies.resize(width);
+            batch.raws.resize(width);
+            batch.tables.resize(width);
+            batch.filled = 0;
+            batch.read = 0;
+            while (batch.filled < width && !batch.end) {
+                BlockHeader& header = batch.headers[batch.filled];
+                header.type = in.get();
+                if (in.fail()) {
+                    throw HuffmanArchiver::IO_error("wrong header / read error");
+                }
+                batch.read++;
+                if (header.type == BLOCK_END) {
+                    batch.end = true;
+                    break;
+                }
+                header.raw_size = read_le(in, 4);
+                header.body_size = read_le(in, 4);
+                if (header.raw_size > block_size || 
+                        header.body_size > max_body_size(block_size)) {
+                    throw HuffmanArchiver::IO_error("wrong block header");
+                }
+
+                std::vector<unsigned char>& body = batch.bodies[batch.filled];
+                body.resize(header.body_size + checksum);
+                if (read_full(in, body.data(), body.size()) != body.size()) {
+                    throw HuffmanArchiver::IO_error("read error");
+                }
+                batch.raws[batch.filled].resize(header.raw_size);
+                batch.read += BLOCK_HEADER_SIZE - 1 + body.size();
+                ++batch.filled;
+            }
+        }
+    }
+
+    size_t max_body_size(size_t block_size) {
+        return HuffmanArchiver::NUM_OF_BYTES + MAX_STREAM_TABLE_SIZE +
+               (block_size * Codes::MAX_CODE_LENGTH + 7) / 8 + 
+               HuffmanArchiver::MAX_STREAMS;
+    }
+
+    void check_options(const HuffmanArchiver::Options& options) {
+        if (options.max_code_length < 8 || 
+                options.max_code_length > Codes::MAX_CODE_LENGTH) {
+            throw std::invalid_argument("max code length out of range");
+        }
+        if (options.block_size > HuffmanArchiver::MAX_BLOCK_SIZE) {
+            throw std::invalid_argument("block size out of range");
+        }
+        if (options.streams == 0 || 
+                options.streams > HuffmanArchiver::MAX_STREAMS) {
+            throw std::invalid_argument("number of streams out of range");
+        }
+        if (options.store_margin > 100) {
+            throw std::invalid_argument("store margin out of range");
+        }
+        if (options.index && 
+                (options.block_size == 0 || options.dictionary != nullptr)) {
+            throw std::invalid_argument("only block archives have an index");
+        }
+        if (options.checksum && 
+                (options.block_size == 0 || options.dictionary != nullptr)) {
+            throw std::invalid_argument("only block archives have checksums");
+        }
+        if (options.context_groups > HuffmanArchiver::MAX_CONTEXT_GROUPS) {
+            throw std::invalid_argument("context groups out of range");
+        }
+        if (options.context_groups > 1 && 
+                (options.block_size == 0 || options.dictionary != nullptr)) {
+            throw std::invalid_argument("only block archives have context groups");
+        }
+        if (options.symbol_size != 1 && options.symbol_size != 2) {
+            throw std::invalid_argument("symbol size out of range");
+        }
+        if (options.symbol_size == 2 && 
+                (options.block_size == 0 || options.dictionary != nullptr)) {
+            throw std::invalid_argument("only block archives have 16-bit symbols");
+        }
+    }
+
+    void put_archive_header(unsigned char* dest,
+                            const HuffmanArchiver::Options& options) {
+        std::copy(HuffmanArchiver::SIGNATURE, 
+                  HuffmanArchiver::SIGNATURE + HuffmanArchiver::SIGNATURE_SIZE,
+                  dest);
+        dest[HuffmanArchiver::SIGNATURE_SIZE] = HuffmanArchiver::FORMAT_BLOCKS;
+        dest[HuffmanArchiver::SIGNATURE_SIZE + 1] = 
+                (options.index ? FLAG_INDEX : 0) | 
+                (options.checksum ? FLAG_CHECKSUM : 0);
+        put_le(dest + HuffmanArchiver::SIGNATURE_SIZE + 2, options.block_size, 4);
+    }
+
+    size_t index_size(size_t blocks) {
+        return 8 * blocks + INDEX_TRAILER_SIZE;
+    }
+
+    void put_index(unsigned char* dest, const std::vector<uint64_t>& offsets,
+                   uint64_t raw_size) {
+        for (uint64_t offset: offsets) {
+            put_le(dest, offset, 8);
+            dest += 8;
+        }
+        put_le(dest, offsets.size(), 8);
+        put_le(dest + 8, raw_size, 8);
+        put_le(dest + 16, INDEX_MAGIC, 4);
+    }
+
+    size_t index_blocks(const unsigned char* archive, size_t size,
+                        std::vector<BlockRef>& blocks) {
+        const unsigned char* flags = archive + HuffmanArchiver::SIGNATURE_SIZE + 1;
+        if (size < ARCHIVE_HEADER_SIZE || (*flags & ~KNOWN_FLAGS) != 0) {
+            throw HuffmanArchiver::IO_error("wrong header");
+        }
+        size_t block_size = get_le(flags + 1, 4);
+        if (block_size == 0 || block_size > HuffmanArchiver::MAX_BLOCK_SIZE) {
+            throw HuffmanArchiver::IO_error("wrong header");
+        }
+
+        const size_t checksum = (*flags & FLAG_CHECKSUM) ? CHECKSUM_SIZE : 0;
+        blocks.clear();
+        size_t pos = ARCHIVE_HEADER_SIZE;
+        uint64_t raw_offset = 0;
+        while (true) {
+            if (pos == size) {
+                throw HuffmanArchiver::IO_error("read error");
+            }
+            BlockRef block;
+            block.header.type = archive[pos];
+            if (block.header.type == BLOCK_END) {
+                pos++;
+                if (size - pos < checksum) {
+                    throw HuffmanArchiver::IO_error("read error");
+                }
+                pos += checksum;
+                if (!(*flags & FLAG_INDEX)) {
+                    return pos;
+                }
+                if (size - pos < index_size(blocks.size()) ||
+                        get_le(archive + pos + 8 * blocks.size(), 8) != blocks.size() ||
+                        get_le(archive + pos + index_size(blocks.size()) - 4, 4) != 
+                                INDEX_MAGIC) {
+                    throw HuffmanArchiver::IO_error("wrong index");
+                }
+                return pos + index_size(blocks.size());
+            }
+            if (size - pos < BLOCK_HEADER_SIZE) {
+                throw HuffmanArchiver::IO_error("read error");
+            }
+            block.header.raw_size = get_le(archive + pos + 1, 4);
+            block.header.body_size = get_le(archive + pos + 5, 4);
+            block.body_offset = pos + BLOCK_HEADER_SIZE;
+            block.raw_offset = raw_offset;
+            if (block.header.raw_size > block_size || 
+                    block.header.body_size + checksum > size - block.body_offset) {
+                throw HuffmanArchiver::IO_error("wrong block header");
+            }
+            blocks.push_back(block);
+            pos = block.body_offset + block.header.body_size + checksum;
+            raw_offset += block.header.raw_size;
+        }
+    }
+
+    size_t max_encoded_block_size(size_t size) {
+        return BLOCK_HEADER_SIZE + HuffmanArchiver::NUM_OF_BYTES + 
+               MAX_STREAM_TABLE_SIZE + size + HuffmanArchiver::MAX_STREAMS + 4 +
+               CHECKSUM_SIZE;
+    }
+
+    namespace {
+        size_t encode_body(const unsigned char* data, size_t size,
+                           const HuffmanArchiver::Options& options,
+                           unsigned char* dest, size_t& tables,
+                           BlockScratch& scratch) {
+            Frequencies frequencies;
+            frequencies.add(data, size);
+
+            if (size != 0 && frequencies[data[0]] == size) {
+                dest[0] = BLOCK_RLE;
+                put_le(dest + 1, size, 4);
+                put_le(dest + 5, 1, 4);
+                dest[BLOCK_HEADER_SIZE] = data[0];
+                tables = BLOCK_HEADER_SIZE + 1;
+                return tables;
+            }
+
+            CodeLengths lengths;
+            code_lengths(frequencies, options.max_code_length, lengths,
+                         scratch.lengths);
+            const size_t streams = options.streams;
+
+            // The lengths give the coded size exactly, up to stream padding,
+            // so this costs 256 multiplications instead of a coding pass.
+            uint64_t bits = 0;
+            for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+                bits += frequencies[i] * lengths[i];
+            }
+            uint64_t coded = lengths.saved_size() + (bits + 7) / 8 +
+                             ((streams > 1) ? stream_table_size(streams) : 0);
+
+            ContextModel& model = scratch.model;
+            bool use_contexts = false;
+            if (options.context_groups > 1) {
+                build_context_model(data, size, options.context_groups,
+                                    options.max_code_length, model,
+                                    scratch.context, scratch.lengths);
+                uint64_t context_coded = saved_size(model) + (model.bits + 7) / 8;
+                use_contexts = (context_coded < coded);
+                coded = std::min(coded, context_coded);
+            }
+            WideCodes& wide = scratch.wide;
+            bool use_wide = false;
+            if (options.symbol_size == 2 && size >= 2) {
+                count_wide(data, size / 2, wide);
+                uint64_t wide_coded = saved_wide_size(wide) + size % 2 +
+                                      stream_table_size(streams) +
+                                      (build_wide_codes(wide) + 7) / 8;
+                use_wide = (wide_coded < coded);
+                use_contexts = use_contexts && !use_wide;
+                coded = std::min(coded, wide_coded);
+            }
+            if (coded * 100 > uint64_t(size) * (100 - options.store_margin)) {
+                dest[0] = BLOCK_STORED;
+                put_le(dest + 1, size, 4);
+                put_le(dest + 5, size, 4);
+                std::memcpy(dest + BLOCK_HEADER_SIZE, data, size);
+                tables = BLOCK_HEADER_SIZE;
+                return BLOCK_HEADER_SIZE + size;
+            }
+
+            unsigned char* const end = dest + max_encoded_block_size(size);
+            if (use_wide) {
+                HUFFMAN_STATS_CALL(add_codes, wide);
+                tables = BLOCK_HEADER_SIZE + save_wide_codes(wide, dest + BLOCK_HEADER_SIZE);
+                if (size % 2) {
+                    dest[tables++] = data[size - 1];
+                }
+                dest[tables] = static_cast<unsigned char>(streams);
+                unsigned char* const stream_table = dest + tables + 1;
+                tables += stream_table_size(streams);
+
+                const size_t count = size / 2;
+                const size_t slice = (count + streams - 1) / streams;
+                size_t pos = tables;
+                for (size_t i = 0; i < streams; ++i) {
+                    const size_t begin = std::min(i * slice, count);
+                    const size_t stop = std::min(begin + slice, count);
+
+                    HuffmanFastBitWriter writer(dest + pos, end - dest - pos);
+                    write_wide_codes(writer, wide, data + 2 * begin, stop - begin);
+                    writer.flush();
+                    if (i + 1 < streams) {
+                        put_le(stream_table + 4 * i, writer.get_byte_cnt(), 4);
+                    }
+                    pos += writer.get_byte_cnt();
+                }
+                dest[0] = BLOCK_WIDE;
+                put_le(dest + 1, size, 4);
+                put_le(dest + 5, pos - BLOCK_HEADER_SIZE, 4);
+                return pos;
+            }
+            if (use_contexts) {
+                for (size_t i = 0; i < model.lengths.size(); ++i) {
+                    HUFFMAN_STATS_CALL(add_codes, model.frequencies[i], 
+                                       model.lengths[i]);
+                }
+                tables = BLOCK_HEADER_SIZE + 
+                         save_context_model(model, dest + BLOCK_HEADER_SIZE);
+                HuffmanFastBitWriter writer(dest + tables, end - dest - tables);
+                write_context_codes(writer, model, data, size, scratch.context);
+                writer.flush();
+                dest[0] = BLOCK_CONTEXT;
+                put_le(dest + 1, size, 4);
+                put_le(dest + 5, tables - BLOCK_HEADER_SIZE + writer.get_byte_cnt(), 4);
+                return tables + writer.get_byte_cnt();
+            }
+
+            HUFFMAN_STATS_CALL(add_codes, frequencies, lengths);
+            Codes codes(lengths);
+            tables = BLOCK_HEADER_SIZE + lengths.save(dest + BLOCK_HEADER_SIZE);
+            unsigned char* const stream_table = dest + tables + 1;
+            if (streams > 1) {
+                dest[tables] = static_cast<unsigned char>(streams);
+                tables += stream_table_size(streams);
+            }
+
+            const size_t slice = (size + streams - 1) / streams;
+            size_t pos = tables;
+            for (size_t i = 0; i < streams; ++i) {
+                const size_t begin = std::min(i * slice, size);
+                const size_t stop = std::min(begin + slice, size);
+
+                HuffmanFastBitWriter writer(dest + pos, end - dest - pos);
+                write_codes(writer, codes, lengths.max_length(), 
+                            data + begin, stop - begin);
+                writer.flush();
+                if (i + 1 < streams) {
+                    put_le(stream_table + 4 * i, writer.get_byte_cnt(), 4);
+                }
+                pos += writer.get_byte_cnt();
+            }
+
+            dest[0] = (streams > 1) ? BLOCK_HUFFMAN_STREAMS : BLOCK_HUFFMAN;
+            put_le(dest + 1, size, 4);
+            put_le(dest + 5, pos - BLOCK_HEADER_SIZE, 4);
+            return pos;
+        }
+
+        // `count` symbols from the streams laid one after another from
+        // `stream` on, with a DecodeTable or a WideDecodeTable
+        template <typename Table>
+        void decode_streams(const Table& table, const unsigned char* stream,
+                            const size_t* stream_sizes, size_t streams,
+                            unsigned char* dest, size_t count) {
+            HUFFMAN_STATS_PHASE(PHASE_CODE);
+            if (streams == 1) {
+                HuffmanFastBitReader reader(stream, stream_sizes[0]);
+                table.decode(reader, dest, count);
+                reader.check_bounds();
+                return;
+            }
+
+            std::optional<HuffmanFastBitReader> readers[HuffmanArchiver::MAX_STREAMS];
+            HuffmanFastBitReader* reader_ptrs[HuffmanArchiver::MAX_STREAMS];
+            for (size_t i = 0; i < streams; ++i) {
+                reader_ptrs[i] = &readers[i].emplace(stream, stream_sizes[i]);
+                stream += stream_sizes[i];
+            }
+            table.decode(reader_ptrs, streams, dest, count);
+            for (size_t i = 0; i < streams; ++i) {
+                readers[i]->check_bounds();
+            }
+        }
+
+        size_t decode_body(const BlockHeader& header,
+                           const unsigned char* body, unsigned char* dest,
+                           BlockScratch& scratch) {
+            if (header.type == BLOCK_STORED) {
+                if (header.body_size != header.raw_size) {
+                    throw HuffmanArchiver::IO_error("wrong block header");
+                }
+                if (header.raw_size != 0) { // else `dest` may be null
+                    std::memcpy(dest, body, header.raw_size);
+                }
+                return 0;
+            }
+            if (header.type == BLOCK_RLE) { // runs are never empty
+                if (header.body_size != 1 || header.raw_size == 0) {
+                    throw HuffmanArchiver::IO_error("wrong block header");
+                }
+                std::memset(dest, body[0], header.raw_size);
+                return 1;
+            }
+            if (header.type == BLOCK_CONTEXT) {
+                ContextModel& model = scratch.model;
+                size_t tables = load_context_model(body, header.body_size, model);
+                HuffmanFastBitReader reader(body + tables, header.body_size - tables);
+                read_context_codes(reader, model, scratch.context_tables,
+                                   dest, header.raw_size);
+                reader.check_bounds();
+                return tables;
+            }
+            const bool wide = (header.type == BLOCK_WIDE);
+            if (header.type != BLOCK_HUFFMAN && 
+                    header.type != BLOCK_HUFFMAN_STREAMS && !wide) {
+                throw HuffmanArchiver::IO_error("unknown block type");
+            }
+            CodeLengths lengths;
+            size_t tables;
+            if (wide) {
+                tables = load_wide_codes(body, header.body_size,
+                                         header.raw_size / 2, scratch.wide);
+                if (header.raw_size % 2) {
+                    if (tables == header.body_size) {
+                        throw HuffmanArchiver::IO_error("wrong block header");
+                    }
+                    dest[header.raw_size - 1] = body[tables++];
+                }
+            } else {
+                tables = lengths.load_saved(body, header.body_size);
+            }
+
+            size_t streams = 1;
+            size_t stream_sizes[HuffmanArchiver::MAX_STREAMS];
+            if (header.type != BLOCK_HUFFMAN) {
+                streams = (tables < header.body_size) ? body[tables] : 0;
+                if (streams < (wide ? 1 : 2) || streams > HuffmanArchiver::MAX_STREAMS ||
+                        header.body_size - tables - 1 < 4 * (streams - 1)) {
+                    throw HuffmanArchiver::IO_error("wrong block header");
+                }
+                for (size_t i = 0; i + 1 < streams; ++i) {
+                    stream_sizes[i] = get_le(body + tables + 1 + 4 * i, 4);
+                }
+                tables += stream_table_size(streams);
+            }
+            size_t left = header.body_size - tables;
+            for (size_t i = 0; i + 1 < streams; ++i) {
+                if (stream_sizes[i] > left) {
+                    throw HuffmanArchiver::IO_error("wrong block header");
+                }
+                left -= stream_sizes[i];
+            }
+            stream_sizes[streams - 1] = left;
+
+            if (wide) {
+                decode_streams(scratch.wide.table, body + tables, stream_sizes,
+                               streams, dest, header.raw_size / 2);
+            } else {
+                decode_streams(lengths_table(scratch, lengths,
+                                       DecodeTable::lookup_bits_for(
+                                               header.raw_size, lengths.max_length())),
+                               body + tables, stream_sizes, streams,
+                               dest, header.raw_size);
+            }
+            return tables;
+        }
+    }
+
+    size_t encode_block(const unsigned char* data, size_t size,
+                        const HuffmanArchiver::Options& options,
+                        unsigned char* dest, size_t& tables) {
+        BlockScratch scratch;
+        return encode_block(data, size, options, dest, tables, scratch);
+    }
+
+    size_t encode_block(const unsigned char* data, size_t size,
+                        const HuffmanArchiver::Options& options,
+                        unsigned char* dest, size_t& tables,
+                        BlockScratch& scratch) {
+        size_t written = encode_body(data, size, options, dest, tables, scratch);
+        if (options.checksum) {
+            put_le(dest + written, crc32c(0, data, size), CHECKSUM_SIZE);
+            written += CHECKSUM_SIZE;
+            tables += CHECKSUM_SIZE;
+        }
+        return written;
+    }
+
+    const DecodeTable& lengths_table(BlockScratch& scratch,
+                                     const CodeLengths& lengths,
+                                     unsigned lookup_bits) {
+        if (scratch.cache != nullptr) {
+            scratch.cached = scratch.cache->table(lengths, lookup_bits);
+            return *scratch.cached;
+        }
+        scratch.table.rebuild(Codes(lengths), lookup_bits);
+        return scratch.table;
+    }
+
+    size_t decode_block(const BlockHeader& header, const unsigned char* body,
+                        unsigned char* dest, const unsigned char* checksum,
+                        BlockScratch& scratch) {
+        size_t tables = decode_body(header, body, dest, scratch);
+        if (checksum != nullptr && 
+                crc32c(0, dest, header.raw_size) != get_le(checksum, CHECKSUM_SIZE)) {
+            throw HuffmanArchiver::IO_error("checksum mismatch");
+        }
+        return tables;
+    }
+
+    void encode_blocks(std::istream& in, std::ostream& out,
+                       const HuffmanArchiver::Options& options,
+                       uint64_t& in_size, uint64_t& out_size,
+                       uint64_t& header_size) {
+        unsigned char archive_header[ARCHIVE_HEADER_SIZE];
+        put_archive_header(archive_header, options);
+        write_bytes(out, archive_header, ARCHIVE_HEADER_SIZE);
+
+        in_size = 0;
+        out_size = ARCHIVE_HEADER_SIZE;
+        header_size = ARCHIVE_HEADER_SIZE;
+
+        ThreadPool pool(options.threads);
+        const size_t width = pool.size();
+        std::vector<uint64_t> offsets;
+        std::uint32_t checksum = 0;
+        // batch k is coded while k + 1 is read and k - 1 written
+        EncodeBatch batches[3];
+        IoThread reader;
+        IoThread writer;
+
+        reader.start([&in, &batches, width, &options]() {
+            read_batch(in, batches[0], width, options.block_size);
+        });
+        for (size_t k = 0; ; ++k) {
+            reader.wait();
+            EncodeBatch* batch = &batches[k % 3];
+            if (!batch->eof) {
+                EncodeBatch* next = &batches[(k + 1) % 3];
+                reader.start([&in, next, width, &options]() {
+                    read_batch(in, *next, width, options.block_size);
+                });
+            }
+
+            pool.run(batch->filled, [batch, &options](size_t i) {
+                std::vector<unsigned char>& block = batch->blocks[i];
+                block.resize(max_encoded_block_size(batch->raw_sizes[i]));
+                block.resize(encode_block(batch->raws[i].data(), 
+                                          batch->raw_sizes[i], options, 
+                                          block.data(), batch->tables[i]));
+            });
+
+            writer.wait();
+            writer.start([&out, batch, &options, &offsets, &checksum,
+                          &in_size, &out_size, &header_size]() {
+                for (size_t i = 0; i < batch->filled; ++i) {
+                    const std::vector<unsigned char>& block = batch->blocks[i];
+                    if (options.index) {
+                        offsets.push_back(out_size);
+                    }
+                    if (options.checksum) {
+                        checksum = crc32c_combine(checksum, 
+                                get_le(block.data() + block.size() - CHECKSUM_SIZE,
+                                       CHECKSUM_SIZE),
+                                batch->raw_sizes[i]);
+                    }
+                    write_bytes(out, block.data(), block.size());
+                    in_size += batch->raw_sizes[i];
+                    out_size += batch->blocks[i].size();
+                    header_size += batch->tables[i];
+                }
+            });
+            if (batch->eof) {
+                break;
+            }
+        }
+        writer.wait();
+
+        unsigned char end_mark[1 + CHECKSUM_SIZE] = {BLOCK_END};
+        const size_t end_size = options.checksum ? 1 + CHECKSUM_SIZE : 1;
+        put_le(end_mark + 1, checksum, CHECKSUM_SIZE);
+        write_bytes(out, end_mark, end_size);
+        out_size += end_size;
+        header_size += end_size;
+
+        if (options.index) {
+            std::vector<unsigned char> index(index_size(offsets.size()));
+            put_index(index.data(), offsets, in_size);
+            write_bytes(out, index.data(), index.size());
+            out_size += index.size();
+            header_size += index.size();
+        }
+    }
+
+    void decode_blocks(std::istream& in, std::ostream& out,
+                       const HuffmanArchiver::Options& options,
+                       uint64_t& in_size, uint64_t& out_size,
+                       uint64_t& header_size) {
+        int flags = in.get();
+        size_t block_size = read_le(in, 4);
+        if ((flags & ~KNOWN_FLAGS) != 0 || block_size == 0 || 
+                block_size > HuffmanArchiver::MAX_BLOCK_SIZE) {
+            throw HuffmanArchiver::IO_error("wrong header");
+        }
+        const size_t checksum_size = (flags & FLAG_CHECKSUM) ? CHECKSUM_SIZE : 0;
+        std::uint32_t checksum = 0;
+
+        in_size = ARCHIVE_HEADER_SIZE;
+        out_size = 0;
+        header_size = ARCHIVE_HEADER_SIZE;
+
+        uint64_t block_cnt = 0;
+        ThreadPool pool(options.threads);
+        const size_t width = pool.size();
+        // as in encode_blocks
+        DecodeBatch batches[3];
+        IoThread reader;
+        IoThread writer;
+
+        reader.start([&in, &batches, width, block_size, checksum_size]() {
+            read_batch(in, batches[0], width, block_size, checksum_size);
+        });
+        for (size_t k = 0; ; ++k) {
+            reader.wait();
+            DecodeBatch* batch = &batches[k % 3];
+            in_size += batch->read;
+            block_cnt += batch->filled;
+            if (batch->end) {
+                header_size++;
+            } else {
+                DecodeBatch* next = &batches[(k + 1) % 3];
+                reader.start([&in, next, width, block_size, checksum_size]() {
+                    read_batch(in, *next, width, block_size, checksum_size);
+                });
+            }
+
+            pool.run(batch->filled, [batch, checksum_size, &options](size_t i) {
+                const BlockHeader& header = batch->headers[i];
+                const unsigned char* body = batch->bodies[i].data();
+                BlockScratch scratch;
+                scratch.cache = options.table_cache;
+                batch->tables[i] = decode_block(header, body, batch->raws[i].data(),
+                        checksum_size ? body + header.body_size : nullptr,
+                        scratch);
+            });
+
+            writer.wait();
+            writer.start([&out, batch, checksum_size, &checksum,
+                          &out_size, &header_size]() {
+                for (size_t i = 0; i < batch->filled; ++i) {
+                    const BlockHeader& header = batch->headers[i];
+                    write_bytes(out, batch->raws[i].data(), 
+                                batch->raws[i].size());
+                    if (checksum_size) {
+                        checksum = crc32c_combine(checksum, 
+                                get_le(batch->bodies[i].data() + header.body_size,
+                                       CHECKSUM_SIZE),
+                                header.raw_size);
+                    }
+                    out_size += header.raw_size;
+                    header_size += BLOCK_HEADER_SIZE + batch->tables[i] + 
+                                   checksum_size;
+                }
+            });
+            if (batch->end) {
+                break;
+            }
+        }
+        writer.wait();
+
+        if (checksum_size) {
+            unsigned char stored[CHECKSUM_SIZE];
+            if (read_full(in, stored, CHECKSUM_SIZE) != CHECKSUM_SIZE) {
+                throw HuffmanArchiver::IO_error("read error");
+            }
+            if (get_le(stored, CHECKSUM_SIZE) != checksum) {
+                throw HuffmanArchiver::IO_error("checksum mismatch");
+            }
+            in_size += CHECKSUM_SIZE;
+            header_size += CHECKSUM_SIZE;
+        }
+
+        if (flags & FLAG_INDEX) { // nothing to use it for, just check it
+            std::vector<unsigned char> index(index_size(block_cnt));
+            if (read_full(in, index.data(), index.size()) != index.size() ||
+                    get_le(index.data() + 8 * block_cnt, 8) != block_cnt ||
+                    get_le(index.data() + 8 * block_cnt + 8, 8) != out_size ||
+                    get_le(index.data() + index.size() - 4, 4) != INDEX_MAGIC) {
+                throw HuffmanArchiver::IO_error("wrong index");
+            }
+            in_size += index.size();
+            header_size += index.size();
+        }
+    }
+
+    void decode_range(std::istream& in, uint64_t offset, uint64_t length,
+                      std::ostream& out, uint64_t& in_size,
+                      uint64_t& header_size) {
+        int flags = in.get();
+        size_t block_size = read_le(in, 4);
+        if ((flags & ~KNOWN_FLAGS) != 0 || block_size == 0 || 
+                block_size > HuffmanArchiver::MAX_BLOCK_SIZE) {
+            throw HuffmanArchiver::IO_error("wrong header");
+        }
+        if (!(flags & FLAG_INDEX)) {
+            throw HuffmanArchiver::IO_error("archive has no index");
+        }
+        const size_t checksum = (flags & FLAG_CHECKSUM) ? CHECKSUM_SIZE : 0;
+
+        in.seekg(-static_cast<std::streamoff>(INDEX_TRAILER_SIZE), std::ios::end);
+        const std::streamoff trailer_pos = in.tellg();
+        unsigned char trailer[INDEX_TRAILER_SIZE];
+        if (in.fail() || 
+                read_full(in, trailer, INDEX_TRAILER_SIZE) != INDEX_TRAILER_SIZE ||
+                get_le(trailer + 16, 4) != INDEX_MAGIC) {
+            throw HuffmanArchiver::IO_error("wrong index");
+        }
+        const uint64_t block_cnt = get_le(trailer, 8);
+        const uint64_t raw_size = get_le(trailer + 8, 8);
+        if (block_cnt != (raw_size + block_size - 1) / block_size ||
+                block_cnt > uint64_t(trailer_pos) / 8) {
+            throw HuffmanArchiver::IO_error("wrong index");
+        }
+        if (offset > raw_size || length > raw_size - offset) {
+            throw std::out_of_range("range past the end of the data");
+        }
+
+        in_size = ARCHIVE_HEADER_SIZE + INDEX_TRAILER_SIZE;
+        header_size = in_size;
+        if (length == 0) {
+            return;
+        }
+
+        // the entries of just the blocks needed
+        const uint64_t first = offset / block_size;
+        const uint64_t last = (offset + length - 1) / block_size;
+        std::vector<unsigned char> entries(8 * (last - first + 1));
+        in.seekg(trailer_pos - static_cast<std::streamoff>(8 * (block_cnt - first)));
+        if (in.fail() || 
+                read_full(in, entries.data(), entries.size()) != entries.size()) {
+            throw HuffmanArchiver::IO_error("wrong index");
+        }
+        in_size += entries.size();
+        header_size += entries.size();
+
+        std::vector<unsigned char> body;
+        std::vector<unsigned char> raw;
+        BlockScratch scratch;
+        for (uint64_t i = first; i <= last; ++i) {
+            in.seekg(get_le(entries.data() + 8 * (i - first), 8));
+            unsigned char block_header[BLOCK_HEADER_SIZE];
+            if (in.fail() || read_full(in, block_header, BLOCK_HEADER_SIZE) != 
+                                     BLOCK_HEADER_SIZE) {
+                throw HuffmanArchiver::IO_error("wrong index");
+            }
+            BlockHeader header;
+            header.type = block_header[0];
+            header.raw_size = get_le(block_header + 1, 4);
+            header.body_size = get_le(block_header + 5, 4);
+            const uint64_t raw_offset = i * block_size;
+            if (header.type == BLOCK_END || 
+                    header.raw_size != std::min<uint64_t>(block_size, 
+                                                          raw_size - raw_offset) ||
+                    header.body_size > max_body_size(block_size)) {
+                throw HuffmanArchiver::IO_error("wrong index");
+            }
+
+            body.resize(header.body_size + checksum);
+            if (read_full(in, body.data(), body.size()) != body.size()) {
+                throw HuffmanArchiver::IO_error("read error");
+            }
+            raw.resize(header.raw_size);
+            header_size += BLOCK_HEADER_SIZE + checksum + 
+                           decode_block(header, body.data(), raw.data(),
+                                        checksum ? body.data() + header.body_size 
+                                                 : nullptr, scratch);
+            in_size += BLOCK_HEADER_SIZE + body.size();
+
+            const uint64_t from = std::max(offset, raw_offset) - raw_offset;
+            const uint64_t to = std::min(offset + length, 
+                                         raw_offset + header.raw_size) - raw_offset;
+            write_bytes(out, raw.data() + from, to - from);
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#include <cstring>
+#include "huffman_impl_cache.h"
+
+using std::size_t;
+using std::uint64_t;
+
+namespace HuffmanImpl {
+
+    TableKey::TableKey(const HuffmanArchiver::CodeLengths& lengths_param,
+                       unsigned lookup_bits_param)
+        : hash(lookup_bits_param), lookup_bits(lookup_bits_param) {
+        for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+            lengths[i] = lengths_param[i];
+        }
+        // a word of lengths at a time, mixed as in splitmix64
+        for (size_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, lengths + i, 8);
+            hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+            hash ^= hash >> 31;
+        }
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+        hash ^= hash >> 31;
+    }
+
+    bool operator==(const TableKey& a, const TableKey& b) {
+        return a.hash == b.hash && a.lookup_bits == b.lookup_bits &&
+               std::memcmp(a.lengths, b.lengths, sizeof(a.lengths)) == 0;
+    }
+
+    TableCacheShard::TableCacheShard(size_t capacity_param)
+        : capacity(capacity_param) {}
+
+    TableCacheShard::Table TableCacheShard::find(const TableKey& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = by_hash.find(key.hash);
+        if (found == by_hash.end() || !(found->second->key == key)) {
+            return nullptr;
+        }
+        items.splice(items.begin(), items, found->second);
+        return found->second->table;
+    }
+
+    TableCacheShard::Table TableCacheShard::insert(const TableKey& key,
+                                                   const Table& table) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = by_hash.find(key.hash);
+        if (found != by_hash.end()) {
+            if (found->second->key == key) {
+                items.splice(items.begin(), items, found->second);
+                return found->second->table;
+            }
+            // another table with the same hash, the newer one stays
+            items.erase(found->second);
+            by_hash.erase(found);
+        }
+        items.push_front(Item{key, table});
+        by_hash[key.hash] = items.begin();
+        if (items.size() > capacity) {
+            by_hash.erase(items.back().key.hash);
+            items.pop_back();
+        }
+        return table;
+    }
+
+    size_t TableCacheShard::size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+    }
+
+    void TableCacheShard::clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        by_hash.clear();
+        items.clear();
+    }
+}
@@ -0,0 +1,262 @@
+#include <cmath>
+#include <algorithm>
+#include "huffman_impl_context.h"
+#include "huffman_impl_io.h"
+#include "huffman_impl_table.h"
+#include "huffman_impl_stats.h"
+
+using std::size_t;
+using std::uint64_t;
+using HuffmanArchiver::NUM_OF_BYTES;
+using HuffmanArchiver::Frequencies;
+using HuffmanArchiver::CodeLengths;
+using HuffmanArchiver::Codes;
+
+namespace HuffmanImpl {
+
+    namespace {
+        // rounds of regrouping; later ones rarely move anything
+        const size_t CLUSTER_ROUNDS = 6;
+
+        typedef ContextScratch::Count Count;
+
+        // The bits a byte would take under each group's statistics,
+        // bytes a group hasn't seen priced as slightly rarer than its
+        // rarest, so a context can still move there.
+        void group_costs(const std::vector<uint64_t>& sums, size_t groups,
+                         std::vector<double>& costs) {
+            costs.resize(groups * NUM_OF_BYTES);
+            for (size_t g = 0; g < groups; ++g) {
+                const uint64_t* sum = sums.data() + g * NUM_OF_BYTES;
+                uint64_t total = 0;
+                for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+                    total += sum[i];
+                }
+                const double scale = std::log2(total + 0.5 * NUM_OF_BYTES);
+                for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+                    costs[g * NUM_OF_BYTES + i] = scale - std::log2(sum[i] + 0.5);
+                }
+            }
+        }
+    }
+
+    void build_context_model(const unsigned char* data, size_t size,
+                             size_t max_groups, size_t max_code_length,
+                             ContextModel& model, ContextScratch& scratch,
+                             LengthScratch& lengths) {
+        std::fill(model.groups, model.groups + NUM_OF_BYTES, 0);
+        model.bits = 0;
+
+        std::vector<Count>* const follows = scratch.follows;
+        uint64_t totals[NUM_OF_BYTES] = {};
+        {
+            HUFFMAN_STATS_PHASE(PHASE_COUNT);
+            std::vector<std::uint32_t>& counts = scratch.counts;
+            counts.assign(NUM_OF_BYTES * NUM_OF_BYTES, 0);
+            unsigned char previous = 0;
+            for (size_t i = 0; i < size; ++i) {
+                counts[previous << 8 | data[i]]++;
+                previous = data[i];
+            }
+            for (size_t c = 0; c < NUM_OF_BYTES; ++c) {
+                follows[c].clear();
+                for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+                    if (std::uint32_t count = counts[c << 8 | i]) {
+                        follows[c].push_back(Count{
+                                static_cast<unsigned char>(i), count});
+                        totals[c] += count;
+                    }
+                }
+            }
+        }
+
+        HUFFMAN_STATS_PHASE(PHASE_BUILD);
+        // the busiest contexts seed the groups, ties in byte order
+        // (which std::stable_sort would allocate a buffer to keep)
+        std::vector<size_t>& seen = scratch.seen;
+        seen.clear();
+        for (size_t c = 0; c < NUM_OF_BYTES; ++c) {
+            if (totals[c] != 0) {
+                seen.push_back(c);
+            }
+        }
+        std::sort(seen.begin(), seen.end(), [&totals](size_t a, size_t b) {
+            return totals[a] > totals[b] || (totals[a] == totals[b] && a < b);
+        });
+        size_t groups = std::max<size_t>(1, std::min(max_groups, seen.size()));
+        std::vector<uint64_t>& sums = scratch.sums;
+        sums.assign(groups * NUM_OF_BYTES, 0);
+        for (size_t g = 0; g < groups && g < seen.size(); ++g) {
+            for (const Count& follow: follows[seen[g]]) {
+                sums[g * NUM_OF_BYTES + follow.symbol] += follow.count;
+            }
+        }
+
+        // k-means over the contexts, a context's distance to a group
+        // being what its bytes would cost coded with the group's codes
+        std::vector<double>& costs = scratch.costs;
+        for (size_t round = 0; round < CLUSTER_ROUNDS; ++round) {
+            group_costs(sums, groups, costs);
+            bool moved = false;
+            for (size_t c: seen) {
+                size_t best = 0;
+                double best_cost = HUGE_VAL;
+                for (size_t g = 0; g < groups; ++g) {
+                    const double* cost = costs.data() + g * NUM_OF_BYTES;
+                    double total = 0;
+                    for (const Count& follow: follows[c]) {
+                        total += follow.count * cost[follow.symbol];
+                    }
+                    if (total < best_cost) {
+                        best_cost = total;
+                        best = g;
+                    }
+                }
+                moved = moved || (round == 0) || (model.groups[c] != best);
+                model.groups[c] = static_cast<unsigned char>(best);
+            }
+            if (!moved) {
+                break;
+            }
+
+            // regroup, dropping groups no context chose
+            size_t renumbered[HuffmanArchiver::MAX_CONTEXT_GROUPS];
+            size_t used = 0;
+            std::fill(sums.begin(), sums.end(), 0);
+            for (size_t g = 0; g < groups; ++g) {
+                renumbered[g] = groups;
+            }
+            for (size_t c: seen) {
+                size_t& g = renumbered[model.groups[c]];
+                if (g == groups) {
+                    g = used++;
+                }
+                model.groups[c] = static_cast<unsigned char>(g);
+                for (const Count& follow: follows[c]) {
+                    sums[g * NUM_OF_BYTES + follow.symbol] += follow.count;
+                }
+            }
+            groups = used;
+            sums.resize(groups * NUM_OF_BYTES);
+        }
+
+        model.frequencies.resize(groups);
+        model.lengths.resize(groups);
+        for (size_t g = 0; g < groups; ++g) {
+            Frequencies& frequencies = model.frequencies[g];
+            for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+                frequencies[i] = sums[g * NUM_OF_BYTES + i];
+            }
+            code_lengths(frequencies, max_code_length, model.lengths[g], lengths);
+            for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+                model.bits += frequencies[i] * model.lengths[g][i];
+            }
+        }
+    }
+
+    size_t saved_size(const ContextModel& model) {
+        size_t size = CONTEXT_MAP_SIZE;
+        for (const CodeLengths& lengths: model.lengths) {
+            size += lengths.saved_size();
+        }
+        return size;
+    }
+
+    size_t save_context_model(const ContextModel& model, unsigned char* dest) {
+        dest[0] = static_cast<unsigned char>(model.lengths.size());
+        for (size_t i = 0; i < NUM_OF_BYTES / 2; ++i) {
+            dest[1 + i] = model.groups[2 * i] | (model.groups[2 * i + 1] << 4);
+        }
+        size_t pos = CONTEXT_MAP_SIZE;
+        for (const CodeLengths& lengths: model.lengths) {
+            pos += lengths.save(dest + pos);
+        }
+        return pos;
+    }
+
+    size_t load_context_model(const unsigned char* data, size_t size,
+                              ContextModel& model) {
+        const size_t groups = (size != 0) ? data[0] : 0;
+        if (size < CONTEXT_MAP_SIZE || groups == 0 ||
+                groups > HuffmanArchiver::MAX_CONTEXT_GROUPS) {
+            throw HuffmanArchiver::IO_error("wrong block header");
+        }
+        for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+            model.groups[i] = (data[1 + i / 2] >> (4 * (i % 2))) & 0x0F;
+            if (model.groups[i] >= groups) {
+                throw HuffmanArchiver::IO_error("wrong block header");
+            }
+        }
+        size_t pos = CONTEXT_MAP_SIZE;
+        model.lengths.resize(groups);
+        for (CodeLengths& lengths: model.lengths) {
+            pos += lengths.load_saved(data + pos, size - pos);
+        }
+        return pos;
+    }
+
+    void write_context_codes(HuffmanFastBitWriter& writer,
+                             const ContextModel& model,
+                             const unsigned char* data, size_t size,
+                             ContextScratch& scratch) {
+        // one flat table, the row picked by the previous byte's group
+        std::vector<HuffmanArchiver::Codeword>& codewords = scratch.codewords;
+        codewords.clear();
+        size_t max_length = 0;
+        for (const CodeLengths& lengths: model.lengths) {
+            Codes codes(lengths);
+            for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+                codewords.push_back(codes[i]);
+            }
+            max_length = std::max(max_length, lengths.max_length());
+        }
+        size_t rows[NUM_OF_BYTES];
+        for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+            rows[i] = model.groups[i] * NUM_OF_BYTES;
+        }
+
+        HUFFMAN_STATS_PHASE(PHASE_CODE);
+        const HuffmanArchiver::Codeword* const table = codewords.data();
+        unsigned char previous = 0;
+        if (max_length <= 32) {
+            for (size_t i = 0; i < size; ++i) {
+                const HuffmanArchiver::Codeword& codeword =
+                        table[rows[previous] + data[i]];
+                writer.write_short(codeword.code, codeword.length);
+                previous = data[i];
+            }
+        } else {
+            for (size_t i = 0; i < size; ++i) {
+                const HuffmanArchiver::Codeword& codeword =
+                        table[rows[previous] + data[i]];
+                writer.write(codeword.code, codeword.length);
+                previous = data[i];
+            }
+        }
+    }
+
+    void read_context_codes(HuffmanFastBitReader& reader,
+                            const ContextModel& model,
+                            std::vector<DecodeTable>& tables,
+                            unsigned char* dest, size_t count) {
+        size_t max_length = 0;
+        for (const CodeLengths& lengths: model.lengths) {
+            max_length = std::max(max_length, lengths.max_length());
+        }
+        // each table sees about its share of the block
+        const unsigned lookup_bits = DecodeTable::lookup_bits_for(
+                count / model.lengths.size(), max_length);
+        const size_t groups = model.lengths.size();
+        if (tables.size() < groups) {
+            tables.resize(groups);
+        }
+        for (size_t g = 0; g < groups; ++g) {
+            tables[g].rebuild(Codes(model.lengths[g]), lookup_bits, false);
+        }
+        DecodeTable::pair_contexts(tables.data(), groups, model.groups);
+
+        HUFFMAN_STATS_PHASE(PHASE_CODE);
+        DecodeTable::decode_contexts(tables.data(), model.groups,
+                                     reader, dest, count);
+    }
+}
@@ -0,0 +1,160 @@
+#include <cstring>
+#include "huffman_impl_crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+using std::size_t;
+using std::uint32_t;
+using std::uint64_t;
+
+namespace HuffmanImpl {
+
+    namespace {
+        // reflected Castagnoli polynomial
+        const uint32_t POLYNOMIAL = 0x82F63B78;
+
+        // slicing by 8: tables[k][b] is the CRC of byte b followed by
+        // k zero bytes
+        struct Tables {
+            uint32_t tables[8][256];
+
+            Tables() {
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t crc = i;
+                    for (int j = 0; j < 8; ++j) {
+                        crc = (crc & 1) ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+                    }
+                    tables[0][i] = crc;
+                }
+                for (uint32_t i = 0; i < 256; ++i) {
+                    for (int k = 1; k < 8; ++k) {
+                        uint32_t prev = tables[k - 1][i];
+                        tables[k][i] = (prev >> 8) ^ tables[0][prev & 0xFF];
+                    }
+                }
+            }
+        };
+
+        const Tables& tables() {
+            static const Tables instance;
+            return instance;
+        }
+
+        uint32_t crc32c_tables(uint32_t crc, const unsigned char* data,
+                               size_t size) {
+            const uint32_t (*t)[256] = tables().tables;
+            while (size >= 8) {
+                uint32_t low;
+                uint32_t high;
+                std::memcpy(&low, data, 4);
+                std::memcpy(&high, data + 4, 4);
+                low ^= crc; // little-endian, as x86 and arm both are
+                crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^
+                      t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+                      t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^
+                      t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+                data += 8;
+                size -= 8;
+            }
+            while (size-- > 0) {
+                crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+            }
+            return crc;
+        }
+
+        uint32_t multiply(uint32_t a, uint32_t b);
+        uint32_t shift_by(uint64_t bytes);
+
+#if defined(__x86_64__)
+        // Below this a buffer goes through one chain of crc32s; above it
+        // through three, which the CPU overlaps, joined at the end.
+        const size_t LANES_MIN_SIZE = 1 << 14;
+
+        __attribute__((target("sse4.2")))
+        uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data,
+                              size_t size) {
+            uint64_t wide = crc;
+            while (size >= 8) {
+                uint64_t word;
+                std::memcpy(&word, data, 8);
+                wide = _mm_crc32_u64(wide, word);
+                data += 8;
+                size -= 8;
+            }
+            crc = static_cast<uint32_t>(wide);
+            while (size-- > 0) {
+                crc = _mm_crc32_u8(crc, *data++);
+            }
+            return crc;
+        }
+
+        __attribute__((target("sse4.2")))
+        uint32_t crc32c_sse42_lanes(uint32_t crc, const unsigned char* data,
+                                    size_t size) {
+            const size_t lane = size / 3 / 8 * 8;
+            uint64_t a = crc;
+            uint64_t b = 0xFFFFFFFF;
+            uint64_t c = 0xFFFFFFFF;
+            for (size_t i = 0; i < lane; i += 8) {
+                uint64_t words[3];
+                std::memcpy(&words[0], data + i, 8);
+                std::memcpy(&words[1], data + lane + i, 8);
+                std::memcpy(&words[2], data + 2 * lane + i, 8);
+                a = _mm_crc32_u64(a, words[0]);
+                b = _mm_crc32_u64(b, words[1]);
+                c = _mm_crc32_u64(c, words[2]);
+            }
+            // as finished checksums the lanes combine like any others
+            const uint32_t shift = shift_by(lane);
+            crc = ~static_cast<uint32_t>(a);
+            crc = multiply(shift, crc) ^ ~static_cast<uint32_t>(b);
+            crc = multiply(shift, crc) ^ ~static_cast<uint32_t>(c);
+            return crc32c_sse42(~crc, data + 3 * lane, size - 3 * lane);
+        }
+
+        const bool HAS_SSE42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+        // a * b modulo the polynomial, both reflected
+        uint32_t multiply(uint32_t a, uint32_t b) {
+            uint32_t product = 0;
+            for (uint32_t mask = uint32_t(1) << 31; mask != 0; mask >>= 1) {
+                if (a & mask) {
+                    product ^= b;
+                }
+                b = (b & 1) ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+            }
+            return product;
+        }
+
+        // x^(8 * bytes) modulo the polynomial, by squaring
+        uint32_t shift_by(uint64_t bytes) {
+            uint32_t result = uint32_t(1) << 31; // x^0
+            uint32_t power = uint32_t(1) << 23;  // x^8
+            for (; bytes != 0; bytes >>= 1) {
+                if (bytes & 1) {
+                    result = multiply(power, result);
+                }
+                power = multiply(power, power);
+            }
+            return result;
+        }
+    }
+
+    uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t size) {
+        crc = ~crc;
+#if defined(__x86_64__)
+        if (HAS_SSE42) {
+            return ~((size < LANES_MIN_SIZE) ? crc32c_sse42(crc, data, size)
+                                             : crc32c_sse42_lanes(crc, data, size));
+        }
+#endif
+        return ~crc32c_tables(crc, data, size);
+    }
+
+    uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t size_b) {
+        return multiply(shift_by(size_b), crc_a) ^ crc_b;
+    }
+}
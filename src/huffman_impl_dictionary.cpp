@@ -0,0 +1,57 @@
+#include <algorithm>
+#include "huffman_impl_dictionary.h"
+#include "huffman_impl_io.h"
+#include "huffman_impl_stats.h"
+
+using std::size_t;
+using std::uint64_t;
+using HuffmanArchiver::Dictionary;
+
+namespace HuffmanImpl {
+
+    const Dictionary& find_dictionary(const HuffmanArchiver::Options& options,
+                                      std::uint32_t id) {
+        if (options.dictionary == nullptr) {
+            throw HuffmanArchiver::IO_error("archive needs a dictionary");
+        }
+        if (options.dictionary->id() != id) {
+            throw HuffmanArchiver::IO_error("archive needs another dictionary");
+        }
+        return *options.dictionary;
+    }
+
+    size_t max_dictionary_archive_size(size_t size, 
+                                       const Dictionary& dictionary) {
+        return DICTIONARY_PREFIX_SIZE + MAX_VARINT_SIZE + 
+               (size * dictionary.lengths().max_length() + 7) / 8 + 4;
+    }
+
+    size_t encode_with_dictionary(const unsigned char* data, size_t size,
+                                  unsigned char* dest,
+                                  const Dictionary& dictionary,
+                                  uint64_t& header_size) {
+        std::copy(HuffmanArchiver::SIGNATURE, 
+                  HuffmanArchiver::SIGNATURE + HuffmanArchiver::SIGNATURE_SIZE,
+                  dest);
+        dest[HuffmanArchiver::SIGNATURE_SIZE] = HuffmanArchiver::FORMAT_DICTIONARY;
+        put_le(dest + HuffmanArchiver::SIGNATURE_SIZE + 1, dictionary.id(), 4);
+        header_size = DICTIONARY_PREFIX_SIZE + 
+                      put_varint(dest + DICTIONARY_PREFIX_SIZE, size);
+
+#if HUFFMAN_STATS
+        if (active_stats() != nullptr) { // costs a counting pass
+            HuffmanArchiver::Frequencies frequencies;
+            frequencies.add(data, size);
+            active_stats()->add_codes(frequencies, dictionary.lengths());
+        }
+#endif
+
+        HuffmanFastBitWriter writer(
+                dest + header_size, 
+                max_dictionary_archive_size(size, dictionary) - header_size);
+        write_codes(writer, dictionary.codes(), dictionary.lengths().max_length(),
+                    data, size);
+        writer.flush();
+        return header_size + writer.get_byte_cnt();
+    }
+}
@@ -0,0 +1,81 @@
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "huffman_impl_histogram.h"
+#include "huffman_impl_pool.h"
+#include "huffman.h"
+
+using std::size_t;
+using std::uint64_t;
+using HuffmanArchiver::NUM_OF_BYTES;
+
+namespace HuffmanImpl {
+
+    namespace {
+        const size_t TABLES = 4;
+        // each table sees at most a quarter of a chunk, so 32-bit
+        // counters can't overflow
+        const size_t CHUNK_SIZE = size_t(1) << 30;
+        // smaller slices aren't worth a thread
+        const size_t MIN_SLICE_SIZE = size_t(1) << 20;
+    }
+
+    void count_bytes(const unsigned char* data, size_t size, uint64_t* counts) {
+        std::uint32_t tables[TABLES][NUM_OF_BYTES];
+
+        while (size != 0) {
+            const size_t chunk = std::min(size, CHUNK_SIZE);
+            const unsigned char* pos = data;
+            const unsigned char* const end = data + chunk;
+            std::memset(tables, 0, sizeof(tables));
+
+            while (end - pos >= 8) {
+                uint64_t word;
+                std::memcpy(&word, pos, 8);
+                tables[0][word & 0xFF]++;
+                tables[1][(word >> 8) & 0xFF]++;
+                tables[2][(word >> 16) & 0xFF]++;
+                tables[3][(word >> 24) & 0xFF]++;
+                tables[0][(word >> 32) & 0xFF]++;
+                tables[1][(word >> 40) & 0xFF]++;
+                tables[2][(word >> 48) & 0xFF]++;
+                tables[3][word >> 56]++;
+                pos += 8;
+            }
+            while (pos != end) {
+                tables[0][*pos++]++;
+            }
+
+            for (size_t i = 0; i < NUM_OF_BYTES; ++i) {
+                counts[i] += uint64_t(tables[0][i]) + tables[1][i] +
+                             tables[2][i] + tables[3][i];
+            }
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    void count_bytes(const unsigned char* data, size_t size,
+                     uint64_t* counts, ThreadPool& pool) {
+        const size_t slices = std::max<size_t>(1, 
+                std::min(pool.size(), size / MIN_SLICE_SIZE));
+        if (slices == 1) {
+            count_bytes(data, size, counts);
+            return;
+        }
+
+        const size_t slice_size = (size + slices - 1) / slices;
+        std::vector<uint64_t> partial(slices * NUM_OF_BYTES, 0);
+        pool.run(slices, [&](size_t i) {
+            size_t offset = i * slice_size;
+            count_bytes(data + offset, std::min(slice_size, size - offset),
+                        partial.data() + i * NUM_OF_BYTES);
+        });
+
+        for (size_t i = 0; i < slices; ++i) {
+            for (size_t j = 0; j < NUM_OF_BYTES; ++j) {
+                counts[j] += partial[i * NUM_OF_BYTES + j];
+            }
+        }
+    }
+}
@@ -1,16 +1,134 @@
+#include <stdexcept>
 #include "huffman_impl_io.h"
+#include "huffman_impl_stats.h"
 
 namespace HuffmanImpl {
-    
-    HuffmanBitIO::HuffmanBitIO(std::ios& stream_param)
-            : stream(stream_param), buf(0), byte_cnt(0) {
+
+    std::size_t read_chunk(std::istream& in, unsigned char* dest,
+                           std::size_t size) {
+        HUFFMAN_STATS_PHASE(PHASE_IO);
+        std::streamsize got = 0;
+        try {
+            in.read(reinterpret_cast<char*>(dest), size);
+            got = in.gcount();
+        } catch (const std::istream::failure& excep) { // streams with exceptions turned on
+            if (!in.eof()) {
+                throw excep;
+            }
+            got = in.gcount();
+        }
+        if (got == 0 && !in.eof()) {
+            throw HuffmanArchiver::IO_error("read error");
+        }
+        HUFFMAN_STATS_CALL(add_read, got);
+        return got;
     }
-    
-    HuffmanBitIO::~HuffmanBitIO() {
+
+    namespace {
+        template <unsigned MAX_LENGTH>
+        void write_codes(HuffmanFastBitWriter& writer,
+                         const HuffmanArchiver::Codes& codes,
+                         const unsigned char* data, std::size_t size) {
+            std::size_t i = 0;
+            if (MAX_LENGTH <= 16) {
+                for (; i + 1 < size; i += 2) {
+                    unsigned second = codes.length(data[i + 1]);
+                    writer.write_short((codes.code(data[i]) << second) | 
+                                       codes.code(data[i + 1]),
+                                       codes.length(data[i]) + second);
+                }
+            }
+            for (; i < size; ++i) {
+                if (MAX_LENGTH <= 32) {
+                    writer.write_short(codes.code(data[i]), codes.length(data[i]));
+                } else {
+                    writer.write(codes.code(data[i]), codes.length(data[i]));
+                }
+            }
+        }
+    }
+
+    void write_codes(HuffmanFastBitWriter& writer,
+                     const HuffmanArchiver::Codes& codes, std::size_t max_length,
+                     const unsigned char* data, std::size_t size) {
+        HUFFMAN_STATS_PHASE(PHASE_CODE);
+        if (max_length <= 16) {
+            write_codes<16>(writer, codes, data, size);
+        } else if (max_length <= 32) {
+            write_codes<32>(writer, codes, data, size);
+        } else {
+            write_codes<HuffmanArchiver::Codes::MAX_CODE_LENGTH>(
+                    writer, codes, data, size);
+        }
+    }
+
+    void put_le(unsigned char* dest, std::uint64_t value, std::size_t bytes) {
+        for (std::size_t i = 0; i < bytes; ++i) {
+            dest[i] = static_cast<unsigned char>(value >> (8 * i));
+        }
     }
 
-    std::uint64_t HuffmanBitIO::get_byte_cnt() const {
-        return byte_cnt;
+    std::uint64_t get_le(const unsigned char* data, std::size_t bytes) {
+        std::uint64_t value = 0;
+        for (std::size_t i = bytes; i-- > 0; ) {
+            value = (value << 8) | data[i];
+        }
+        return value;
+    }
+
+    std::size_t put_varint(unsigned char* dest, std::uint64_t value) {
+        std::size_t size = 0;
+        while (value >= 0x80) {
+            dest[size++] = static_cast<unsigned char>(value | 0x80);
+            value >>= 7;
+        }
+        dest[size++] = static_cast<unsigned char>(value);
+        return size;
+    }
+
+    std::size_t get_varint(const unsigned char* data, std::size_t size,
+                           std::uint64_t& value) {
+        value = 0;
+        for (std::size_t i = 0; i < size && i < MAX_VARINT_SIZE; ++i) {
+            value |= std::uint64_t(data[i] & 0x7F) << (7 * i);
+            if (!(data[i] & 0x80)) {
+                return i + 1;
+            }
+        }
+        throw HuffmanArchiver::IO_error("wrong header / read error");
+    }
+
+    std::uint64_t read_varint(std::istream& in) {
+        unsigned char buf[MAX_VARINT_SIZE];
+        std::size_t size = 0;
+        do {
+            int byte = in.get();
+            if (in.fail()) {
+                throw HuffmanArchiver::IO_error("wrong header / read error");
+            }
+            buf[size++] = static_cast<unsigned char>(byte);
+        } while ((buf[size - 1] & 0x80) && size < MAX_VARINT_SIZE);
+        std::uint64_t value;
+        get_varint(buf, size, value);
+        return value;
+    }
+
+    void write_le(std::ostream& out, std::uint64_t value, std::size_t bytes) {
+        unsigned char buf[8];
+        put_le(buf, value, bytes);
+        out.write(reinterpret_cast<char*>(buf), bytes);
+        if (out.fail()) {
+            throw HuffmanArchiver::IO_error("write error");
+        }
+    }
+
+    std::uint64_t read_le(std::istream& in, std::size_t bytes) {
+        unsigned char buf[8];
+        in.read(reinterpret_cast<char*>(buf), bytes);
+        if (in.fail()) {
+            throw HuffmanArchiver::IO_error("wrong header / read error");
+        }
+        return get_le(buf, bytes);
     }
     
     HuffmanBitWriter::HuffmanBitWriter(std::ostream& out_stream) 
@@ -23,10 +141,11 @@ namespace HuffmanImpl {
     }
 
     void HuffmanBitWriter::write(const HuffmanArchiver::Codeword& codeword) {
-        for (unsigned char bit: codeword) {
+        for (std::size_t i = codeword.length; i-- > 0; ) {
             if (pos == -1) {
                 flush();    
             }
+            unsigned char bit = (codeword.code >> i) & 1;
             buf ^= (bit << pos);
             --pos;
         }
@@ -34,8 +153,7 @@ namespace HuffmanImpl {
     
     void HuffmanBitWriter::flush() {
         if (pos != 7) {
-            dynamic_cast<std::ostream&>(stream).write(
-                reinterpret_cast<char*>(&buf), 1);
+            stream.write(reinterpret_cast<char*>(&buf), 1);
             if(stream.fail()) {
                 throw HuffmanArchiver::IO_error("write error");
             }
@@ -53,8 +171,7 @@ namespace HuffmanImpl {
 
     bool HuffmanBitReader::read(bool& value) {
         if (pos == -1) {
-            dynamic_cast<std::istream&>(stream).read(
-                reinterpret_cast<char*>(&buf), 1);
+            stream.read(reinterpret_cast<char*>(&buf), 1);
             if(stream.fail()) {
                 throw HuffmanArchiver::IO_error("read error");
             }
@@ -65,4 +182,90 @@ namespace HuffmanImpl {
         --pos;
         return static_cast<bool>(stream);
     }
+
+
+
+    HuffmanFastBitWriter::HuffmanFastBitWriter(std::ostream& out_stream)
+            : stream(&out_stream), buffer(BUFFER_SIZE),
+              begin(buffer.data()), pos(begin), limit(begin + buffer.size()),
+              bits(0), bit_cnt(0), byte_cnt(0) {
+    }
+
+    HuffmanFastBitWriter::HuffmanFastBitWriter(unsigned char* dest,
+                                               std::size_t capacity)
+            : stream(nullptr), begin(dest), pos(dest),
+              limit(dest + capacity / 4 * 4), 
+              bits(0), bit_cnt(0), byte_cnt(0) {
+    }
+
+    void HuffmanFastBitWriter::flush() {
+        while (bit_cnt > 0) {
+            *pos++ = static_cast<unsigned char>(bits >> 56);
+            bits <<= 8;
+            bit_cnt = (bit_cnt > 8) ? bit_cnt - 8 : 0;
+        }
+        if (stream != nullptr) {
+            drain();
+        }
+    }
+
+    void HuffmanFastBitWriter::drain() {
+        if (stream == nullptr) {
+            throw std::length_error("bit writer out of space");
+        }
+        HUFFMAN_STATS_PHASE(PHASE_IO);
+        std::size_t size = pos - begin;
+        stream->write(reinterpret_cast<char*>(begin), size);
+        if (stream->fail()) {
+            throw HuffmanArchiver::IO_error("write error");
+        }
+        HUFFMAN_STATS_CALL(add_write, size);
+        byte_cnt += size;
+        pos = begin;
+    }
+
+    std::uint64_t HuffmanFastBitWriter::get_byte_cnt() const {
+        return byte_cnt + (pos - begin);
+    }
+
+
+    HuffmanFastBitReader::HuffmanFastBitReader(std::istream& in_stream)
+            : stream(&in_stream), buffer(BUFFER_SIZE),
+              pos(buffer.data()), end(buffer.data()),
+              bits(0), bit_cnt(0), consumed_cnt(0), loaded_cnt(0),
+              exhausted(false) {
+    }
+
+    HuffmanFastBitReader::HuffmanFastBitReader(const unsigned char* data,
+                                               std::size_t size)
+            : stream(nullptr), pos(data), end(data + size),
+              bits(0), bit_cnt(0), consumed_cnt(0), loaded_cnt(size),
+              exhausted(true) {
+    }
+
+    bool HuffmanFastBitReader::load() {
+        if (!exhausted) {
+            std::size_t got = read_chunk(*stream, buffer.data(), buffer.size());
+            if (got > 0) {
+                pos = buffer.data();
+                end = pos + got;
+                loaded_cnt += got;
+                return true;
+            }
+            exhausted = true;
+        }
+        check_bounds();
+        bit_cnt = 64; // the rest is zero padding
+        return false;
+    }
+
+    void HuffmanFastBitReader::check_bounds() const {
+        if (consumed_cnt > loaded_cnt * 8) {
+            throw HuffmanArchiver::IO_error("read error");
+        }
+    }
+
+    std::uint64_t HuffmanFastBitReader::get_byte_cnt() const {
+        return (consumed_cnt + 7) / 8;
+    }
 }
@@ -0,0 +1,175 @@
+#include <limits>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
+#include "huffman_impl_lengths.h"
+#include "huffman_impl_stats.h"
+
+using std::size_t;
+using std::uint64_t;
+using HuffmanArchiver::NUM_OF_BYTES;
+
+namespace HuffmanImpl {
+
+    namespace {
+        using Item = LengthScratch::Item;
+
+        // a Huffman tree over every byte value, merged nodes included
+        const size_t MAX_NODES = 2 * NUM_OF_BYTES - 1;
+
+        uint64_t saturating_add(uint64_t a, uint64_t b) {
+            return (a > std::numeric_limits<uint64_t>::max() - b)
+                   ? std::numeric_limits<uint64_t>::max() : a + b;
+        }
+
+        void count_leaves(const std::vector<Item>& pool, size_t ind,
+                          std::uint8_t* lengths) {
+            const Item& item = pool[ind];
+            if (item.symbol >= 0) {
+                lengths[item.symbol]++;
+                return;
+            }
+            count_leaves(pool, item.first, lengths);
+            count_leaves(pool, item.second, lengths);
+        }
+
+        // Leaves sorted by frequency in one queue, merged nodes in another:
+        // merged nodes come out in frequency order too, so the two
+        // smallest are always at the fronts. Ties go to leaves.
+        // Returns the longest code.
+        size_t huffman_lengths(const HuffmanArchiver::Frequencies& frequencies,
+                               std::uint8_t* lengths) {
+            std::uint16_t symbols[NUM_OF_BYTES];
+            size_t n = 0;
+            for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
+                lengths[i] = 0;
+                if (frequencies[i] != 0) {
+                    symbols[n++] = static_cast<std::uint16_t>(i);
+                }
+            }
+            if (n < 2) { // a lonely byte still needs a bit
+                for (size_t i = 0; i < n; ++i) {
+                    lengths[symbols[i]] = 1;
+                }
+                return n;
+            }
+            std::sort(symbols, symbols + n, [&frequencies](std::uint16_t a,
+                                                           std::uint16_t b) {
+                return frequencies[a] < frequencies[b] ||
+                       (frequencies[a] == frequencies[b] && a < b);
+            });
+
+            // leaves first, then merged nodes in the order they're made
+            uint64_t weights[MAX_NODES];
+            std::uint16_t parents[MAX_NODES];
+            for (size_t i = 0; i < n; ++i) {
+                weights[i] = frequencies[symbols[i]];
+            }
+            size_t leaf = 0;
+            size_t merged = n;
+            auto take_smallest = [&](size_t end) {
+                if (leaf < n && (merged == end || weights[leaf] <= weights[merged])) {
+                    return leaf++;
+                }
+                return merged++;
+            };
+            for (size_t end = n; end < 2 * n - 1; ++end) {
+                size_t first = take_smallest(end);
+                size_t second = take_smallest(end);
+                weights[end] = weights[first] + weights[second];
+                parents[first] = parents[second] = static_cast<std::uint16_t>(end);
+            }
+
+            // parents come after their children, so walking backwards
+            // meets every parent first
+            std::uint8_t depths[MAX_NODES];
+            depths[2 * n - 2] = 0;
+            size_t longest = 0;
+            for (size_t i = 2 * n - 2; i-- > 0; ) {
+                depths[i] = depths[parents[i]] + 1;
+                if (i < n) {
+                    lengths[symbols[i]] = depths[i];
+                    longest = std::max<size_t>(longest, depths[i]);
+                }
+            }
+            return longest;
+        }
+    }
+
+    void package_merge(const HuffmanArchiver::Frequencies& frequencies,
+                       size_t max_length, std::uint8_t* lengths) {
+        LengthScratch scratch;
+        package_merge(frequencies, max_length, lengths, scratch);
+    }
+
+    void package_merge(const HuffmanArchiver::Frequencies& frequencies,
+                       size_t max_length, std::uint8_t* lengths,
+                       LengthScratch& scratch) {
+        std::vector<Item>& pool = scratch.pool;
+        std::vector<size_t>& leaves = scratch.leaves;
+        pool.clear();
+        leaves.clear();
+        for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
+            lengths[i] = 0;
+            if (frequencies[i] != 0) {
+                leaves.push_back(pool.size());
+                pool.push_back(Item{frequencies[i], static_cast<int>(i), 0, 0});
+            }
+        }
+        const size_t n = leaves.size();
+        if (n < 2) {
+            for (size_t leaf: leaves) {
+                lengths[pool[leaf].symbol] = 1;
+            }
+            return;
+        }
+        if (max_length < 64 && (size_t(1) << max_length) < n) {
+            throw std::invalid_argument("max code length too small");
+        }
+
+        // ties in byte order, as a stable sort would leave them
+        std::sort(leaves.begin(), leaves.end(), [&pool](size_t a, size_t b) {
+            return pool[a].weight < pool[b].weight ||
+                   (pool[a].weight == pool[b].weight && a < b);
+        });
+
+        std::vector<size_t>& list = scratch.list;
+        list.assign(leaves.begin(), leaves.end());
+        for (size_t level = 1; level < max_length; ++level) {
+            std::vector<size_t>& packages = scratch.packages;
+            packages.clear();
+            for (size_t i = 0; i + 1 < list.size(); i += 2) {
+                packages.push_back(pool.size());
+                pool.push_back(Item{saturating_add(pool[list[i]].weight, 
+                                                   pool[list[i + 1]].weight),
+                                    -1, list[i], list[i + 1]});
+            }
+
+            std::vector<size_t>& merged = scratch.merged;
+            merged.clear();
+            std::merge(leaves.begin(), leaves.end(), 
+                       packages.begin(), packages.end(),
+                       std::back_inserter(merged), [&pool](size_t a, size_t b) {
+                           return pool[a].weight < pool[b].weight;
+                       });
+            list.swap(merged);
+        }
+
+        for (size_t i = 0; i < 2 * n - 2; ++i) {
+            count_leaves(pool, list[i], lengths);
+        }
+    }
+
+    void code_lengths(const HuffmanArchiver::Frequencies& frequencies,
+                      size_t max_length, HuffmanArchiver::CodeLengths& lengths,
+                      LengthScratch& scratch) {
+        HUFFMAN_STATS_PHASE(PHASE_BUILD);
+        std::uint8_t arr[NUM_OF_BYTES];
+        if (huffman_lengths(frequencies, arr) > max_length) {
+            package_merge(frequencies, max_length, arr, scratch);
+        }
+        for (std::uint_fast16_t i = 0; i < NUM_OF_BYTES; ++i) {
+            lengths[i] = arr[i];
+        }
+    }
+}
@@ -0,0 +1,123 @@
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "huffman.h"
+#include "huffman_impl_mmap.h"
+
+namespace HuffmanImpl {
+
+    namespace {
+        HuffmanArchiver::IO_error system_error(const std::string& what) {
+            return HuffmanArchiver::IO_error(what + ": " + std::strerror(errno));
+        }
+    }
+
+    bool MappedFile::mappable(const std::string& path, bool may_be_missing) {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) {
+            return may_be_missing && errno == ENOENT;
+        }
+        return S_ISREG(info.st_mode);
+    }
+
+    MappedFile::MappedFile(const std::string& path)
+            : fd(-1), ptr(nullptr), length(0), writable(false) {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw system_error("can't open input file");
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw system_error("can't open input file");
+        }
+        length = info.st_size;
+        if (length == 0) {
+            return;
+        }
+        void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            throw system_error("can't map input file");
+        }
+        ptr = static_cast<unsigned char*>(addr);
+        madvise(addr, length, MADV_SEQUENTIAL);
+    }
+
+    MappedFile::MappedFile(const std::string& path, std::size_t size)
+            : fd(-1), ptr(nullptr), length(size), writable(true) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            throw system_error("can't open output file");
+        }
+        if (ftruncate(fd, size) != 0) {
+            ::close(fd);
+            throw system_error("can't resize output file");
+        }
+        if (length == 0) {
+            return;
+        }
+        // A full disk would otherwise show up as SIGBUS on some store
+        // through the map, so the blocks are taken before any of them.
+        int error = posix_fallocate(fd, 0, size);
+        if (error != 0) {
+            ftruncate(fd, 0);
+            ::close(fd);
+            errno = error;
+            throw system_error("no room for output file");
+        }
+        void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, 
+                          MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            ftruncate(fd, 0);
+            ::close(fd);
+            throw system_error("can't map output file");
+        }
+        ptr = static_cast<unsigned char*>(addr);
+    }
+
+    MappedFile::~MappedFile() {
+        if (fd == -1) {
+            return;
+        }
+        unmap();
+        if (writable) {
+            ftruncate(fd, 0);
+        }
+        ::close(fd);
+    }
+
+    unsigned char* MappedFile::data() {
+        return ptr;
+    }
+
+    const unsigned char* MappedFile::data() const {
+        return ptr;
+    }
+
+    std::size_t MappedFile::size() const {
+        return length;
+    }
+
+    void MappedFile::close(std::size_t final_size) {
+        unmap();
+        int result = writable ? ftruncate(fd, final_size) : 0;
+        if (result != 0 || ::close(fd) != 0) {
+            fd = -1;
+            throw system_error("write error");
+        }
+        fd = -1;
+    }
+
+    void MappedFile::unmap() {
+        if (ptr != nullptr) {
+            munmap(ptr, length);
+            ptr = nullptr;
+        }
+    }
+}
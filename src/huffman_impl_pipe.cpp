@@ -0,0 +1,67 @@
+#include "huffman_impl_pipe.h"
+#include "huffman_impl_stats.h"
+
+namespace HuffmanImpl {
+
+    IoThread::IoThread()
+            : busy(false), stopping(false), stats(nullptr),
+              thread(&IoThread::work, this) {}
+
+    IoThread::~IoThread() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]() { return !busy; });
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+
+    void IoThread::start(std::function<void()> job_param) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = std::move(job_param);
+            busy = true;
+            error = nullptr;
+#if HUFFMAN_STATS
+            stats = active_stats();
+#endif
+        }
+        wake.notify_one();
+    }
+
+    void IoThread::wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return !busy; });
+        if (error) {
+            std::exception_ptr thrown = error;
+            error = nullptr;
+            std::rethrow_exception(thrown);
+        }
+    }
+
+    void IoThread::work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this]() { return stopping || busy; });
+            if (stopping) {
+                return;
+            }
+            lock.unlock();
+            try {
+#if HUFFMAN_STATS
+                StatsBinding binding(stats);
+#endif
+                job();
+            } catch (...) {
+                lock.lock();
+                error = std::current_exception();
+                lock.unlock();
+            }
+            lock.lock();
+            job = nullptr;
+            busy = false;
+            done.notify_all();
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include "huffman_impl_pool.h"
+#include "huffman_impl_stats.h"
+
+namespace HuffmanImpl {
+
+    ThreadPool::ThreadPool(std::size_t threads)
+            : current(nullptr), next(0), count(0), unfinished(0),
+              generation(0), stopping(false), stats(nullptr) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (std::size_t i = 1; i < threads; ++i) {
+            workers.emplace_back(&ThreadPool::work, this);
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker: workers) {
+            worker.join();
+        }
+    }
+
+    std::size_t ThreadPool::size() const {
+        return workers.size() + 1;
+    }
+
+    void ThreadPool::run(std::size_t task_count,
+                         const std::function<void(std::size_t)>& task) {
+        std::unique_lock<std::mutex> lock(mutex);
+        current = &task;
+        next = 0;
+        count = task_count;
+        unfinished = task_count;
+        error = nullptr;
+#if HUFFMAN_STATS
+        stats = active_stats();
+#endif
+        ++generation;
+        wake.notify_all();
+
+        take_tasks(lock);
+        done.wait(lock, [this]() { return unfinished == 0; });
+        current = nullptr;
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    void ThreadPool::work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::size_t seen = 0;
+        while (true) {
+            wake.wait(lock, [this, seen]() { 
+                return stopping || generation != seen; 
+            });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            take_tasks(lock);
+        }
+    }
+
+    void ThreadPool::take_tasks(std::unique_lock<std::mutex>& lock) {
+        while (current != nullptr && next < count) {
+            std::size_t ind = next++;
+            const std::function<void(std::size_t)>& task = *current;
+            lock.unlock();
+            try {
+#if HUFFMAN_STATS
+                StatsBinding binding(stats);
+#endif
+                task(ind);
+            } catch (...) {
+                lock.lock();
+                if (!error) {
+                    error = std::current_exception();
+                }
+                lock.unlock();
+            }
+            lock.lock();
+            if (--unfinished == 0) {
+                done.notify_all();
+            }
+        }
+    }
+}
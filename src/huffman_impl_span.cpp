@@ -0,0 +1,397 @@
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "huffman_impl_span.h"
+#include "huffman_impl_io.h"
+#include "huffman_impl_block.h"
+#include "huffman_impl_pool.h"
+#include "huffman_impl_table.h"
+#include "huffman_impl_dictionary.h"
+#include "huffman_impl_crc.h"
+#include "huffman_impl_stats.h"
+
+using std::size_t;
+using std::uint64_t;
+using HuffmanArchiver::Frequencies;
+using HuffmanArchiver::CodeLengths;
+using HuffmanArchiver::Codes;
+using HuffmanArchiver::SIGNATURE;
+using HuffmanArchiver::SIGNATURE_SIZE;
+
+namespace HuffmanImpl {
+
+    namespace {
+        // signature, version, size
+        const size_t CANONICAL_PREFIX_SIZE = SIGNATURE_SIZE + 1 + 8;
+
+        enum Format {
+            LEGACY,
+            CANONICAL,
+            BLOCKS,
+            DICTIONARY
+        };
+
+        Format detect_format(const unsigned char* archive, size_t size) {
+            if (size < SIGNATURE_SIZE) {
+                throw HuffmanArchiver::IO_error("wrong header / read error");
+            }
+            if (!std::equal(archive, archive + SIGNATURE_SIZE, SIGNATURE)) {
+                if (size < HuffmanArchiver::HEADER_SIZE) {
+                    throw HuffmanArchiver::IO_error("wrong header / read error");
+                }
+                return LEGACY;
+            }
+            if (size == SIGNATURE_SIZE) {
+                throw HuffmanArchiver::IO_error("wrong header / read error");
+            }
+            if (archive[SIGNATURE_SIZE] == HuffmanArchiver::FORMAT_BLOCKS) {
+                return BLOCKS;
+            }
+            if (archive[SIGNATURE_SIZE] == HuffmanArchiver::FORMAT_DICTIONARY) {
+                if (size < DICTIONARY_PREFIX_SIZE) {
+                    throw HuffmanArchiver::IO_error("wrong header / read error");
+                }
+                return DICTIONARY;
+            }
+            if (archive[SIGNATURE_SIZE] != HuffmanArchiver::FORMAT_CANONICAL) {
+                throw HuffmanArchiver::IO_error("unsupported format version");
+            }
+            if (size < CANONICAL_PREFIX_SIZE) {
+                throw HuffmanArchiver::IO_error("wrong header / read error");
+            }
+            return CANONICAL;
+        }
+
+        size_t num_of_blocks(size_t size, size_t block_size) {
+            return (size + block_size - 1) / block_size;
+        }
+
+        size_t encode_canonical(const unsigned char* data, size_t size,
+                                unsigned char* dest,
+                                const HuffmanArchiver::Options& options,
+                                uint64_t& header_size, SpanScratch& scratch) {
+            Frequencies frequencies;
+            frequencies.add(data, size, options.threads);
+            CodeLengths lengths;
+            code_lengths(frequencies, options.max_code_length, lengths,
+                         scratch.block.lengths);
+            Codes codes(lengths);
+
+            std::copy(SIGNATURE, SIGNATURE + SIGNATURE_SIZE, dest);
+            dest[SIGNATURE_SIZE] = HuffmanArchiver::FORMAT_CANONICAL;
+            put_le(dest + SIGNATURE_SIZE + 1, size, 8);
+            header_size = CANONICAL_PREFIX_SIZE + 
+                          lengths.save(dest + CANONICAL_PREFIX_SIZE);
+
+            uint64_t bits = 0;
+            for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+                bits += frequencies[i] * lengths[i];
+            }
+            const size_t payload = (bits + 7) / 8;
+            HUFFMAN_STATS_CALL(add_codes, frequencies, lengths);
+
+            HuffmanFastBitWriter writer(dest + header_size, payload + 4);
+            write_codes(writer, codes, lengths.max_length(), data, size);
+            writer.flush();
+            return header_size + payload;
+        }
+
+        size_t encode_blocks(const unsigned char* data, size_t size,
+                             unsigned char* dest,
+                             const HuffmanArchiver::Options& options,
+                             uint64_t& header_size, SpanScratch& scratch) {
+            put_archive_header(dest, options);
+            size_t pos = ARCHIVE_HEADER_SIZE;
+            header_size = ARCHIVE_HEADER_SIZE;
+
+            const size_t block_size = options.block_size;
+            const size_t block_cnt = num_of_blocks(size, block_size);
+            std::vector<uint64_t>& offsets = scratch.offsets;
+            offsets.clear();
+            std::uint32_t checksum = 0;
+            ThreadPool pool(options.threads);
+
+            if (pool.size() == 1) {
+                for (size_t i = 0; i < block_cnt; ++i) {
+                    size_t offset = i * block_size;
+                    size_t tables;
+                    size_t length = std::min(block_size, size - offset);
+                    offsets.push_back(pos);
+                    pos += encode_block(data + offset, length, options,
+                                        dest + pos, tables, scratch.block);
+                    header_size += tables;
+                    if (options.checksum) {
+                        checksum = crc32c_combine(checksum, 
+                                get_le(dest + pos - CHECKSUM_SIZE, CHECKSUM_SIZE),
+                                length);
+                    }
+                }
+            } else {
+                // blocks land wherever the previous ones end, so code a
+                // batch aside and then move it into place
+                std::vector<std::vector<unsigned char>> blocks(pool.size());
+                std::vector<size_t> tables(pool.size());
+                for (size_t first = 0; first < block_cnt; first += pool.size()) {
+                    size_t batch = std::min(pool.size(), block_cnt - first);
+                    pool.run(batch, [&](size_t i) {
+                        size_t offset = (first + i) * block_size;
+                        size_t length = std::min(block_size, size - offset);
+                        blocks[i].resize(max_encoded_block_size(length));
+                        blocks[i].resize(encode_block(data + offset, length,
+                                                      options, blocks[i].data(),
+                                                      tables[i]));
+                    });
+                    for (size_t i = 0; i < batch; ++i) {
+                        offsets.push_back(pos);
+                        std::memcpy(dest + pos, blocks[i].data(), blocks[i].size());
+                        pos += blocks[i].size();
+                        header_size += tables[i];
+                        if (options.checksum) {
+                            checksum = crc32c_combine(checksum, 
+                                    get_le(dest + pos - CHECKSUM_SIZE, CHECKSUM_SIZE),
+                                    std::min(block_size, size - (first + i) * block_size));
+                        }
+                    }
+                }
+            }
+
+            dest[pos++] = BLOCK_END;
+            header_size++;
+            if (options.checksum) {
+                put_le(dest + pos, checksum, CHECKSUM_SIZE);
+                pos += CHECKSUM_SIZE;
+                header_size += CHECKSUM_SIZE;
+            }
+
+            if (options.index) {
+                put_index(dest + pos, offsets, size);
+                pos += index_size(offsets.size());
+                header_size += index_size(offsets.size());
+            }
+            return pos;
+        }
+
+        size_t decode_with(const DecodeTable& table, const unsigned char* payload,
+                           size_t size, unsigned char* dest, uint64_t count) {
+            HUFFMAN_STATS_PHASE(PHASE_CODE);
+            HuffmanFastBitReader reader(payload, size);
+            table.decode(reader, dest, count);
+            reader.check_bounds();
+            return reader.get_byte_cnt();
+        }
+
+        // with `table` rebuilt as wide as pays off for `count` bytes
+        size_t decode_with(DecodeTable& table, const Codes& codes,
+                           size_t max_length, const unsigned char* payload,
+                           size_t size, unsigned char* dest, uint64_t count) {
+            table.rebuild(codes, DecodeTable::lookup_bits_for(count, max_length));
+            return decode_with(table, payload, size, dest, count);
+        }
+
+        // what decode_span does, with the size decoded in `out_size`
+        size_t decode_archive(const unsigned char* archive, size_t size,
+                              unsigned char* dest,
+                              const HuffmanArchiver::Options& options,
+                              uint64_t& header_size, uint64_t& out_size,
+                              SpanScratch& scratch) {
+            scratch.block.cache = options.table_cache;
+            switch (detect_format(archive, size)) {
+                case LEGACY: {
+                    std::memcpy(&out_size, archive, HuffmanArchiver::SYSTEM_INFO_SIZE);
+                    Frequencies frequencies;
+                    for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+                        std::memcpy(&frequencies[i], 
+                                    archive + HuffmanArchiver::SYSTEM_INFO_SIZE + 8 * i, 8);
+                    }
+                    header_size = HuffmanArchiver::HEADER_SIZE;
+                    return header_size + 
+                           decode_with(scratch.block.table, Codes(frequencies),
+                                       Codes::MAX_CODE_LENGTH,
+                                       archive + header_size,
+                                       size - header_size, dest, out_size);
+                }
+                case CANONICAL: {
+                    out_size = get_le(archive + SIGNATURE_SIZE + 1, 8);
+                    CodeLengths lengths;
+                    header_size = CANONICAL_PREFIX_SIZE + 
+                                  lengths.load_saved(archive + CANONICAL_PREFIX_SIZE,
+                                                     size - CANONICAL_PREFIX_SIZE);
+                    return header_size + 
+                           decode_with(lengths_table(scratch.block, lengths,
+                                                     DecodeTable::lookup_bits_for(
+                                                             out_size, lengths.max_length())),
+                                       archive + header_size,
+                                       size - header_size, dest, out_size);
+                }
+                case DICTIONARY: {
+                    const HuffmanArchiver::Dictionary& dictionary = find_dictionary(
+                            options, get_le(archive + SIGNATURE_SIZE + 1, 4));
+                    header_size = DICTIONARY_PREFIX_SIZE + 
+                                  get_varint(archive + DICTIONARY_PREFIX_SIZE,
+                                             size - DICTIONARY_PREFIX_SIZE, out_size);
+                    return header_size + 
+                           decode_with(dictionary.table(), archive + header_size,
+                                       size - header_size, dest, out_size);
+                }
+                case BLOCKS:
+                    break;
+            }
+
+            std::vector<BlockRef>& blocks = scratch.blocks;
+            size_t used = index_blocks(archive, size, blocks);
+            out_size = blocks.empty() ? 0 : blocks.back().raw_offset +
+                                            blocks.back().header.raw_size;
+            std::vector<size_t>& tables = scratch.tables;
+            tables.assign(blocks.size(), 0);
+            const unsigned char flags = archive[SIGNATURE_SIZE + 1];
+            const size_t checksum_size = (flags & FLAG_CHECKSUM) ? CHECKSUM_SIZE : 0;
+
+            ThreadPool pool(options.threads);
+            if (pool.size() == 1) {
+                for (size_t i = 0; i < blocks.size(); ++i) {
+                    const unsigned char* body = archive + blocks[i].body_offset;
+                    tables[i] = decode_block(blocks[i].header, body,
+                                             dest + blocks[i].raw_offset,
+                                             checksum_size ? 
+                                             body + blocks[i].header.body_size : nullptr,
+                                             scratch.block);
+                }
+            } else {
+                pool.run(blocks.size(), [&](size_t i) {
+                    const unsigned char* body = archive + blocks[i].body_offset;
+                    BlockScratch block;
+                    block.cache = options.table_cache;
+                    tables[i] = decode_block(blocks[i].header, body,
+                                             dest + blocks[i].raw_offset,
+                                             checksum_size ? 
+                                             body + blocks[i].header.body_size : nullptr,
+                                             block);
+                });
+            }
+
+            header_size = ARCHIVE_HEADER_SIZE + 1 + checksum_size;
+            size_t end = used;
+            if (flags & FLAG_INDEX) {
+                header_size += index_size(blocks.size());
+                end -= index_size(blocks.size());
+            }
+            std::uint32_t checksum = 0;
+            for (size_t i = 0; i < blocks.size(); ++i) {
+                header_size += BLOCK_HEADER_SIZE + tables[i] + checksum_size;
+                if (checksum_size) { // the blocks are checked, now their order
+                    const BlockRef& block = blocks[i];
+                    checksum = crc32c_combine(checksum, 
+                            get_le(archive + block.body_offset + block.header.body_size,
+                                   CHECKSUM_SIZE),
+                            block.header.raw_size);
+                }
+            }
+            if (checksum_size && 
+                    get_le(archive + end - CHECKSUM_SIZE, CHECKSUM_SIZE) != checksum) {
+                throw HuffmanArchiver::IO_error("checksum mismatch");
+            }
+            return used;
+        }
+    }
+
+    size_t max_archive_size(size_t size, const HuffmanArchiver::Options& options) {
+        if (options.dictionary != nullptr) {
+            return max_dictionary_archive_size(size, *options.dictionary);
+        }
+        if (options.block_size == 0) {
+            return CANONICAL_PREFIX_SIZE + HuffmanArchiver::NUM_OF_BYTES + size + 4;
+        }
+        const size_t blocks = num_of_blocks(size, options.block_size);
+        return ARCHIVE_HEADER_SIZE + size + 1 + 
+               blocks * max_encoded_block_size(0) + 
+               (options.checksum ? CHECKSUM_SIZE : 0) +
+               (options.index ? index_size(blocks) : 0);
+    }
+
+    size_t encode_span(const unsigned char* data, size_t size,
+                       unsigned char* dest,
+                       const HuffmanArchiver::Options& options,
+                       uint64_t& header_size) {
+        SpanScratch scratch;
+        return encode_span(data, size, dest, options, header_size, scratch);
+    }
+
+    size_t encode_span(const unsigned char* data, size_t size,
+                       unsigned char* dest,
+                       const HuffmanArchiver::Options& options,
+                       uint64_t& header_size, SpanScratch& scratch) {
+        HUFFMAN_STATS_SCOPE(options.stats);
+        check_options(options);
+        size_t written;
+        if (options.dictionary != nullptr) {
+            written = encode_with_dictionary(data, size, dest, 
+                                             *options.dictionary, header_size);
+        } else if (options.block_size == 0) {
+            written = encode_canonical(data, size, dest, options, header_size,
+                                       scratch);
+        } else {
+            written = encode_blocks(data, size, dest, options, header_size,
+                                    scratch);
+        }
+        // the input counts as one read and the archive as one write,
+        // unless a caller streaming them counts its own
+        HUFFMAN_STATS_SCOPE_CALL(add_read, size);
+        HUFFMAN_STATS_SCOPE_CALL(add_write, written);
+        return written;
+    }
+
+    uint64_t decoded_size(const unsigned char* archive, size_t size) {
+        SpanScratch scratch;
+        return decoded_size(archive, size, scratch);
+    }
+
+    uint64_t decoded_size(const unsigned char* archive, size_t size,
+                          SpanScratch& scratch) {
+        uint64_t result = 0;
+        switch (detect_format(archive, size)) {
+            case LEGACY:
+                std::memcpy(&result, archive, HuffmanArchiver::SYSTEM_INFO_SIZE);
+                break;
+            case CANONICAL:
+                result = get_le(archive + SIGNATURE_SIZE + 1, 8);
+                break;
+            case BLOCKS: {
+                std::vector<BlockRef>& blocks = scratch.blocks;
+                index_blocks(archive, size, blocks);
+                return blocks.empty() ? 0 : blocks.back().raw_offset + 
+                                            blocks.back().header.raw_size;
+            }
+            case DICTIONARY:
+                get_varint(archive + DICTIONARY_PREFIX_SIZE,
+                           size - DICTIONARY_PREFIX_SIZE, result);
+                break;
+        }
+        // every byte takes at least a bit, so a bigger size is corrupted
+        // and must not turn into a huge allocation
+        if (result / 8 > size) {
+            throw HuffmanArchiver::IO_error("corrupted data");
+        }
+        return result;
+    }
+
+    size_t decode_span(const unsigned char* archive, size_t size,
+                       unsigned char* dest,
+                       const HuffmanArchiver::Options& options,
+                       uint64_t& header_size) {
+        SpanScratch scratch;
+        return decode_span(archive, size, dest, options, header_size, scratch);
+    }
+
+    size_t decode_span(const unsigned char* archive, size_t size,
+                       unsigned char* dest,
+                       const HuffmanArchiver::Options& options,
+                       uint64_t& header_size, SpanScratch& scratch) {
+        HUFFMAN_STATS_SCOPE(options.stats);
+        uint64_t out_size;
+        size_t used = decode_archive(archive, size, dest, options, header_size,
+                                     out_size, scratch);
+        HUFFMAN_STATS_SCOPE_CALL(add_read, used);
+        HUFFMAN_STATS_SCOPE_CALL(add_write, out_size);
+        return used;
+    }
+}
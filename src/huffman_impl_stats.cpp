@@ -0,0 +1,183 @@
+#include <cmath>
+#include <algorithm>
+#include "huffman_impl_stats.h"
+#include "huffman_impl_wide.h"
+
+#if HUFFMAN_STATS
+
+using std::size_t;
+using std::uint64_t;
+using Clock = std::chrono::steady_clock;
+
+namespace HuffmanImpl {
+
+    namespace {
+        thread_local StatsCollector* active = nullptr;
+        thread_local PhaseTimer* running = nullptr;
+
+        double seconds(Clock::duration time) {
+            return std::chrono::duration<double>(time).count();
+        }
+    }
+
+    StatsCollector::StatsCollector() {
+        std::fill(times, times + NUM_OF_PHASES, Clock::duration::zero());
+    }
+
+    void StatsCollector::add_time(Phase phase, Clock::duration time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        times[phase] += time;
+    }
+
+    void StatsCollector::add_read(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        counts.bytes_read += bytes;
+        counts.read_calls++;
+    }
+
+    void StatsCollector::add_write(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        counts.bytes_written += bytes;
+        counts.write_calls++;
+    }
+
+    void StatsCollector::add_codes(const HuffmanArchiver::Frequencies& frequencies,
+                                   const HuffmanArchiver::CodeLengths& lengths) {
+        uint64_t symbols = 0;
+        for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+            symbols += frequencies[i];
+        }
+        uint64_t bits = 0;
+        double entropy = 0;
+        for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+            if (frequencies[i] != 0) {
+                bits += frequencies[i] * lengths[i];
+                entropy -= frequencies[i] *
+                           std::log2(double(frequencies[i]) / symbols);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        counts.symbols += symbols;
+        counts.code_bits += bits;
+        counts.entropy_bits += entropy;
+        counts.max_code_length = std::max(counts.max_code_length,
+                                          lengths.max_length());
+    }
+
+    void StatsCollector::add_codes(const WideCodes& wide) {
+        uint64_t symbols = 0;
+        for (std::uint16_t symbol: wide.used) {
+            symbols += wide.counts[symbol];
+        }
+        uint64_t bits = 0;
+        double entropy = 0;
+        size_t max_length = 0;
+        for (std::uint16_t symbol: wide.used) {
+            const uint64_t count = wide.counts[symbol];
+            bits += count * wide.lengths[symbol];
+            entropy -= count * std::log2(double(count) / symbols);
+            max_length = std::max<size_t>(max_length, wide.lengths[symbol]);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        counts.symbols += 2 * symbols;
+        counts.code_bits += bits;
+        counts.entropy_bits += entropy;
+        counts.max_code_length = std::max(counts.max_code_length, max_length);
+    }
+
+    void StatsCollector::add_table_lookup(bool hit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (hit) {
+            counts.table_hits++;
+        } else {
+            counts.table_misses++;
+        }
+    }
+
+    void StatsCollector::report(HuffmanArchiver::Stats& stats,
+                                Clock::duration total) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.total_seconds += seconds(total);
+        stats.count_seconds += seconds(times[PHASE_COUNT]);
+        stats.build_seconds += seconds(times[PHASE_BUILD]);
+        stats.code_seconds += seconds(times[PHASE_CODE]);
+        stats.io_seconds += seconds(times[PHASE_IO]);
+        stats.bytes_read += counts.bytes_read;
+        stats.bytes_written += counts.bytes_written;
+        stats.read_calls += counts.read_calls;
+        stats.write_calls += counts.write_calls;
+        stats.symbols += counts.symbols;
+        stats.code_bits += counts.code_bits;
+        stats.entropy_bits += counts.entropy_bits;
+        stats.max_code_length = std::max(stats.max_code_length,
+                                         counts.max_code_length);
+        stats.table_hits += counts.table_hits;
+        stats.table_misses += counts.table_misses;
+    }
+
+    StatsCollector* active_stats() {
+        return active;
+    }
+
+    StatsScope::StatsScope(HuffmanArchiver::Stats* stats_param)
+            : stats((active == nullptr) ? stats_param : nullptr),
+              start(Clock::now()) {
+        if (stats != nullptr) {
+            active = &collector;
+        }
+    }
+
+    StatsScope::~StatsScope() {
+        if (stats != nullptr) {
+            active = nullptr;
+            collector.report(*stats, Clock::now() - start);
+        }
+    }
+
+    StatsCollector* StatsScope::collecting() {
+        return (stats != nullptr) ? &collector : nullptr;
+    }
+
+    StatsBinding::StatsBinding(StatsCollector* collector)
+            : previous(active) {
+        active = collector;
+    }
+
+    StatsBinding::~StatsBinding() {
+        active = previous;
+    }
+
+    PhaseTimer::PhaseTimer(Phase phase_param)
+            : collector(active), phase(phase_param), outer(nullptr) {
+        if (collector == nullptr) {
+            return;
+        }
+        start = Clock::now();
+        outer = running;
+        if (outer != nullptr) {
+            outer->stop();
+        }
+        running = this;
+    }
+
+    PhaseTimer::~PhaseTimer() {
+        if (collector == nullptr) {
+            return;
+        }
+        stop();
+        running = outer;
+        if (outer != nullptr) {
+            outer->start = Clock::now();
+        }
+    }
+
+    void PhaseTimer::stop() {
+        Clock::time_point now = Clock::now();
+        collector->add_time(phase, now - start);
+        start = now;
+    }
+}
+
+#endif
@@ -0,0 +1,411 @@
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#include "huffman_impl_table.h"
+#include "huffman_impl_io.h"
+#include "huffman_impl_stats.h"
+
+using std::size_t;
+using std::uint64_t;
+using HuffmanArchiver::Codes;
+
+namespace HuffmanImpl {
+
+    namespace {
+        // `count` bits of the codeword starting `from` bits after its first one
+        uint64_t code_bits(const HuffmanArchiver::Codeword& codeword,
+                           size_t from, size_t count) {
+            if (count == 0) {
+                return 0;
+            }
+            uint64_t value = codeword.code >> (codeword.length - from - count);
+            return (count == 64) ? value : value & ((uint64_t(1) << count) - 1);
+        }
+
+        unsigned checked_lookup_bits(unsigned bits) {
+            if (bits < DecodeTable::MIN_LOOKUP_BITS || 
+                    bits > DecodeTable::MAX_LOOKUP_BITS) {
+                throw std::invalid_argument("lookup width out of range");
+            }
+            return bits;
+        }
+    }
+
+    unsigned DecodeTable::lookup_bits_for(uint64_t count, size_t max_length) {
+        // a table much bigger than the data costs more to fill than
+        // it saves; past 11 bits only long codes gain from it
+        unsigned bits = MIN_LOOKUP_BITS;
+        while (bits < DEFAULT_LOOKUP_BITS && (uint64_t(1) << (bits + 2)) < count) {
+            ++bits;
+        }
+        if (bits == DEFAULT_LOOKUP_BITS && max_length > DEFAULT_LOOKUP_BITS &&
+                (uint64_t(1) << (MAX_LOOKUP_BITS + 4)) < count) {
+            bits = MAX_LOOKUP_BITS;
+        }
+        return bits;
+    }
+
+    DecodeTable::DecodeTable()
+            : lookup_bits(DEFAULT_LOOKUP_BITS) {
+    }
+
+    DecodeTable::DecodeTable(const Codes& codes, unsigned lookup_bits_param,
+                             bool pairs)
+            : lookup_bits(DEFAULT_LOOKUP_BITS) {
+        rebuild(codes, lookup_bits_param, pairs);
+    }
+
+    void DecodeTable::rebuild(const Codes& codes, unsigned lookup_bits_param,
+                              bool pairs) {
+        HUFFMAN_STATS_PHASE(PHASE_BUILD);
+        lookup_bits = checked_lookup_bits(lookup_bits_param);
+        entries.assign(size_t(1) << lookup_bits, Entry{NO_SUBTABLE, 0, 0});
+        subtables.assign(1, Subtable{0, lookup_bits});
+
+        std::uint16_t symbols[HuffmanArchiver::NUM_OF_BYTES];
+        size_t count = 0;
+        for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+            if (codes.length(i) != 0) {
+                symbols[count++] = static_cast<std::uint16_t>(i);
+            }
+        }
+        // lined up at their first bit, codes sharing a prefix sort together
+        std::sort(symbols, symbols + count, [&codes](std::uint16_t a,
+                                                     std::uint16_t b) {
+            return (codes.code(a) << (64 - codes.length(a))) < 
+                   (codes.code(b) << (64 - codes.length(b)));
+        });
+        build(0, symbols, symbols + count, 0, codes);
+        if (pairs) {
+            pair_up();
+        }
+    }
+
+    void DecodeTable::build(size_t subtable, const std::uint16_t* symbols,
+                            const std::uint16_t* symbols_end, size_t depth,
+                            const Codes& codes) {
+        const size_t offset = subtables[subtable].offset;
+        const unsigned bits = subtables[subtable].bits;
+
+        const std::uint16_t* pos = symbols;
+        while (pos != symbols_end) {
+            const HuffmanArchiver::Codeword codeword = codes[*pos];
+            size_t rest = codeword.length - depth;
+            if (rest <= bits) {
+                size_t first = code_bits(codeword, depth, rest) << (bits - rest);
+                size_t last = first + (size_t(1) << (bits - rest));
+                std::fill(entries.begin() + offset + first,
+                          entries.begin() + offset + last,
+                          Entry{*pos, static_cast<std::uint8_t>(rest),
+                                static_cast<std::uint8_t>(rest)});
+                ++pos;
+                continue;
+            }
+
+            // the rest of the codes going on past this prefix
+            const size_t prefix = code_bits(codeword, depth, bits);
+            const std::uint16_t* group_end = pos;
+            size_t longest = 0;
+            while (group_end != symbols_end) {
+                const HuffmanArchiver::Codeword next = codes[*group_end];
+                if (next.length - depth <= bits ||
+                        code_bits(next, depth, bits) != prefix) {
+                    break;
+                }
+                longest = std::max(longest, next.length - depth - bits);
+                ++group_end;
+            }
+
+            unsigned sub_bits = std::min<size_t>(lookup_bits, longest);
+            size_t sub_index = subtables.size();
+            subtables.push_back(Subtable{
+                    static_cast<std::uint32_t>(entries.size()), sub_bits});
+            entries.resize(entries.size() + (size_t(1) << sub_bits),
+                           Entry{NO_SUBTABLE, 0, 0});
+            entries[offset + prefix] =
+                    Entry{static_cast<std::uint16_t>(sub_index), 0, 0};
+            build(sub_index, pos, group_end, depth + bits, codes);
+            pos = group_end;
+        }
+    }
+
+    DecodeTable::Entry DecodeTable::single(size_t ind) const {
+        Entry entry = entries[ind];
+        if (entry.first_length < entry.length) {
+            entry = Entry{static_cast<std::uint16_t>(entry.value & 0xFF),
+                          entry.first_length, entry.first_length};
+        }
+        return entry;
+    }
+
+    // Lets a primary entry carry a second codeword whenever the bits left
+    // after the first one already determine it. Entries are paired in
+    // place, earlier ones read back through single().
+    void DecodeTable::pair_up() {
+        const size_t size = size_t(1) << lookup_bits;
+        for (size_t i = 0; i < size; ++i) {
+            const Entry first = entries[i];
+            if (first.first_length == 0) {
+                continue;
+            }
+            const Entry second = single((i << first.length) & (size - 1));
+            if (second.first_length == 0 ||
+                    second.length > lookup_bits - first.length) {
+                continue;
+            }
+            entries[i] = Entry{
+                    static_cast<std::uint16_t>(first.value | (second.value << 8)),
+                    static_cast<std::uint8_t>(first.length + second.length),
+                    first.length};
+        }
+    }
+
+    inline unsigned char* DecodeTable::step(HuffmanFastBitReader& reader,
+                                            unsigned char* dest) const {
+        reader.refill();
+        Entry entry = entries[reader.peek(lookup_bits)];
+        if (entry.first_length == 0) {
+            *dest = decode_long(reader, entry);
+            return dest + 1;
+        }
+        reader.consume(entry.length);
+        dest[0] = static_cast<unsigned char>(entry.value);
+        dest[1] = static_cast<unsigned char>(entry.value >> 8);
+        return dest + ((entry.first_length == entry.length) ? 1 : 2);
+    }
+
+    void DecodeTable::decode(HuffmanFastBitReader& reader,
+                             unsigned char* dest, size_t count) const {
+        HuffmanFastBitReader* const readers[1] = {&reader};
+        unsigned char* pos[1] = {dest};
+        unsigned char* const end = dest + count;
+
+        while (end - pos[0] >= 2) {
+            dispatch_rounds<1>(readers, pos, &end);
+            if (end - pos[0] >= 2) { // out of read-ahead, refill the slow way
+                pos[0] = step(reader, pos[0]);
+            }
+        }
+        dest = pos[0];
+
+        if (dest != end) {
+            reader.refill();
+            Entry entry = entries[reader.peek(lookup_bits)];
+            if (entry.first_length == 0) {
+                *dest = decode_long(reader, entry);
+            } else {
+                reader.consume(entry.first_length);
+                *dest = static_cast<unsigned char>(entry.value);
+            }
+        }
+    }
+
+    template <size_t N>
+    void DecodeTable::dispatch_rounds(HuffmanFastBitReader* const* readers,
+                                      unsigned char** pos,
+                                      unsigned char* const* ends) const {
+        switch (lookup_bits) {
+            case 8: decode_rounds<N, 8>(readers, pos, ends); break;
+            case 9: decode_rounds<N, 9>(readers, pos, ends); break;
+            case 10: decode_rounds<N, 10>(readers, pos, ends); break;
+            case 11: decode_rounds<N, 11>(readers, pos, ends); break;
+            case 12: decode_rounds<N, 12>(readers, pos, ends); break;
+        }
+    }
+
+    // A round refills every stream once, then takes STEPS_PER_REFILL
+    // lookups in each: a refill leaves at least 56 bits and a lookup
+    // takes at most LOOKUP_BITS. Rounds run while every stream has room
+    // for all their bytes and 8 bytes to refill from, a refill moving
+    // at most 7 bytes ahead. A long code goes through the reader itself
+    // and ends the batch.
+    template <size_t N, unsigned LOOKUP_BITS>
+    void DecodeTable::decode_rounds(HuffmanFastBitReader* const* readers,
+                                    unsigned char** pos,
+                                    unsigned char* const* ends) const {
+        const unsigned STEPS_PER_REFILL = 56 / LOOKUP_BITS;
+        const size_t round_size = 2 * STEPS_PER_REFILL;
+        while (true) {
+            size_t rounds = SIZE_MAX;
+            for (size_t i = 0; i < N; ++i) {
+                size_t ahead = readers[i]->available();
+                rounds = std::min<size_t>(rounds, (ends[i] - pos[i]) / round_size);
+                rounds = std::min(rounds, (ahead >= 8) ? (ahead - 8) / 7 + 1 : 0);
+            }
+            if (rounds == 0) {
+                return;
+            }
+
+            // everything the loop touches is copied into locals, where
+            // the byte stores can't alias it
+            const Entry* const table = entries.data();
+            HuffmanFastBitReader::State states[N];
+            unsigned char* out[N];
+            for (size_t i = 0; i < N; ++i) {
+                states[i] = readers[i]->save();
+                out[i] = pos[i];
+            }
+            bool long_code = false;
+            for (; rounds > 0 && !long_code; --rounds) {
+                for (size_t i = 0; i < N; ++i) {
+                    HuffmanFastBitReader::refill(states[i]);
+                }
+                for (unsigned k = 0; k < STEPS_PER_REFILL; ++k) {
+                    for (size_t i = 0; i < N; ++i) {
+                        HuffmanFastBitReader::State& state = states[i];
+                        Entry entry = table[state.bits >> (64 - LOOKUP_BITS)];
+                        if (entry.first_length == 0) {
+                            readers[i]->restore(state);
+                            *out[i]++ = decode_long(*readers[i], entry);
+                            readers[i]->refill();
+                            state = readers[i]->save();
+                            long_code = true;
+                            continue;
+                        }
+                        state.bits <<= entry.length;
+                        state.bit_cnt -= entry.length;
+                        out[i][0] = static_cast<unsigned char>(entry.value);
+                        out[i][1] = static_cast<unsigned char>(entry.value >> 8);
+                        out[i] += (entry.first_length == entry.length) ? 1 : 2;
+                    }
+                }
+            }
+            for (size_t i = 0; i < N; ++i) {
+                readers[i]->restore(states[i]);
+                pos[i] = out[i];
+            }
+        }
+    }
+
+    void DecodeTable::decode(HuffmanFastBitReader* const* readers,
+                             size_t streams, unsigned char* dest,
+                             size_t count) const {
+        const size_t slice = (count + streams - 1) / streams;
+        unsigned char* pos[HuffmanArchiver::MAX_STREAMS];
+        unsigned char* ends[HuffmanArchiver::MAX_STREAMS];
+        for (size_t i = 0; i < streams; ++i) {
+            pos[i] = dest + std::min(i * slice, count);
+            ends[i] = dest + std::min((i + 1) * slice, count);
+        }
+
+        switch (streams) {
+            case 2: dispatch_rounds<2>(readers, pos, ends); break;
+            case 3: dispatch_rounds<3>(readers, pos, ends); break;
+            case 4: dispatch_rounds<4>(readers, pos, ends); break;
+            case 5: dispatch_rounds<5>(readers, pos, ends); break;
+            case 6: dispatch_rounds<6>(readers, pos, ends); break;
+            case 7: dispatch_rounds<7>(readers, pos, ends); break;
+            case 8: dispatch_rounds<8>(readers, pos, ends); break;
+        }
+
+        for (size_t i = 0; i < streams; ++i) { // whatever the rounds left
+            decode(*readers[i], pos[i], ends[i] - pos[i]);
+        }
+    }
+
+    void DecodeTable::pair_contexts(DecodeTable* tables, size_t count,
+                                    const unsigned char* groups) {
+        const unsigned bits = tables[0].lookup_bits;
+        const size_t size = size_t(1) << bits;
+        for (size_t g = 0; g < count; ++g) {
+            for (size_t i = 0; i < size; ++i) {
+                const Entry first = tables[g].entries[i];
+                if (first.first_length == 0) {
+                    continue;
+                }
+                const Entry second = tables[groups[first.value]].single(
+                        (i << first.length) & (size - 1));
+                if (second.first_length == 0 ||
+                        second.length > bits - first.length) {
+                    continue;
+                }
+                tables[g].entries[i] = Entry{
+                        static_cast<std::uint16_t>(first.value | (second.value << 8)),
+                        static_cast<std::uint8_t>(first.length + second.length),
+                        first.length};
+            }
+        }
+    }
+
+    // Every lookup depends on the byte before it, so this is one chain
+    // of lookups, refilled as in decode_rounds.
+    void DecodeTable::decode_contexts(const DecodeTable* tables,
+                                      const unsigned char* groups,
+                                      HuffmanFastBitReader& reader,
+                                      unsigned char* dest, size_t count) {
+        const DecodeTable* by_previous[HuffmanArchiver::NUM_OF_BYTES];
+        const Entry* entries_by_previous[HuffmanArchiver::NUM_OF_BYTES];
+        for (size_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+            by_previous[i] = &tables[groups[i]];
+            entries_by_previous[i] = by_previous[i]->entries.data();
+        }
+        const unsigned bits = tables[0].lookup_bits;
+        const unsigned steps = 56 / bits;
+        unsigned char* const end = dest + count;
+        unsigned char previous = 0;
+
+        while (true) {
+            size_t ahead = reader.available();
+            size_t rounds = std::min<size_t>((end - dest) / (2 * steps),
+                                             (ahead >= 8) ? (ahead - 8) / 7 + 1 : 0);
+            if (rounds == 0) {
+                break;
+            }
+            HuffmanFastBitReader::State state = reader.save();
+            bool long_code = false;
+            for (; rounds > 0 && !long_code; --rounds) {
+                HuffmanFastBitReader::refill(state);
+                for (unsigned k = 0; k < steps; ++k) {
+                    Entry entry = entries_by_previous[previous][
+                            state.bits >> (64 - bits)];
+                    if (entry.first_length == 0) {
+                        reader.restore(state);
+                        previous = by_previous[previous]->decode_long(reader, entry);
+                        *dest++ = previous;
+                        reader.refill();
+                        state = reader.save();
+                        long_code = true;
+                        continue;
+                    }
+                    state.bits <<= entry.length;
+                    state.bit_cnt -= entry.length;
+                    dest[0] = static_cast<unsigned char>(entry.value);
+                    dest[1] = static_cast<unsigned char>(entry.value >> 8);
+                    const bool pair = (entry.first_length != entry.length);
+                    previous = static_cast<unsigned char>(entry.value >> (8 * pair));
+                    dest += 1 + pair;
+                }
+            }
+            reader.restore(state);
+        }
+
+        while (dest != end) { // the last few the slow way, one at a time
+            reader.refill();
+            Entry entry = entries_by_previous[previous][reader.peek(bits)];
+            if (entry.first_length == 0) {
+                previous = by_previous[previous]->decode_long(reader, entry);
+            } else {
+                reader.consume(entry.first_length);
+                previous = static_cast<unsigned char>(entry.value);
+            }
+            *dest++ = previous;
+        }
+    }
+
+    unsigned char DecodeTable::decode_long(HuffmanFastBitReader& reader,
+                                           Entry entry) const {
+        unsigned bits = lookup_bits;
+        while (entry.first_length == 0) {
+            if (entry.value == NO_SUBTABLE) {
+                throw HuffmanArchiver::IO_error("corrupted data");
+            }
+            reader.consume(bits);
+            reader.refill();
+            const Subtable& subtable = subtables[entry.value];
+            bits = subtable.bits;
+            entry = entries[subtable.offset + reader.peek(bits)];
+        }
+        reader.consume(entry.first_length);
+        return static_cast<unsigned char>(entry.value);
+    }
+}
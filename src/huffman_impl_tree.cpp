@@ -2,99 +2,110 @@
 
 namespace HuffmanImpl {
 
-    bool HuffmanTree::Greater::operator()(
-            const HuffmanTree& a, const HuffmanTree& b) const {
-        return a.get_frequency() > b.get_frequency();
+    HuffmanTree::Greater::Greater(const HuffmanTree& tree_ref)
+            : tree(&tree_ref) {
     }
 
-    HuffmanTree::HuffmanTree(unsigned char byte, uint64_t frequency_val)
-            : root(std::make_shared<Node>(byte, frequency_val)) {
+    bool HuffmanTree::Greater::operator()(Index a, Index b) const {
+        return tree->get_frequency(a) > tree->get_frequency(b);
     }
 
-    HuffmanTree::HuffmanTree(const HuffmanTree& left, const HuffmanTree& right)
-            : root(std::make_shared<Node>(left.root, right.root)) {
+    bool HuffmanTree::Node::is_leaf() const {
+        return left == NO_CHILD && right == NO_CHILD;
+    }
+
+    HuffmanTree::HuffmanTree()
+            : root(NO_CHILD) {
+        nodes.reserve(MAX_NODES);
     }
 
     HuffmanTree::HuffmanTree(const HuffmanArchiver::Codes& codes) 
-            :root(std::make_shared<Node>(nullptr, nullptr)) {
+            : HuffmanTree() {
+        root = add_leaf(0, 0);
         for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
-            std::shared_ptr<Node> cur = root;          
-            for (bool bit: codes[i]) {
-
-                std::shared_ptr<Node>& dest = 
-                    bit ? cur->right : cur->left;
-
-                if (dest == nullptr) {
-                    dest = std::make_shared<Node>
-                            (Node(nullptr, nullptr));
+            const HuffmanArchiver::Codeword codeword = codes[i];
+            if (codeword.length == 0) {
+                continue;
+            }
+            Index cur = root;
+            for (std::size_t j = codeword.length; j-- > 0; ) {
+                bool bit = (codeword.code >> j) & 1;
+                Index next = bit ? nodes[cur].right : nodes[cur].left;
+
+                if (next == NO_CHILD) {
+                    next = add_leaf(0, 0);
+                    (bit ? nodes[cur].right : nodes[cur].left) = next;
                 }
-                cur = dest;
+                cur = next;
             }
-            cur->c = i; 
+            nodes[cur].c = i; 
+        }
+    }
+
+    HuffmanTree::Index HuffmanTree::add_leaf(unsigned char byte, 
+                                             uint64_t frequency_val) {
+        if (nodes.size() >= NO_CHILD) {
+            throw HuffmanArchiver::IO_error("wrong header: bad code lengths");
         }
+        nodes.push_back(Node{frequency_val, NO_CHILD, NO_CHILD, byte});
+        return static_cast<Index>(nodes.size() - 1);
+    }
+
+    HuffmanTree::Index HuffmanTree::merge(Index left, Index right) {
+        root = add_leaf(0, nodes[left].frequency + nodes[right].frequency);
+        nodes[root].left = left;
+        nodes[root].right = right;
+        return root;
     }
 
-    uint64_t HuffmanTree::get_frequency() const {
-        return root->frequency;
+    uint64_t HuffmanTree::get_frequency(Index node) const {
+        return nodes[node].frequency;
     }
 
     void HuffmanTree::compute_codes(HuffmanArchiver::Codes& codes) const {
-        std::vector<bool> vec;
-        root->compute_codes(codes, vec);
+        compute_codes(root, codes, HuffmanArchiver::Codeword{0, 0});
     }
 
+    void HuffmanTree::compute_codes(
+            Index node, HuffmanArchiver::Codes& codes,
+            HuffmanArchiver::Codeword prefix) const {
+        const Node& cur = nodes[node];
+        if (cur.is_leaf()) {
+            if (prefix.length <= HuffmanArchiver::Codes::MAX_CODE_LENGTH) {
+                codes.set(cur.c, prefix);
+            } else if (cur.frequency != 0) {
+                throw HuffmanArchiver::IO_error("codeword too long");
+            }
+            return; // unused bytes that deep are simply left without a code
+        }
+        
+        prefix.code <<= 1;
+        prefix.length++;
+        compute_codes(cur.left, codes, prefix);
+
+        prefix.code |= 1;
+        compute_codes(cur.right, codes, prefix);
+    }
 
     HuffmanTree::TreeWalker::TreeWalker(const HuffmanTree& tree) 
-            : root(tree.root), cur(root) {
+            : nodes(tree.nodes.data()), root(tree.root), cur(tree.root) {
     }
 
     void HuffmanTree::TreeWalker::go(bool to) {
         if (is_leaf()) {
             cur = root;
         }
-        cur = to ? cur->right : cur->left;
+        cur = to ? nodes[cur].right : nodes[cur].left;
+        if (cur == NO_CHILD) {
+            throw HuffmanArchiver::IO_error("corrupted data");
+        }
     }
 
     bool HuffmanTree::TreeWalker::is_leaf() const {
-        return (cur->left == nullptr && cur->right == nullptr);
+        return nodes[cur].is_leaf();
     }
 
     unsigned char HuffmanTree::TreeWalker::get_byte() const {
-        return cur->c;
-    }
-
-
-    HuffmanTree::Node::Node(
-            std::shared_ptr<Node> left_child, 
-            std::shared_ptr<Node> right_child)
-            : left(left_child), right(right_child), frequency(0) {
-        if (left != nullptr) {
-            frequency += left->frequency;
-        } 
-        if (right != nullptr) {
-            frequency += right->frequency;
-        }
-    }
-
-    HuffmanTree::Node::Node(unsigned char byte, 
-                                                  uint64_t frequency_val)
-            : left(nullptr), right(nullptr), c(byte), frequency(frequency_val) {
-    }
-    
-
-    void HuffmanTree::Node::compute_codes(
-            HuffmanArchiver::Codes& codes, std::vector<bool>& vec) const {
-        if (left == nullptr && right == nullptr) {
-            codes[c] = vec;
-            return;
-        }
-        
-        vec.push_back(0);
-        left->compute_codes(codes, vec);
-        vec.pop_back();
-
-        vec.push_back(1);
-        right->compute_codes(codes, vec);
-        vec.pop_back(); 
+        return nodes[cur].c;
     }
 }
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include "huffman_impl_wide.h"
+#include "huffman_impl_io.h"
+#include "huffman_impl_table.h"
+#include "huffman_impl_stats.h"
+
+using std::size_t;
+using std::uint64_t;
+
+namespace HuffmanImpl {
+
+    namespace {
+        // sizes the per-symbol arrays once, then forgets the last block
+        // by resetting only the symbols it used
+        void reset(WideCodes& wide) {
+            if (wide.counts.size() != NUM_OF_WIDE_SYMBOLS) {
+                wide.counts.assign(NUM_OF_WIDE_SYMBOLS, 0);
+                wide.lengths.assign(NUM_OF_WIDE_SYMBOLS, 0);
+                wide.codes.assign(NUM_OF_WIDE_SYMBOLS, 0);
+                wide.used.reserve(NUM_OF_WIDE_SYMBOLS);
+            }
+            for (std::uint16_t symbol: wide.used) {
+                wide.counts[symbol] = 0;
+                wide.lengths[symbol] = 0;
+            }
+            wide.used.clear();
+        }
+
+        // canonical codes for the lengths of the used symbols, which are
+        // in symbol order: shorter first, equal lengths in symbol order
+        void assign_codes(WideCodes& wide) {
+            std::uint32_t per_length[WIDE_MAX_CODE_LENGTH + 1] = {};
+            for (std::uint16_t symbol: wide.used) {
+                per_length[wide.lengths[symbol]]++;
+            }
+            std::uint32_t next[WIDE_MAX_CODE_LENGTH + 1] = {};
+            std::uint32_t code = 0;
+            for (size_t length = 1; length <= WIDE_MAX_CODE_LENGTH; ++length) {
+                code = (code + per_length[length - 1]) << 1;
+                next[length] = code;
+            }
+            for (std::uint16_t symbol: wide.used) {
+                wide.codes[symbol] = next[wide.lengths[symbol]]++;
+            }
+        }
+
+        // Like huffman_lengths for bytes: leaves sorted by count in one
+        // queue, merged nodes in another. Leaves in wide.order get their
+        // depths, cut down as below when longer than the limit.
+        void huffman_lengths(WideCodes& wide) {
+            const size_t n = wide.used.size();
+            if (n < 2) { // a lonely symbol still needs a bit
+                for (std::uint16_t symbol: wide.used) {
+                    wide.lengths[symbol] = 1;
+                }
+                return;
+            }
+            wide.order.assign(wide.used.begin(), wide.used.end());
+            const std::vector<std::uint32_t>& counts = wide.counts;
+            std::sort(wide.order.begin(), wide.order.end(),
+                      [&counts](std::uint16_t a, std::uint16_t b) {
+                return counts[a] < counts[b] || (counts[a] == counts[b] && a < b);
+            });
+
+            std::vector<uint64_t>& weights = wide.weights;
+            std::vector<std::uint32_t>& parents = wide.parents;
+            weights.resize(2 * n - 1);
+            parents.resize(2 * n - 1);
+            for (size_t i = 0; i < n; ++i) {
+                weights[i] = counts[wide.order[i]];
+            }
+            size_t leaf = 0;
+            size_t merged = n;
+            auto take_smallest = [&](size_t end) {
+                if (leaf < n && (merged == end || weights[leaf] <= weights[merged])) {
+                    return leaf++;
+                }
+                return merged++;
+            };
+            for (size_t end = n; end < 2 * n - 1; ++end) {
+                size_t first = take_smallest(end);
+                size_t second = take_smallest(end);
+                weights[end] = weights[first] + weights[second];
+                parents[first] = parents[second] = static_cast<std::uint32_t>(end);
+            }
+
+            // Parents turn into depths from the root down: a parent comes
+            // after its children, so it holds its own depth by then.
+            parents[2 * n - 2] = 0;
+            size_t longest = 0;
+            for (size_t i = 2 * n - 2; i-- > 0; ) {
+                parents[i] = parents[parents[i]] + 1;
+                longest = std::max<size_t>(longest, parents[i]);
+            }
+            if (longest <= WIDE_MAX_CODE_LENGTH) {
+                for (size_t i = 0; i < n; ++i) {
+                    wide.lengths[wide.order[i]] = static_cast<std::uint8_t>(parents[i]);
+                }
+                return;
+            }
+
+            // Too long: every leaf past the limit moves up to it, which
+            // overfills the code space, then a leaf at the limit at a time
+            // pairs up with the deepest shorter one, each move freeing one
+            // slot at the limit. The rarest leaves get the longest codes.
+            const size_t limit = WIDE_MAX_CODE_LENGTH;
+            size_t per_length[WIDE_MAX_CODE_LENGTH + 1] = {};
+            for (size_t i = 0; i < n; ++i) {
+                per_length[std::min<size_t>(parents[i], limit)]++;
+            }
+            uint64_t space = 0;
+            for (size_t length = 1; length <= limit; ++length) {
+                space += uint64_t(per_length[length]) << (limit - length);
+            }
+            for (; space > (uint64_t(1) << limit); --space) {
+                per_length[limit]--;
+                for (size_t length = limit - 1; length > 0; --length) {
+                    if (per_length[length] != 0) {
+                        per_length[length]--;
+                        per_length[length + 1] += 2;
+                        break;
+                    }
+                }
+            }
+            size_t ind = 0;
+            for (size_t length = limit; length > 0; --length) {
+                for (size_t k = 0; k < per_length[length]; ++k) {
+                    wide.lengths[wide.order[ind++]] = static_cast<std::uint8_t>(length);
+                }
+            }
+        }
+    }
+
+    WideDecodeTable::WideDecodeTable()
+            : lookup_bits(DecodeTable::DEFAULT_LOOKUP_BITS), steps(1) {
+    }
+
+    void WideDecodeTable::rebuild(const std::uint16_t* symbols, size_t count,
+                                  const std::uint8_t* lengths,
+                                  const std::uint32_t* codes,
+                                  unsigned lookup_bits_param) {
+        HUFFMAN_STATS_PHASE(PHASE_BUILD);
+        lookup_bits = lookup_bits_param;
+        const size_t size = size_t(1) << lookup_bits;
+        entries.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            entries[i] = Entry{static_cast<std::uint32_t>(i), 0, 0, 0};
+        }
+
+        // a subtable for each prefix of longer codes, as wide as the
+        // longest of them needs, after the primary table
+        for (size_t i = 0; i < count; ++i) {
+            const unsigned length = lengths[symbols[i]];
+            if (length > lookup_bits) {
+                const unsigned rest = length - lookup_bits;
+                Entry& entry = entries[codes[symbols[i]] >> rest];
+                entry.sub_bits = static_cast<std::uint8_t>(
+                        std::max<unsigned>(entry.sub_bits, rest));
+            }
+        }
+        size_t offset = size;
+        for (size_t i = 0; i < size; ++i) {
+            if (entries[i].sub_bits != 0) {
+                entries[i].next = static_cast<std::uint32_t>(offset);
+                offset += size_t(1) << entries[i].sub_bits;
+            }
+        }
+        entries.resize(offset);
+        for (size_t i = size; i < offset; ++i) {
+            entries[i] = Entry{static_cast<std::uint32_t>(i), 0, 0, 0};
+        }
+
+        unsigned longest = 1;
+        for (size_t i = 0; i < count; ++i) {
+            const std::uint16_t symbol = symbols[i];
+            const unsigned length = lengths[symbol];
+            const std::uint32_t code = codes[symbol];
+            longest = std::max(longest, length);
+            size_t first, spread;
+            if (length <= lookup_bits) {
+                first = size_t(code) << (lookup_bits - length);
+                spread = size_t(1) << (lookup_bits - length);
+            } else {
+                const unsigned rest = length - lookup_bits;
+                const Entry& link = entries[code >> rest];
+                first = link.next +
+                        (size_t(code & ((1u << rest) - 1)) << (link.sub_bits - rest));
+                spread = size_t(1) << (link.sub_bits - rest);
+            }
+            for (size_t j = first; j < first + spread; ++j) {
+                entries[j] = Entry{static_cast<std::uint32_t>(j), symbol,
+                                   static_cast<std::uint8_t>(length), 0};
+            }
+        }
+        steps = 56 / longest;
+    }
+
+    // The second lookup is the same entry again for codes that fit the
+    // primary table, so there is no branch to mispredict when short and
+    // long codes mix, as they do over large alphabets.
+    inline WideDecodeTable::Entry WideDecodeTable::lookup(
+            const Entry* entries, unsigned lookup_bits, uint64_t bits) {
+        Entry entry = entries[bits >> (64 - lookup_bits)];
+        entry = entries[entry.next +
+                        (((bits << lookup_bits) >> 1) >> (63 - entry.sub_bits))];
+        if (entry.length == 0) {
+            throw HuffmanArchiver::IO_error("corrupted data");
+        }
+        return entry;
+    }
+
+    // As DecodeTable::decode_rounds, but every lookup gives a symbol:
+    // a round refills each stream, then takes `steps` codes from each,
+    // as many as the longest code fits 56 bits.
+    template <size_t N>
+    void WideDecodeTable::decode_rounds(HuffmanFastBitReader* const* readers,
+                                        unsigned char** pos,
+                                        unsigned char* const* ends) const {
+        // locals, which the byte stores can't alias
+        const Entry* const table = entries.data();
+        const unsigned bits = lookup_bits;
+        const size_t round_size = 2 * steps;
+        while (true) {
+            size_t rounds = SIZE_MAX;
+            for (size_t i = 0; i < N; ++i) {
+                size_t ahead = readers[i]->available();
+                rounds = std::min<size_t>(rounds, (ends[i] - pos[i]) / round_size);
+                rounds = std::min(rounds, (ahead >= 8) ? (ahead - 8) / 7 + 1 : 0);
+            }
+            if (rounds == 0) {
+                return;
+            }
+
+            HuffmanFastBitReader::State states[N];
+            unsigned char* out[N];
+            for (size_t i = 0; i < N; ++i) {
+                states[i] = readers[i]->save();
+                out[i] = pos[i];
+            }
+            for (; rounds > 0; --rounds) {
+                for (size_t i = 0; i < N; ++i) {
+                    HuffmanFastBitReader::refill(states[i]);
+                }
+                for (unsigned k = 0; k < steps; ++k) {
+                    for (size_t i = 0; i < N; ++i) {
+                        Entry entry = lookup(table, bits, states[i].bits);
+                        states[i].bits <<= entry.length;
+                        states[i].bit_cnt -= entry.length;
+                        out[i][0] = static_cast<unsigned char>(entry.symbol);
+                        out[i][1] = static_cast<unsigned char>(entry.symbol >> 8);
+                        out[i] += 2;
+                    }
+                }
+            }
+            for (size_t i = 0; i < N; ++i) {
+                readers[i]->restore(states[i]);
+                pos[i] = out[i];
+            }
+        }
+    }
+
+    void WideDecodeTable::decode(HuffmanFastBitReader& reader,
+                                 unsigned char* dest, size_t count) const {
+        HuffmanFastBitReader* const readers[1] = {&reader};
+        unsigned char* pos[1] = {dest};
+        unsigned char* const end = dest + 2 * count;
+        decode_rounds<1>(readers, pos, &end);
+
+        for (dest = pos[0]; dest != end; dest += 2) { // the last few the slow way
+            reader.refill();
+            Entry entry = lookup(entries.data(), lookup_bits, reader.peek(64));
+            reader.consume(entry.length);
+            dest[0] = static_cast<unsigned char>(entry.symbol);
+            dest[1] = static_cast<unsigned char>(entry.symbol >> 8);
+        }
+    }
+
+    void WideDecodeTable::decode(HuffmanFastBitReader* const* readers,
+                                 size_t streams, unsigned char* dest,
+                                 size_t count) const {
+        const size_t slice = (count + streams - 1) / streams;
+        unsigned char* pos[HuffmanArchiver::MAX_STREAMS];
+        unsigned char* ends[HuffmanArchiver::MAX_STREAMS];
+        for (size_t i = 0; i < streams; ++i) {
+            pos[i] = dest + 2 * std::min(i * slice, count);
+            ends[i] = dest + 2 * std::min((i + 1) * slice, count);
+        }
+
+        switch (streams) {
+            case 2: decode_rounds<2>(readers, pos, ends); break;
+            case 3: decode_rounds<3>(readers, pos, ends); break;
+            case 4: decode_rounds<4>(readers, pos, ends); break;
+            case 5: decode_rounds<5>(readers, pos, ends); break;
+            case 6: decode_rounds<6>(readers, pos, ends); break;
+            case 7: decode_rounds<7>(readers, pos, ends); break;
+            case 8: decode_rounds<8>(readers, pos, ends); break;
+        }
+
+        for (size_t i = 0; i < streams; ++i) { // whatever the rounds left
+            decode(*readers[i], pos[i], (ends[i] - pos[i]) / 2);
+        }
+    }
+
+    void count_wide(const unsigned char* data, size_t count, WideCodes& wide) {
+        HUFFMAN_STATS_PHASE(PHASE_COUNT);
+        reset(wide);
+        std::uint32_t* const counts = wide.counts.data();
+        for (size_t i = 0; i < count; ++i) {
+            const std::uint16_t symbol = data[2 * i] | (data[2 * i + 1] << 8);
+            if (counts[symbol]++ == 0) {
+                wide.used.push_back(symbol);
+            }
+        }
+    }
+
+    uint64_t build_wide_codes(WideCodes& wide) {
+        HUFFMAN_STATS_PHASE(PHASE_BUILD);
+        huffman_lengths(wide);
+        std::sort(wide.used.begin(), wide.used.end());
+        assign_codes(wide);
+        uint64_t bits = 0;
+        for (std::uint16_t symbol: wide.used) {
+            bits += uint64_t(wide.counts[symbol]) * wide.lengths[symbol];
+        }
+        return bits;
+    }
+
+    size_t saved_wide_size(const WideCodes& wide) {
+        unsigned char buf[MAX_VARINT_SIZE];
+        size_t size = put_varint(buf, wide.used.size());
+        size_t next = 0;
+        for (std::uint16_t symbol: wide.used) {
+            size += put_varint(buf, (uint64_t(symbol - next) << 5) |
+                                    wide.lengths[symbol]);
+            next = symbol + 1;
+        }
+        return size;
+    }
+
+    size_t save_wide_codes(const WideCodes& wide, unsigned char* dest) {
+        size_t size = put_varint(dest, wide.used.size());
+        size_t next = 0;
+        for (std::uint16_t symbol: wide.used) {
+            size += put_varint(dest + size, (uint64_t(symbol - next) << 5) |
+                                            wide.lengths[symbol]);
+            next = symbol + 1;
+        }
+        return size;
+    }
+
+    size_t load_wide_codes(const unsigned char* data, size_t size,
+                           size_t count, WideCodes& wide) {
+        reset(wide);
+        uint64_t used;
+        size_t pos = get_varint(data, size, used);
+        if (used == 0 || used > NUM_OF_WIDE_SYMBOLS) {
+            throw HuffmanArchiver::IO_error("wrong header: bad code lengths");
+        }
+        uint64_t next = 0;
+        uint64_t space = 0;
+        size_t longest = 0;
+        for (uint64_t i = 0; i < used; ++i) {
+            uint64_t value;
+            pos += get_varint(data + pos, size - pos, value);
+            const uint64_t symbol = next + (value >> 5);
+            const size_t length = value & 31;
+            if (symbol >= NUM_OF_WIDE_SYMBOLS || length == 0 ||
+                    length > WIDE_MAX_CODE_LENGTH) {
+                throw HuffmanArchiver::IO_error("wrong header: bad code lengths");
+            }
+            wide.used.push_back(static_cast<std::uint16_t>(symbol));
+            wide.lengths[symbol] = static_cast<std::uint8_t>(length);
+            space += uint64_t(1) << (WIDE_MAX_CODE_LENGTH - length);
+            longest = std::max(longest, length);
+            next = symbol + 1;
+        }
+        if (space > (uint64_t(1) << WIDE_MAX_CODE_LENGTH)) {
+            throw HuffmanArchiver::IO_error("wrong header: bad code lengths");
+        }
+        assign_codes(wide);
+        wide.table.rebuild(wide.used.data(), wide.used.size(), wide.lengths.data(),
+                           wide.codes.data(),
+                           DecodeTable::lookup_bits_for(count, longest));
+        return pos;
+    }
+
+    void write_wide_codes(HuffmanFastBitWriter& writer, const WideCodes& wide,
+                          const unsigned char* data, size_t count) {
+        HUFFMAN_STATS_PHASE(PHASE_CODE);
+        const std::uint32_t* const codes = wide.codes.data();
+        const std::uint8_t* const lengths = wide.lengths.data();
+        for (size_t i = 0; i < count; ++i) {
+            const std::uint16_t symbol = data[2 * i] | (data[2 * i + 1] << 8);
+            writer.write_short(codes[symbol], lengths[symbol]);
+        }
+    }
+}
@@ -6,29 +6,311 @@
 
 #include <unistd.h>
 #include <getopt.h>
+#include <sys/resource.h>
 
 #include "huffman.h"
+#include "huffman_impl_span.h"
+#include "huffman_impl_mmap.h"
+#include "huffman_impl_stats.h"
+#include "huffman_impl_batch.h"
 
 class CL_options_error : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+namespace {
+    std::size_t parse_number(const std::string& arg, const std::string& opt) {
+        std::size_t pos = 0;
+        unsigned long value = 0;
+        try {
+            value = std::stoul(arg, &pos);
+        } catch (const std::logic_error&) {
+            pos = 0;
+        }
+        if (pos == 0 || pos != arg.size()) {
+            throw CL_options_error("option " + opt + " requires a number");
+        }
+        return value;
+    }
+
+    // --range OFFSET:LENGTH of the decoded data
+    struct Range {
+        std::uint64_t offset = 0;
+        std::uint64_t length = 0;
+    };
+
+    Range parse_range(const std::string& arg) {
+        std::size_t colon = arg.find(':');
+        if (colon == std::string::npos) {
+            throw CL_options_error("option --range requires OFFSET:LENGTH");
+        }
+        Range range;
+        range.offset = parse_number(arg.substr(0, colon), "--range");
+        range.length = parse_number(arg.substr(colon + 1), "--range");
+        return range;
+    }
+
+    // regular files are mapped whole and coded straight between the maps
+    void run_mapped(char mode, const std::string& input_path,
+                    const std::string& output_path,
+                    const HuffmanArchiver::Options& options,
+                    std::uint64_t& in_size, std::uint64_t& out_size,
+                    std::uint64_t& header_size) {
+        HuffmanImpl::MappedFile input(input_path);
+
+        if (mode == 'c') {
+            HuffmanImpl::MappedFile output(output_path, 
+                    HuffmanImpl::max_archive_size(input.size(), options));
+            in_size = input.size();
+            out_size = HuffmanImpl::encode_span(input.data(), input.size(), 
+                                                output.data(), options, 
+                                                header_size);
+            output.close(out_size);
+        } else {
+            out_size = HuffmanImpl::decoded_size(input.data(), input.size());
+            HuffmanImpl::MappedFile output(output_path, out_size);
+            in_size = HuffmanImpl::decode_span(input.data(), input.size(),
+                                               output.data(), options, 
+                                               header_size);
+            output.close(out_size);
+        }
+    }
+
+    std::uint64_t peak_memory() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return std::uint64_t(usage.ru_maxrss) * 1024;
+    }
+
+    double ratio(double part, double whole) {
+        return (whole != 0) ? part / whole : 0;
+    }
+
+    // --stats as lines of text, --stats-json as a single JSON object
+    void print_stats(std::ostream& report, const HuffmanArchiver::Stats& stats,
+                     std::uint64_t in_size, std::uint64_t out_size,
+                     char mode, bool json) {
+        // bits per byte of the original data, whichever side that is
+        const double achieved = ratio(8.0 * ((mode == 'c') ? out_size : in_size),
+                                      (mode == 'c') ? in_size : out_size);
+        const double average = ratio(stats.code_bits, stats.symbols);
+        const double entropy = ratio(stats.entropy_bits, stats.symbols);
+        // only building codes tells their lengths and the entropy;
+        // decoding and stored data leave them out
+        const bool coded = (stats.symbols != 0);
+        if (json) {
+            report << "{\"total_seconds\": " << stats.total_seconds
+                   << ", \"count_seconds\": " << stats.count_seconds
+                   << ", \"build_seconds\": " << stats.build_seconds
+                   << ", \"code_seconds\": " << stats.code_seconds
+                   << ", \"io_seconds\": " << stats.io_seconds
+                   << ", \"bytes_read\": " << stats.bytes_read
+                   << ", \"bytes_written\": " << stats.bytes_written
+                   << ", \"read_calls\": " << stats.read_calls
+                   << ", \"write_calls\": " << stats.write_calls;
+            if (coded) {
+                report << ", \"max_code_length\": " << stats.max_code_length
+                       << ", \"average_code_length\": " << average
+                       << ", \"entropy_bits_per_symbol\": " << entropy;
+            }
+            report << ", \"achieved_bits_per_symbol\": " << achieved
+                   << ", \"table_hits\": " << stats.table_hits
+                   << ", \"table_misses\": " << stats.table_misses
+                   << ", \"peak_memory\": " << peak_memory() << "}\n";
+            return;
+        }
+        report << "time: " << stats.total_seconds << " s"
+               << " (count " << stats.count_seconds 
+               << ", build " << stats.build_seconds
+               << ", code " << stats.code_seconds
+               << ", io " << stats.io_seconds << ")\n"
+               << "read: " << stats.bytes_read << " bytes in " 
+               << stats.read_calls << " calls\n"
+               << "written: " << stats.bytes_written << " bytes in " 
+               << stats.write_calls << " calls\n";
+        if (coded) {
+            report << "code length: max " << stats.max_code_length 
+                   << ", average " << average << '\n'
+                   << "bits per symbol: entropy " << entropy 
+                   << ", achieved " << achieved << '\n';
+        } else {
+            report << "bits per symbol: achieved " << achieved << '\n';
+        }
+        report << "peak memory: " << peak_memory() << " bytes\n";
+        if (stats.table_hits + stats.table_misses != 0) {
+            report << "table cache: " << stats.table_hits << " hits, "
+                   << stats.table_misses << " misses\n";
+        }
+    }
+
+    // --batch: `path` is a manifest or a directory; prints a line per
+    // file (status, input, output, sizes, seconds, error) and sums up
+    // the sizes of the files that went through
+    void run_batch(char mode, const std::string& path,
+                   const std::string& output_path,
+                   const HuffmanArchiver::Options& options,
+                   std::size_t workers, std::size_t memory,
+                   std::uint64_t& in_size, std::uint64_t& out_size,
+                   std::uint64_t& header_size) {
+        std::vector<HuffmanImpl::BatchJob> jobs;
+        if (HuffmanImpl::MappedFile::mappable(path, false)) {
+            if (output_path != "") {
+                throw CL_options_error("-o takes a directory, not a manifest");
+            }
+            std::ifstream manifest(path);
+            if (!manifest.is_open()) {
+                throw HuffmanArchiver::IO_error("can't open manifest");
+            }
+            jobs = HuffmanImpl::read_manifest(manifest, mode == 'c');
+        } else {
+            jobs = HuffmanImpl::list_directory(path, output_path, mode == 'c');
+        }
+
+        std::vector<HuffmanImpl::BatchResult> results = 
+                HuffmanImpl::run_batch(jobs, mode == 'c', options, 
+                                       workers, memory);
+        in_size = out_size = header_size = 0;
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+            const HuffmanImpl::BatchResult& result = results[i];
+            std::cout << (result.error.empty() ? "ok" : "error") << '\t'
+                      << jobs[i].input << '\t' << jobs[i].output << '\t'
+                      << result.in_size << '\t' << result.out_size << '\t'
+                      << result.header_size << '\t' << result.seconds << '\t'
+                      << result.error << '\n';
+            if (result.error.empty()) {
+                in_size += result.in_size;
+                out_size += result.out_size;
+                header_size += result.header_size;
+            }
+        }
+    }
+
+    HuffmanArchiver::Dictionary load_dictionary(const std::string& path) {
+        std::ifstream file(path, std::ifstream::binary);
+        if (!file.is_open()) {
+            throw HuffmanArchiver::IO_error("can't open dictionary file");
+        }
+        HuffmanArchiver::Dictionary dictionary;
+        dictionary.load_saved(file);
+        return dictionary;
+    }
+
+    // swallows what --verify decodes
+    class NullBuffer : public std::streambuf {
+    protected:
+        int overflow(int c) override {
+            return traits_type::not_eof(c);
+        }
+        std::streamsize xsputn(const char*, std::streamsize count) override {
+            return count;
+        }
+    };
+
+    // without -f/-o work as a filter: stdin to stdout;
+    // mode 'r' decodes `range` only, mode 'v' decodes to nowhere
+    void run_streams(char mode, const std::string& input_path,
+                     const std::string& output_path,
+                     const HuffmanArchiver::Options& options,
+                     const Range& range, std::uint64_t& in_size, std::uint64_t& out_size,
+                     std::uint64_t& header_size) {
+        std::ios::sync_with_stdio(false);
+
+        std::ifstream in_file;
+        if (input_path != "") {
+            in_file.open(input_path, std::ifstream::binary);
+            if (!in_file.is_open()) {
+                throw HuffmanArchiver::IO_error("can't open input file");
+            }
+        }
+        std::istream& in_stream = (input_path != "") ? in_file : std::cin;
+
+        std::ofstream out_file;
+        if (output_path != "") {
+            out_file.open(output_path, std::ofstream::binary);
+            if (!out_file.is_open()) {
+                throw HuffmanArchiver::IO_error("can't open output file");
+            }
+        }
+        NullBuffer null_buffer;
+        std::ostream null_stream(&null_buffer);
+        std::ostream& out_stream = (mode == 'v') ? null_stream :
+                                   (output_path != "") ? out_file : std::cout;
+
+        if (mode == 'c') {
+            HuffmanArchiver::encode(in_stream, out_stream, 
+                                    in_size, out_size, header_size, options);
+        } else if (mode == 't') { // the input is the sample corpus
+            HuffmanArchiver::Frequencies samples;
+            samples.add(in_stream);
+            HuffmanArchiver::Dictionary dictionary(samples, 
+                                                   options.max_code_length);
+            dictionary.save(out_stream);
+            in_size = 0;
+            for (std::size_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+                in_size += samples[i];
+            }
+            out_size = header_size = HuffmanArchiver::SIGNATURE_SIZE + 5 + 
+                                     dictionary.lengths().saved_size();
+        } else if (mode == 'r') {
+            HuffmanArchiver::decode_range(in_stream, range.offset, range.length,
+                                          out_stream, in_size, header_size);
+            out_size = range.length;
+        } else {
+            HuffmanArchiver::decode(in_stream, out_stream, 
+                                    in_size, out_size, header_size, options);
+        }
+        out_stream.flush();
+        if (out_stream.fail()) {
+            throw HuffmanArchiver::IO_error("write error");
+        }
+    }
+}
+
 int main(int argc, char* argv[]) {
+    // only --verify and --range tell failures by their exit status
+    bool verify = false;
+    bool use_range = false;
+    bool failed = false;
     try {
         char mode = '\0';
         std::string input_path; 
         std::string output_path;
+        HuffmanArchiver::Options options;
+        bool use_mmap = true;
+        std::string dictionary_path;
+        Range range;
+        HuffmanArchiver::Stats stats;
+        bool show_stats = false;
+        bool stats_json = false;
+        std::string batch_path;
+        bool jobs_given = false;
+        std::size_t memory = std::size_t(1) << 28;
 
-        const char short_opts[] = ":cuf:o:";
+        const char short_opts[] = ":cuf:o:j:";
         const option long_opts[] = {
             {"file", required_argument, nullptr, 'f'},
-            {"output", required_argument, nullptr, 'o'}
+            {"output", required_argument, nullptr, 'o'},
+            {"jobs", required_argument, nullptr, 'j'},
+            {"no-mmap", no_argument, nullptr, 'M'},
+            {"train", no_argument, nullptr, 't'},
+            {"dict", required_argument, nullptr, 'd'},
+            {"index", no_argument, nullptr, 'I'},
+            {"range", required_argument, nullptr, 'r'},
+            {"stats", no_argument, nullptr, 'S'},
+            {"stats-json", no_argument, nullptr, 'J'},
+            {"batch", required_argument, nullptr, 'B'},
+            {"memory", required_argument, nullptr, 'm'},
+            {"contexts", required_argument, nullptr, 'x'},
+            {"checksum", no_argument, nullptr, 'K'},
+            {"verify", no_argument, nullptr, 'V'},
+            {"symbol-size", required_argument, nullptr, 'w'},
+            {nullptr, 0, nullptr, 0}
         };
         
         opterr = 0;
         char opt = getopt_long(argc, argv, short_opts, long_opts, nullptr);
         while (opt != -1) {
-            if (opt == 'c' || opt == 'u') {
+            if (opt == 'c' || opt == 'u' || opt == 't') {
                 if (mode != opt && mode != '\0') {
                     throw CL_options_error("incompatible arguments");
                 }
@@ -37,6 +319,37 @@ int main(int argc, char* argv[]) {
                 input_path = optarg; 
             } else if (opt == 'o') {
                 output_path = optarg;
+            } else if (opt == 'j') {
+                options.threads = parse_number(optarg, "-j");
+                jobs_given = true;
+            } else if (opt == 'M') {
+                use_mmap = false;
+            } else if (opt == 'd') {
+                dictionary_path = optarg;
+            } else if (opt == 'I') {
+                options.index = true;
+            } else if (opt == 'r') {
+                range = parse_range(optarg);
+                use_range = true;
+            } else if (opt == 'B') {
+                batch_path = optarg;
+            } else if (opt == 'm') {
+                memory = parse_number(optarg, "--memory");
+            } else if (opt == 'K') {
+                options.checksum = true;
+            } else if (opt == 'V') {
+                verify = true;
+            } else if (opt == 'x') {
+                options.context_groups = parse_number(optarg, "--contexts");
+            } else if (opt == 'w') {
+                options.symbol_size = parse_number(optarg, "--symbol-size");
+            } else if (opt == 'S' || opt == 'J') {
+                if (!HUFFMAN_STATS) {
+                    throw CL_options_error("built without stats");
+                }
+                show_stats = true;
+                stats_json = stats_json || (opt == 'J');
+                options.stats = &stats;
             } else if (opt == ':') {
                 throw CL_options_error("option -" + std::string(1, optopt) + 
                                                         " requires argument");
@@ -47,35 +360,77 @@ int main(int argc, char* argv[]) {
             opt = getopt_long(argc, argv, short_opts, long_opts, nullptr);
         }
         
-        if (input_path == "" || output_path == "" || mode == '\0') {
+        if (verify) { // decodes without writing anything
+            if ((mode != 'u' && mode != '\0') || use_range || output_path != "") {
+                throw CL_options_error("incompatible arguments");
+            }
+            mode = 'v';
+        }
+
+        if (mode == '\0') {
             throw CL_options_error("missing mandatory options");
         }
 
-        std::ifstream in_stream(input_path, std::ifstream::binary);
-        if (!in_stream.is_open()) {
-            throw HuffmanArchiver::IO_error("can't open input file");
+        HuffmanArchiver::Dictionary dictionary;
+        if (dictionary_path != "") {
+            if (mode == 't') {
+                throw CL_options_error("incompatible arguments");
+            }
+            dictionary = load_dictionary(dictionary_path);
+            options.dictionary = &dictionary;
         }
 
-        std::ofstream out_stream(output_path, std::ofstream::binary);
+        if (use_range) { // seeks around the archive instead of mapping it
+            if (mode != 'u') {
+                throw CL_options_error("incompatible arguments");
+            }
+            mode = 'r';
+        }
 
-        std::uint64_t in_size, out_size;
+        std::uint64_t in_size, out_size, header_size;
 
-        if (mode == 'c') {
-            HuffmanArchiver::encode(in_stream, out_stream, in_size, out_size);
+        if (batch_path != "") { // -j counts files coded at once
+            if ((mode != 'c' && mode != 'u') || use_range || input_path != "") {
+                throw CL_options_error("incompatible arguments");
+            }
+            run_batch(mode, batch_path, output_path, options,
+                      jobs_given ? options.threads : 0, memory,
+                      in_size, out_size, header_size);
+        } else if (mode != 't' && mode != 'r' && use_mmap && input_path != "" && output_path != "" &&
+                HuffmanImpl::MappedFile::mappable(input_path, false) &&
+                HuffmanImpl::MappedFile::mappable(output_path, true)) {
+            run_mapped(mode, input_path, output_path, options,
+                       in_size, out_size, header_size);
         } else {
-            HuffmanArchiver::decode(in_stream, out_stream, in_size, out_size);
+            run_streams(mode, input_path, output_path, options, range,
+                        in_size, out_size, header_size);
         }
 
-        std::cout << in_size << '\n' << out_size << '\n' 
-                  << HuffmanArchiver::HEADER_SIZE << '\n';
+        std::ostream& report = (output_path != "" || batch_path != "" || 
+                                mode == 'v') ? std::cout : std::cerr;
+        report << in_size << '\n' << out_size << '\n' 
+               << header_size << '\n';
+        if (show_stats) {
+            print_stats(report, stats, in_size, out_size, mode, stats_json);
+        }
 
     } catch (const HuffmanArchiver::IO_error& excep) {
         std::cerr << "I/O Error:\n"
                   << excep.what() << '\n'; 
+        failed = true;
     } catch (const CL_options_error& excep) {
         std::cerr << "Options Error:\n"
                   << excep.what() << '\n';
+        failed = true;
+    } catch (const std::out_of_range& excep) { // --range past the end
+        std::cerr << "Range Error:\n"
+                  << excep.what() << '\n';
+        failed = true;
+    } catch (const std::logic_error& excep) { // settings the coder refused
+        std::cerr << "Options Error:\n"
+                  << excep.what() << '\n';
+        failed = true;
     }
 
-    return 0;
+    return ((verify || use_range) && failed) ? 1 : 0;
 }
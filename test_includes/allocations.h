@@ -0,0 +1,9 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// every allocation the test program makes, so a test can tell whether
+// some code made any; the replaced operators live in their own file so
+// that no caller of new sees them inlined
+extern std::atomic<std::size_t> allocations;
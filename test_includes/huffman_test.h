@@ -8,6 +8,7 @@ public:
 private:
     void frequencies_add_test();
     void frequencies_save_load_test();
+    void frequencies_buffer_test();
 
     void codes_test();
 
@@ -17,4 +18,35 @@ private:
     
     void encode_decode_by_codes_test_1();
     void encode_decode_by_codes_test_2();
+
+    void decode_fast_test();
+    void fast_bit_writer_test();
+
+    void code_lengths_test();
+    void canonical_codes_test();
+    void legacy_archive_test();
+
+    void length_limit_test();
+    void deep_tree_test();
+    void kernel_widths_test();
+
+    void block_stream_test();
+    void parallel_blocks_test();
+    void multi_stream_test();
+    void stored_blocks_test();
+    void pipelined_io_test();
+    void context_blocks_test();
+    void checksum_test();
+    void range_test();
+    void stats_test();
+    void batch_manifest_test();
+    void batch_run_test();
+
+    void span_test();
+    void buffer_api_test();
+    void reusable_contexts_test();
+    void table_cache_test();
+    void wide_symbols_test();
+
+    void dictionary_test();
 };
@@ -1,18 +1,65 @@
 #include <ctime>
+#include <cstdlib>
+#include <thread>
+#include <string>
+#include <streambuf>
 #include <sstream>
+#include <fstream>
+#include <filesystem>
 #include <iostream>
 
 #include "huffman.h"
+#include "huffman_impl_io.h"
+#include "huffman_impl_lengths.h"
+#include "huffman_impl_table.h"
+#include "huffman_impl_span.h"
+#include "huffman_impl_stats.h"
+#include "huffman_impl_batch.h"
+#include "huffman_impl_crc.h"
+#include "huffman_impl_wide.h"
 #include "huffman_test.h"
+#include "allocations.h"
 
 void HuffmanArchiverTest::RunAllTests() {
     frequencies_add_test();
     frequencies_save_load_test();
+    frequencies_buffer_test();
 
     codes_test();
 
     encode_decode_test_1();
     encode_decode_test_2();
+
+    decode_fast_test();
+    fast_bit_writer_test();
+
+    code_lengths_test();
+    canonical_codes_test();
+    legacy_archive_test();
+
+    length_limit_test();
+    deep_tree_test();
+    kernel_widths_test();
+
+    block_stream_test();
+    parallel_blocks_test();
+    multi_stream_test();
+    stored_blocks_test();
+    pipelined_io_test();
+    context_blocks_test();
+    checksum_test();
+    range_test();
+    stats_test();
+    batch_manifest_test();
+    batch_run_test();
+
+    span_test();
+    buffer_api_test();
+    reusable_contexts_test();
+    table_cache_test();
+    wide_symbols_test();
+
+    dictionary_test();
 }
 
 namespace {
@@ -20,6 +67,7 @@ namespace {
                                                | std::stringstream::in 
                                                | std::stringstream::out;
 }
+
 void HuffmanArchiverTest::frequencies_add_test() {
     HuffmanArchiver::Frequencies frequencies;
     
@@ -57,6 +105,32 @@ void HuffmanArchiverTest::frequencies_save_load_test() {
     }
 }
 
+void HuffmanArchiverTest::frequencies_buffer_test() {
+    // long runs and an odd length, larger than a thread's slice
+    std::vector<unsigned char> data;
+    for (std::size_t i = 0; data.size() < 3000001; ++i) {
+        data.insert(data.end(), rand() % 1000, 
+                    static_cast<unsigned char>(rand()));
+    }
+    data.resize(3000001);
+
+    std::uint64_t expected[HuffmanArchiver::NUM_OF_BYTES] = {};
+    for (unsigned char c: data) {
+        expected[c]++;
+    }
+
+    HuffmanArchiver::Frequencies single, parallel, streamed;
+    single.add(data.data(), data.size());
+    parallel.add(data.data(), data.size(), 4);
+    std::stringstream stream(std::string(data.begin(), data.end()), bit_mask);
+    streamed.add(stream);
+    for (std::size_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+        CHECK(single[i] == expected[i]);
+        CHECK(parallel[i] == expected[i]);
+        CHECK(streamed[i] == expected[i]);
+    }
+}
+
 void HuffmanArchiverTest::codes_test() {
     HuffmanArchiver::Frequencies frequencies;
     
@@ -67,7 +141,8 @@ void HuffmanArchiverTest::codes_test() {
 
     HuffmanArchiver::Codes codes(frequencies);
 
-    CHECK(codes[0].size() == 1);
+    CHECK(codes[0].length == 1);
+    CHECK(codes[0].code == codes.code(0));
 
 }
 
@@ -140,3 +215,1489 @@ void HuffmanArchiverTest::encode_decode_test_2() {
 }
 
 
+
+void HuffmanArchiverTest::decode_fast_test() {
+    const std::size_t TEST_SIZE = 100000;
+    std::string input;
+    for (std::size_t i = 0; i < TEST_SIZE; ++i) {
+        unsigned char c = (rand() % 3 == 0) ? rand() : rand() % 4;
+        input.push_back(c);
+    }
+
+    HuffmanArchiver::Frequencies frequencies;
+    std::uint64_t fib_a = 1, fib_b = 1;
+    for (std::uint_fast16_t i = 0; i < 40; ++i) { // codes longer than a lookup
+        frequencies[i] = fib_a;
+        std::uint64_t next = fib_a + fib_b;
+        fib_a = fib_b;
+        fib_b = next;
+    }
+    for (unsigned char c: input) {
+        frequencies[c]++;
+    }
+    HuffmanArchiver::Codes codes(frequencies);
+
+    std::stringstream input_stream(input, bit_mask);
+    std::stringstream encoder_stream(bit_mask);
+    std::uint64_t input_size, output_size;
+    HuffmanArchiver::encode(codes, input_stream, encoder_stream,
+                            input_size, output_size);
+
+    std::stringstream slow_stream(encoder_stream.str(), bit_mask);
+    std::stringstream fast_stream(encoder_stream.str(), bit_mask);
+    std::stringstream slow_output(bit_mask);
+    std::stringstream fast_output(bit_mask);
+    std::uint64_t slow_in, slow_out, fast_in, fast_out;
+
+    try {
+        HuffmanArchiver::decode(codes, slow_stream, slow_output, TEST_SIZE,
+                                slow_in, slow_out);
+        HuffmanArchiver::decode_fast(codes, fast_stream, fast_output, TEST_SIZE,
+                                     fast_in, fast_out);
+    } catch(...) {
+        CHECK(0 == 1);
+    }
+    CHECK(fast_output.str() == input);
+    CHECK(fast_output.str() == slow_output.str());
+    CHECK(fast_in == slow_in);
+    CHECK(fast_out == slow_out);
+
+    std::string truncated = encoder_stream.str();
+    truncated.resize(truncated.size() / 2);
+    std::stringstream truncated_stream(truncated, bit_mask);
+    bool thrown = false;
+    try {
+        HuffmanArchiver::decode_fast(codes, truncated_stream, fast_output,
+                                     TEST_SIZE, fast_in, fast_out);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::fast_bit_writer_test() {
+    std::stringstream slow_stream(bit_mask);
+    std::stringstream fast_stream(bit_mask);
+    {
+        HuffmanImpl::HuffmanBitWriter slow_writer(slow_stream);
+        HuffmanImpl::HuffmanFastBitWriter fast_writer(fast_stream);
+
+        for (std::size_t i = 0; i < 50000; ++i) {
+            HuffmanArchiver::Codeword codeword{0, std::size_t(rand() % 64 + 1)};
+            for (std::size_t j = 0; j < codeword.length; ++j) {
+                codeword.code = (codeword.code << 1) | (rand() % 2);
+            }
+            slow_writer.write(codeword);
+            fast_writer.write(codeword.code, codeword.length);
+        }
+        slow_writer.flush();
+        fast_writer.flush();
+        CHECK(slow_writer.get_byte_cnt() == fast_writer.get_byte_cnt());
+    }
+    CHECK(slow_stream.str() == fast_stream.str());
+}
+
+void HuffmanArchiverTest::code_lengths_test() {
+    HuffmanArchiver::Frequencies frequencies;
+    frequencies['a'] = 10;
+    frequencies['b'] = 5;
+    frequencies['c'] = 5;
+    frequencies[200] = 1;
+
+    HuffmanArchiver::CodeLengths lengths(frequencies);
+    CHECK(lengths['a'] == 1);
+    CHECK(lengths['b'] == 2 || lengths['c'] == 2);
+    CHECK(lengths[200] == 3);
+    CHECK(lengths[0] == 0);
+
+    std::stringstream stream(bit_mask);
+    lengths.save(stream);
+    CHECK(stream.str().size() == lengths.saved_size());
+    CHECK(lengths.saved_size() < 16);
+
+    HuffmanArchiver::CodeLengths second_lengths;
+    second_lengths.load_saved(stream);
+    for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+        CHECK(lengths[i] == second_lengths[i]);
+    }
+
+    HuffmanArchiver::Frequencies single;
+    single['x'] = 42;
+    CHECK(HuffmanArchiver::CodeLengths(single)['x'] == 1);
+}
+
+void HuffmanArchiverTest::canonical_codes_test() {
+    HuffmanArchiver::CodeLengths lengths;
+    lengths['a'] = 1;
+    lengths['b'] = 2;
+    lengths['c'] = 3;
+    lengths['d'] = 3;
+
+    HuffmanArchiver::Codes codes(lengths);
+    CHECK(codes.code('a') == 0);
+    CHECK(codes.code('b') == 2);
+    CHECK(codes.code('c') == 6);
+    CHECK(codes.code('d') == 7);
+    CHECK(codes.length('d') == 3);
+    CHECK(codes.length('e') == 0);
+
+    lengths['e'] = 2; // over-subscribed
+    bool thrown = false;
+    try {
+        HuffmanArchiver::Codes bad_codes(lengths);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    std::stringstream input_stream(std::string("abracadabra"), bit_mask);
+    std::stringstream encoder_stream(bit_mask);
+    std::stringstream decoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    HuffmanArchiver::Options options;
+    options.block_size = 0;
+    HuffmanArchiver::encode(input_stream, encoder_stream,
+                            input_size, output_size, header_size, options);
+    CHECK(output_size == encoder_stream.str().size());
+    CHECK(header_size < 32);
+
+    HuffmanArchiver::decode(encoder_stream, decoder_stream,
+                            input_size, output_size, header_size);
+    CHECK(decoder_stream.str() == "abracadabra");
+    CHECK(header_size < 32);
+}
+
+void HuffmanArchiverTest::legacy_archive_test() {
+    const std::string input = "legacy archives start with the size";
+
+    HuffmanArchiver::Frequencies frequencies;
+    for (unsigned char c: input) {
+        frequencies[c]++;
+    }
+    HuffmanArchiver::Codes codes(frequencies);
+
+    std::stringstream archive(bit_mask);
+    std::uint64_t size = input.size();
+    archive.write(reinterpret_cast<char*>(&size), 8);
+    frequencies.save(archive);
+    std::stringstream input_stream(input, bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    HuffmanArchiver::encode(codes, input_stream, archive,
+                            input_size, output_size);
+
+    std::stringstream decoder_stream(bit_mask);
+    try {
+        HuffmanArchiver::decode(archive, decoder_stream,
+                                input_size, output_size, header_size);
+    } catch(...) {
+        CHECK(0 == 1);
+    }
+    CHECK(decoder_stream.str() == input);
+    CHECK(header_size == HuffmanArchiver::HEADER_SIZE);
+    CHECK(input_size == archive.str().size());
+}
+
+namespace {
+    std::uint64_t total_bits(const HuffmanArchiver::Frequencies& frequencies,
+                             const HuffmanArchiver::CodeLengths& lengths) {
+        std::uint64_t bits = 0;
+        for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+            bits += frequencies[i] * lengths[i];
+        }
+        return bits;
+    }
+}
+
+void HuffmanArchiverTest::length_limit_test() {
+    HuffmanArchiver::Frequencies frequencies;
+    std::uint64_t fib_a = 1, fib_b = 1;
+    for (std::uint_fast16_t i = 0; i < 60; ++i) {
+        frequencies[i] = fib_a;
+        std::uint64_t next = fib_a + fib_b;
+        fib_a = fib_b;
+        fib_b = next;
+    }
+
+    HuffmanArchiver::CodeLengths unlimited(frequencies, 64);
+    CHECK(unlimited.max_length() == 59);
+
+    for (std::size_t limit: {11, 12, 15}) {
+        HuffmanArchiver::CodeLengths lengths(frequencies, limit);
+        CHECK(lengths.max_length() == limit);
+        CHECK(total_bits(frequencies, lengths) > 
+              total_bits(frequencies, unlimited));
+        try {
+            HuffmanArchiver::Codes codes(lengths);
+        } catch(...) {
+            CHECK(0 == 1);
+        }
+    }
+
+    for (int round = 0; round < 20; ++round) { // as good as Huffman when it fits
+        HuffmanArchiver::Frequencies random_frequencies;
+        for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+            random_frequencies[i] = (rand() % 4) ? rand() % 1000 : 0;
+        }
+        HuffmanArchiver::CodeLengths huffman(random_frequencies, 64);
+        std::uint8_t merged[HuffmanArchiver::NUM_OF_BYTES];
+        HuffmanImpl::package_merge(random_frequencies, 64, merged);
+        HuffmanArchiver::CodeLengths merged_lengths;
+        for (std::uint_fast16_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+            merged_lengths[i] = merged[i];
+        }
+        CHECK(total_bits(random_frequencies, huffman) == 
+              total_bits(random_frequencies, merged_lengths));
+    }
+
+    std::string input;
+    for (std::uint_fast16_t i = 0; i < 30; ++i) {
+        input.append(std::size_t(1) << (i / 2), static_cast<char>(i));
+    }
+    HuffmanArchiver::Options options;
+    options.max_code_length = 8;
+    std::stringstream input_stream(input, bit_mask);
+    std::stringstream encoder_stream(bit_mask);
+    std::stringstream decoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    HuffmanArchiver::encode(input_stream, encoder_stream,
+                            input_size, output_size, header_size, options);
+    HuffmanArchiver::decode(encoder_stream, decoder_stream,
+                            input_size, output_size, header_size);
+    CHECK(decoder_stream.str() == input);
+
+    options.max_code_length = 7;
+    bool thrown = false;
+    try {
+        HuffmanArchiver::encode(input_stream, encoder_stream,
+                                input_size, output_size, header_size, options);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+namespace {
+    // a stream that can neither seek nor tell, like a pipe
+    class PipeBuf : public std::streambuf {
+    public:
+        PipeBuf(const std::string& data_param) : data(data_param), pos(0) {}
+    protected:
+        int_type underflow() override {
+            if (pos == data.size()) {
+                return traits_type::eof();
+            }
+            ch = data[pos++];
+            setg(&ch, &ch, &ch + 1);
+            return traits_type::to_int_type(ch);
+        }
+    private:
+        std::string data;
+        std::size_t pos;
+        char ch;
+    };
+}
+
+void HuffmanArchiverTest::kernel_widths_test() {
+    // skewed enough for codes past every lookup width
+    std::vector<unsigned char> input;
+    for (std::size_t i = 0; i < 30000; ++i) {
+        std::size_t byte = 0;
+        while (byte < 40 && rand() % 3 != 0) {
+            ++byte;
+        }
+        input.push_back(static_cast<unsigned char>(byte));
+    }
+    HuffmanArchiver::Frequencies frequencies;
+    frequencies.add(input.data(), input.size());
+
+    const std::size_t limits[3] = {15, 32, 64};
+    for (std::size_t limit: limits) {
+        HuffmanArchiver::CodeLengths lengths(frequencies, limit);
+        HuffmanArchiver::Codes codes(lengths);
+        CHECK(lengths.max_length() > HuffmanImpl::DecodeTable::MAX_LOOKUP_BITS);
+
+        // every kernel writes what writing codeword by codeword does
+        std::vector<unsigned char> plain(input.size() * 8 + 4);
+        std::vector<unsigned char> batched(plain.size());
+        HuffmanImpl::HuffmanFastBitWriter plain_writer(plain.data(), plain.size());
+        for (unsigned char byte: input) {
+            plain_writer.write(codes.code(byte), codes.length(byte));
+        }
+        plain_writer.flush();
+        HuffmanImpl::HuffmanFastBitWriter writer(batched.data(), batched.size());
+        HuffmanImpl::write_codes(writer, codes, lengths.max_length(),
+                                 input.data(), input.size());
+        writer.flush();
+        CHECK(writer.get_byte_cnt() == plain_writer.get_byte_cnt());
+        CHECK(std::equal(plain.begin(), 
+                         plain.begin() + writer.get_byte_cnt(),
+                         batched.begin()));
+
+        // and every lookup width reads it back
+        for (unsigned bits = HuffmanImpl::DecodeTable::MIN_LOOKUP_BITS;
+                bits <= HuffmanImpl::DecodeTable::MAX_LOOKUP_BITS; ++bits) {
+            HuffmanImpl::DecodeTable table(codes, bits);
+            HuffmanImpl::HuffmanFastBitReader reader(batched.data(),
+                                                     writer.get_byte_cnt());
+            std::vector<unsigned char> output(input.size());
+            table.decode(reader, output.data(), output.size());
+            CHECK(output == input);
+        }
+    }
+    CHECK(HuffmanImpl::DecodeTable::lookup_bits_for(100, 15) ==
+          HuffmanImpl::DecodeTable::MIN_LOOKUP_BITS);
+    CHECK(HuffmanImpl::DecodeTable::lookup_bits_for(1 << 20, 11) ==
+          HuffmanImpl::DecodeTable::DEFAULT_LOOKUP_BITS);
+}
+
+void HuffmanArchiverTest::deep_tree_test() {
+    // plain Huffman would go 79 levels deep here
+    HuffmanArchiver::Frequencies frequencies;
+    std::uint64_t fib_a = 1, fib_b = 1;
+    for (std::uint_fast16_t i = 0; i < 80; ++i) {
+        frequencies[i] = fib_a;
+        std::uint64_t next = fib_a + fib_b;
+        fib_a = fib_b;
+        fib_b = next;
+    }
+
+    HuffmanArchiver::CodeLengths lengths(frequencies, 64);
+    CHECK(lengths.max_length() == 64);
+    try {
+        HuffmanArchiver::Codes codes(lengths);
+    } catch(...) {
+        CHECK(0 == 1);
+    }
+
+    // equal frequencies make a balanced tree
+    HuffmanArchiver::Frequencies equal;
+    for (std::size_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+        equal[i] = 5;
+    }
+    HuffmanArchiver::CodeLengths balanced(equal);
+    for (std::size_t i = 0; i < HuffmanArchiver::NUM_OF_BYTES; ++i) {
+        CHECK(balanced[i] == 8);
+    }
+}
+
+void HuffmanArchiverTest::block_stream_test() {
+    std::string input;
+    for (std::size_t i = 0; i < 300000; ++i) {
+        input.push_back((i / 70000 % 2) ? rand() % 256 : 'a' + rand() % 6);
+    }
+
+    HuffmanArchiver::Options options;
+    options.block_size = 65536;
+
+    PipeBuf pipe(input);
+    std::istream input_stream(&pipe);
+    std::stringstream encoder_stream(bit_mask);
+    std::stringstream decoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    try {
+        HuffmanArchiver::encode(input_stream, encoder_stream,
+                                input_size, output_size, header_size, options);
+    } catch(...) {
+        CHECK(0 == 1);
+    }
+    CHECK(input_size == input.size());
+    CHECK(output_size == encoder_stream.str().size());
+    CHECK(encoder_stream.str()[HuffmanArchiver::SIGNATURE_SIZE] == 
+          HuffmanArchiver::FORMAT_BLOCKS);
+
+    std::uint64_t decoded_in, decoded_out, decoded_header;
+    try {
+        HuffmanArchiver::decode(encoder_stream, decoder_stream,
+                                decoded_in, decoded_out, decoded_header);
+    } catch(...) {
+        CHECK(0 == 1);
+    }
+    CHECK(decoder_stream.str() == input);
+    CHECK(decoded_in == output_size);
+    CHECK(decoded_out == input.size());
+    CHECK(decoded_header == header_size);
+
+    std::string truncated = encoder_stream.str();
+    truncated.resize(truncated.size() - 100);
+    std::stringstream truncated_stream(truncated, bit_mask);
+    bool thrown = false;
+    try {
+        HuffmanArchiver::decode(truncated_stream, decoder_stream,
+                                decoded_in, decoded_out, decoded_header);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::parallel_blocks_test() {
+    std::string input;
+    for (std::size_t i = 0; i < 500000; ++i) {
+        input.push_back('a' + rand() % (i / 50000 + 2));
+    }
+
+    std::string archives[3];
+    const std::size_t threads[3] = {1, 4, 0};
+    for (std::size_t i = 0; i < 3; ++i) {
+        HuffmanArchiver::Options options;
+        options.block_size = 30000;
+        options.threads = threads[i];
+
+        std::stringstream input_stream(input, bit_mask);
+        std::stringstream encoder_stream(bit_mask);
+        std::uint64_t input_size, output_size, header_size;
+        HuffmanArchiver::encode(input_stream, encoder_stream,
+                                input_size, output_size, header_size, options);
+        archives[i] = encoder_stream.str();
+    }
+    CHECK(archives[0] == archives[1]);
+    CHECK(archives[0] == archives[2]);
+
+    HuffmanArchiver::Options options;
+    options.threads = 3;
+    std::stringstream encoder_stream(archives[1], bit_mask);
+    std::stringstream decoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    try {
+        HuffmanArchiver::decode(encoder_stream, decoder_stream,
+                                input_size, output_size, header_size, options);
+    } catch(...) {
+        CHECK(0 == 1);
+    }
+    CHECK(decoder_stream.str() == input);
+
+    std::string corrupted = archives[1];
+    for (std::size_t i = corrupted.size() / 2; i < corrupted.size() - 1; ++i) {
+        corrupted[i] = char(0xFF);
+    }
+    std::stringstream corrupted_stream(corrupted, bit_mask);
+    bool thrown = false;
+    try {
+        HuffmanArchiver::decode(corrupted_stream, decoder_stream,
+                                input_size, output_size, header_size, options);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::multi_stream_test() {
+    // skewed enough for codes longer than a table lookup
+    std::vector<unsigned char> input;
+    for (std::size_t i = 0; i < 100003; ++i) {
+        std::size_t bits = 0;
+        while (bits < 40 && rand() % 2) {
+            ++bits;
+        }
+        input.push_back(static_cast<unsigned char>(bits * 5 + rand() % 3));
+    }
+
+    std::size_t previous_size = 0;
+    for (std::size_t streams = 1; streams <= HuffmanArchiver::MAX_STREAMS; ++streams) {
+        for (std::size_t max_length: {11, 64}) {
+            HuffmanArchiver::Options options;
+            options.streams = streams;
+            options.block_size = 7919;
+            options.max_code_length = max_length;
+
+            std::vector<unsigned char> archive;
+            HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+            std::vector<unsigned char> output;
+            try {
+                HuffmanArchiver::decode(archive.data(), archive.size(), output);
+            } catch (...) {
+                CHECK(0 == 1);
+            }
+            CHECK(output == input);
+
+            // the stream decoder reads the same blocks
+            std::stringstream encoder_stream(
+                    std::string(archive.begin(), archive.end()), bit_mask);
+            std::stringstream decoder_stream(bit_mask);
+            std::uint64_t input_size, output_size, header_size;
+            HuffmanArchiver::decode(encoder_stream, decoder_stream,
+                                    input_size, output_size, header_size);
+            CHECK(decoder_stream.str() == 
+                  std::string(input.begin(), input.end()));
+            CHECK(input_size == archive.size());
+
+            if (max_length == 64) { // each stream costs up to 6 bytes a block
+                CHECK(streams == 1 || archive.size() > previous_size);
+                CHECK(streams == 1 || archive.size() < previous_size + 
+                      (input.size() / options.block_size + 1) * 6);
+                previous_size = archive.size();
+            }
+        }
+    }
+
+    HuffmanArchiver::Options options;
+    options.streams = HuffmanArchiver::MAX_STREAMS + 1;
+    bool thrown = false;
+    try {
+        std::vector<unsigned char> archive;
+        HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::stored_blocks_test() {
+    // random bytes, one repeated byte, then text
+    const std::size_t block_size = 10000;
+    std::vector<unsigned char> input;
+    for (std::size_t i = 0; i < 2 * block_size; ++i) {
+        input.push_back(static_cast<unsigned char>(rand()));
+    }
+    input.insert(input.end(), 2 * block_size, 'z');
+    for (std::size_t i = 0; i < 2 * block_size; ++i) {
+        input.push_back('a' + rand() % 4);
+    }
+
+    HuffmanArchiver::Options options;
+    options.block_size = block_size;
+    std::vector<unsigned char> archive;
+    HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+    // random blocks cost their headers, runs next to nothing,
+    // and text still gets coded
+    CHECK(archive.size() < 2 * block_size + 
+                           2 * block_size / 3 + 100 + 
+                           HuffmanArchiver::NUM_OF_BYTES);
+
+    std::vector<unsigned char> output;
+    HuffmanArchiver::decode(archive.data(), archive.size(), output);
+    CHECK(output == input);
+
+    std::stringstream encoder_stream(
+            std::string(archive.begin(), archive.end()), bit_mask);
+    std::stringstream decoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    HuffmanArchiver::decode(encoder_stream, decoder_stream,
+                            input_size, output_size, header_size);
+    CHECK(decoder_stream.str() == std::string(input.begin(), input.end()));
+
+    // demanding all of it stores everything but the runs
+    options.store_margin = 100;
+    archive.clear();
+    HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+    CHECK(archive.size() > 4 * block_size);
+    output.clear();
+    HuffmanArchiver::decode(archive.data(), archive.size(), output);
+    CHECK(output == input);
+
+    // an empty run is no block the encoder writes
+    const std::vector<unsigned char> run(100, 'z');
+    std::vector<unsigned char> empty_run;
+    HuffmanArchiver::encode(run.data(), run.size(), empty_run);
+    const std::size_t rle = HuffmanImpl::ARCHIVE_HEADER_SIZE;
+    CHECK(empty_run[rle] == HuffmanImpl::BLOCK_RLE && 
+          empty_run[rle + 1] == run.size());
+    std::fill(empty_run.begin() + rle + 1, empty_run.begin() + rle + 5, 0);
+    bool rejected = false;
+    try {
+        output.clear();
+        HuffmanArchiver::decode(empty_run.data(), empty_run.size(), output);
+    } catch (const HuffmanArchiver::IO_error&) {
+        rejected = true;
+    }
+    CHECK(rejected);
+
+    // a single stream has no stream table to pay for, so a tiny block
+    // saving a byte gets coded
+    const std::vector<unsigned char> tiny = {0, 1, 0, 1, 0, 1, 0, 1};
+    std::vector<unsigned char> coded, stored;
+    options.streams = 1;
+    HuffmanArchiver::encode(tiny.data(), tiny.size(), stored, options);
+    options.store_margin = 0;
+    HuffmanArchiver::encode(tiny.data(), tiny.size(), coded, options);
+    CHECK(coded.size() < stored.size());
+    output.clear();
+    HuffmanArchiver::decode(coded.data(), coded.size(), output);
+    CHECK(output == tiny);
+
+    options.store_margin = 101;
+    bool thrown = false;
+    try {
+        HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::pipelined_io_test() {
+    std::string input;
+    for (std::size_t i = 0; i < 300000; ++i) {
+        input.push_back('a' + rand() % (i / 30000 + 2));
+    }
+    HuffmanArchiver::Options options;
+    options.block_size = 4096;
+
+    // blocks read, coded and written on different threads still come
+    // out in order, the same as from memory
+    std::stringstream input_stream(input, bit_mask);
+    std::stringstream encoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    HuffmanArchiver::encode(input_stream, encoder_stream,
+                            input_size, output_size, header_size, options);
+    std::vector<unsigned char> archive;
+    HuffmanArchiver::encode(reinterpret_cast<const unsigned char*>(input.data()),
+                            input.size(), archive, options);
+    CHECK(encoder_stream.str() == std::string(archive.begin(), archive.end()));
+    CHECK(input_size == input.size());
+    CHECK(output_size == archive.size());
+
+    // a write failing halfway is reported, not lost on the writer thread
+    char sink[50000];
+    struct FixedBuf: std::streambuf {
+        FixedBuf(char* begin, std::size_t size) { setp(begin, begin + size); }
+    } fixed(sink, sizeof(sink));
+    std::ostream short_stream(&fixed);
+    std::stringstream decoder_input(encoder_stream.str(), bit_mask);
+    bool thrown = false;
+    try {
+        HuffmanArchiver::decode(decoder_input, short_stream,
+                                input_size, output_size, header_size, options);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::context_blocks_test() {
+    // each letter mostly followed by one of a couple of others, while
+    // all letters are about as common
+    std::vector<unsigned char> input;
+    unsigned char previous = 'a';
+    for (std::size_t i = 0; i < 200000; ++i) {
+        std::size_t step = (rand() % 8 == 0) ? rand() % 26 : 1 + rand() % 2;
+        previous = 'a' + (previous - 'a' + step) % 26;
+        input.push_back(previous);
+    }
+
+    HuffmanArchiver::Options options;
+    options.block_size = 65536;
+    std::vector<unsigned char> plain;
+    HuffmanArchiver::encode(input.data(), input.size(), plain, options);
+
+    options.context_groups = 8;
+    options.index = true;
+    std::vector<unsigned char> archive;
+    HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+    CHECK(archive.size() < plain.size() * 3 / 4);
+
+    std::vector<unsigned char> output;
+    try {
+        HuffmanArchiver::decode(archive.data(), archive.size(), output);
+    } catch (...) {
+        CHECK(0 == 1);
+    }
+    CHECK(output == input);
+
+    std::stringstream encoder_stream(
+            std::string(archive.begin(), archive.end()), bit_mask);
+    std::stringstream decoder_stream(bit_mask);
+    HuffmanArchiver::decode_range(encoder_stream, 60000, 10000, decoder_stream);
+    CHECK(decoder_stream.str() == 
+          std::string(input.begin() + 60000, input.begin() + 70000));
+
+    // no order-1 structure to find: the plain codes stay
+    std::vector<unsigned char> noise;
+    for (std::size_t i = 0; i < 100000; ++i) {
+        noise.push_back('a' + rand() % 16);
+    }
+    std::vector<unsigned char> noise_plain;
+    std::vector<unsigned char> noise_archive;
+    options.context_groups = 0;
+    HuffmanArchiver::encode(noise.data(), noise.size(), noise_plain, options);
+    options.context_groups = HuffmanArchiver::MAX_CONTEXT_GROUPS;
+    HuffmanArchiver::encode(noise.data(), noise.size(), noise_archive, options);
+    CHECK(noise_archive.size() <= noise_plain.size());
+
+    options.context_groups = HuffmanArchiver::MAX_CONTEXT_GROUPS + 1;
+    bool thrown = false;
+    try {
+        HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::checksum_test() {
+    const unsigned char check[] = "123456789";
+    CHECK(HuffmanImpl::crc32c(0, check, 9) == 0xE3069283);
+
+    std::vector<unsigned char> input;
+    for (std::size_t i = 0; i < 150000; ++i) {
+        input.push_back('a' + rand() % (i / 20000 + 2));
+    }
+    // split anywhere, the parts combine to the whole; past 16 KiB
+    // the data goes through three lanes
+    const std::uint32_t whole = HuffmanImpl::crc32c(0, input.data(), input.size());
+    for (std::size_t split: {0, 1, 4099, 70001}) {
+        std::uint32_t first = HuffmanImpl::crc32c(0, input.data(), split);
+        std::uint32_t second = HuffmanImpl::crc32c(0, input.data() + split,
+                                                   input.size() - split);
+        CHECK(HuffmanImpl::crc32c(first, input.data() + split, 
+                                  input.size() - split) == whole);
+        CHECK(HuffmanImpl::crc32c_combine(first, second, 
+                                          input.size() - split) == whole);
+    }
+
+    HuffmanArchiver::Options options;
+    options.block_size = 10000;
+    options.checksum = true;
+    options.threads = 3;
+    std::vector<unsigned char> archive;
+    HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+
+    // the stream encoder writes the same checksums
+    std::stringstream input_stream(std::string(input.begin(), input.end()), 
+                                   bit_mask);
+    std::stringstream encoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    HuffmanArchiver::encode(input_stream, encoder_stream,
+                            input_size, output_size, header_size, options);
+    CHECK(encoder_stream.str() == std::string(archive.begin(), archive.end()));
+
+    std::vector<unsigned char> output;
+    HuffmanArchiver::decode(archive.data(), archive.size(), output);
+    CHECK(output == input);
+
+    // a flipped bit in a stored block still decodes, just wrongly,
+    // so only the checksum can catch it
+    options.store_margin = 100;
+    archive.clear();
+    HuffmanArchiver::encode(input.data(), input.size(), archive, options);
+    archive[archive.size() / 2] ^= 0x04;
+    bool thrown = false;
+    try {
+        output.clear();
+        HuffmanArchiver::decode(archive.data(), archive.size(), output);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    std::stringstream corrupted_stream(std::string(archive.begin(), archive.end()),
+                                       bit_mask);
+    std::stringstream decoder_stream(bit_mask);
+    thrown = false;
+    try {
+        HuffmanArchiver::decode(corrupted_stream, decoder_stream,
+                                input_size, output_size, header_size);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::range_test() {
+    std::string input;
+    for (std::size_t i = 0; i < 100000; ++i) {
+        input.push_back('a' + rand() % (i / 10000 + 2));
+    }
+    HuffmanArchiver::Options options;
+    options.block_size = 7000;
+    options.index = true;
+
+    std::stringstream input_stream(input, bit_mask);
+    std::stringstream encoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    HuffmanArchiver::encode(input_stream, encoder_stream,
+                            input_size, output_size, header_size, options);
+    const std::string archive = encoder_stream.str();
+
+    // the index doesn't get in the way of decoding it all
+    std::stringstream archive_stream(archive, bit_mask);
+    std::stringstream decoder_stream(bit_mask);
+    HuffmanArchiver::decode(archive_stream, decoder_stream,
+                            input_size, output_size, header_size);
+    CHECK(decoder_stream.str() == input);
+    CHECK(input_size == archive.size());
+
+    const std::uint64_t ranges[5][2] = {
+        {0, 0}, {0, 100000}, {6999, 2}, {12345, 30000}, {99999, 1}
+    };
+    for (std::size_t i = 0; i < 5; ++i) {
+        std::stringstream range_stream(archive, bit_mask);
+        std::stringstream part(bit_mask);
+        HuffmanArchiver::decode_range(range_stream, ranges[i][0], 
+                                      ranges[i][1], part, 
+                                      input_size, header_size);
+        CHECK(part.str() == input.substr(ranges[i][0], ranges[i][1]));
+        // blocks outside the range stay unread
+        CHECK(input_size <= archive.size() / 2 || ranges[i][1] > 50000);
+    }
+
+    bool thrown = false;
+    try {
+        std::stringstream range_stream(archive, bit_mask);
+        std::stringstream part(bit_mask);
+        HuffmanArchiver::decode_range(range_stream, 99999, 2, part);
+    } catch (const std::out_of_range&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    // archives without an index can't be read that way
+    options.index = false;
+    std::vector<unsigned char> plain;
+    HuffmanArchiver::encode(
+            reinterpret_cast<const unsigned char*>(input.data()), 
+            input.size(), plain, options);
+    thrown = false;
+    try {
+        std::stringstream range_stream(
+                std::string(plain.begin(), plain.end()), bit_mask);
+        std::stringstream part(bit_mask);
+        HuffmanArchiver::decode_range(range_stream, 0, 1, part);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::stats_test() {
+#if HUFFMAN_STATS
+    std::string input;
+    for (std::size_t i = 0; i < 300000; ++i) {
+        input.push_back('a' + rand() % (i / 30000 + 2));
+    }
+    HuffmanArchiver::Stats stats;
+    HuffmanArchiver::Options options;
+    options.block_size = 50000;
+    options.threads = 3;
+    options.stats = &stats;
+
+    std::stringstream input_stream(input, bit_mask);
+    std::stringstream encoder_stream(bit_mask);
+    std::uint64_t input_size, output_size, header_size;
+    HuffmanArchiver::encode(input_stream, encoder_stream,
+                            input_size, output_size, header_size, options);
+    CHECK(stats.bytes_read == input.size());
+    CHECK(stats.bytes_written == output_size);
+    CHECK(stats.read_calls > 0 && stats.write_calls > 0);
+    // every block gets coded, never shorter than its entropy
+    CHECK(stats.symbols == input.size());
+    CHECK(stats.code_bits >= stats.entropy_bits);
+    CHECK(stats.code_bits < stats.entropy_bits + stats.symbols);
+    CHECK(stats.max_code_length > 0 && stats.max_code_length <= 15);
+    CHECK(stats.total_seconds > 0);
+
+    // a second call adds to the first; decoding codes nothing new,
+    // and a whole buffer is read or written in one go
+    std::vector<unsigned char> output;
+    const std::string archive = encoder_stream.str();
+    HuffmanArchiver::decode(
+            reinterpret_cast<const unsigned char*>(archive.data()),
+            archive.size(), output, options);
+    CHECK(std::string(output.begin(), output.end()) == input);
+    CHECK(stats.symbols == input.size());
+    CHECK(stats.bytes_read == input.size() + archive.size());
+    CHECK(stats.bytes_written == output_size + input.size());
+    CHECK(stats.code_seconds > 0);
+
+    // spans, as mapped files are coded, count their input and archive
+    HuffmanArchiver::Stats span_stats;
+    options.stats = &span_stats;
+    std::vector<unsigned char> span(
+            HuffmanImpl::max_archive_size(input.size(), options));
+    std::size_t span_size = HuffmanImpl::encode_span(
+            reinterpret_cast<const unsigned char*>(input.data()),
+            input.size(), span.data(), options, header_size);
+    CHECK(span_stats.bytes_read == input.size() && span_stats.read_calls == 1);
+    CHECK(span_stats.bytes_written == span_size && span_stats.write_calls == 1);
+#endif
+}
+
+void HuffmanArchiverTest::batch_manifest_test() {
+    std::stringstream manifest("a.txt\tout/a.huf\n\nb.txt\nc.huf\n");
+    std::vector<HuffmanImpl::BatchJob> jobs = 
+            HuffmanImpl::read_manifest(manifest, true);
+    CHECK(jobs.size() == 3);
+    CHECK(jobs[0].input == "a.txt" && jobs[0].output == "out/a.huf");
+    CHECK(jobs[1].input == "b.txt" && jobs[1].output == "b.txt.huf");
+    CHECK(jobs[2].output == "c.huf.huf");
+
+    CHECK(HuffmanImpl::default_output("c.huf", false) == "c");
+    CHECK(HuffmanImpl::default_output("c.txt", false) == "c.txt.out");
+    CHECK(HuffmanImpl::default_output(".huf", false) == ".huf.out");
+}
+
+void HuffmanArchiverTest::batch_run_test() {
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() /
+            ("huffman_batch_test_" + std::to_string(rand()));
+    fs::create_directories(dir / "in");
+
+    // two files that fit a worker's share, and one streamed for its
+    // size; 64 KiB on one worker leaves 32 KiB a file
+    const std::size_t memory = 64 * 1024;
+    std::vector<std::string> inputs(3);
+    for (std::size_t i = 0; i < 3000; ++i) {
+        inputs[0].push_back('a' + rand() % 3);
+        inputs[1].push_back('a' + rand() % 20);
+    }
+    for (std::size_t i = 0; i < 100000; ++i) {
+        inputs[2].push_back('a' + rand() % 2);
+    }
+    const char* names[3] = {"a.txt", "b.txt", "big.txt"};
+    for (std::size_t i = 0; i < 3; ++i) {
+        std::ofstream file(dir / "in" / names[i], std::ofstream::binary);
+        file << inputs[i];
+    }
+
+    HuffmanArchiver::Stats stats;
+    HuffmanArchiver::Options options;
+    options.stats = &stats;
+    std::vector<HuffmanImpl::BatchJob> jobs =
+            HuffmanImpl::list_directory((dir / "in").string(),
+                                        (dir / "huf").string(), true);
+    CHECK(jobs.size() == 3);
+    HuffmanImpl::BatchJob missing;
+    missing.input = (dir / "in" / "missing.txt").string();
+    missing.output = (dir / "huf" / "missing.txt.huf").string();
+    jobs.push_back(missing);
+
+    std::vector<HuffmanImpl::BatchResult> results =
+            HuffmanImpl::run_batch(jobs, true, options, 1, memory);
+    CHECK(results.size() == 4);
+    std::uint64_t in_total = 0;
+    for (std::size_t i = 0; i < 3; ++i) {
+        CHECK(results[i].error.empty());
+        CHECK(results[i].in_size == inputs[i].size());
+        CHECK(results[i].out_size == fs::file_size(jobs[i].output));
+        in_total += inputs[i].size();
+    }
+    CHECK(!results[3].error.empty());
+    CHECK(!fs::exists(missing.output));
+#if HUFFMAN_STATS
+    // the workers' stats add up, streamed files and buffered alike
+    CHECK(stats.bytes_read == in_total);
+    CHECK(stats.symbols == in_total);
+#endif
+
+    // the big file decodes to more than its share too; two workers
+    jobs = HuffmanImpl::list_directory((dir / "huf").string(),
+                                       (dir / "out").string(), false);
+    CHECK(jobs.size() == 3);
+    results = HuffmanImpl::run_batch(jobs, false, HuffmanArchiver::Options(),
+                                     2, 2 * memory);
+    bool same = true;
+    for (std::size_t i = 0; i < 3; ++i) {
+        std::ifstream file(dir / "out" / names[i], std::ifstream::binary);
+        std::stringstream output;
+        output << file.rdbuf();
+        same = same && results[i].error.empty() &&
+               results[i].out_size == inputs[i].size() &&
+               output.str() == inputs[i];
+    }
+    CHECK(same);
+
+    // once warm, a worker codes more files of one size without allocating,
+    // so a batch of eight costs what a batch of two does
+    fs::create_directories(dir / "warm");
+    std::vector<HuffmanImpl::BatchJob> encodes, decodes;
+    for (std::size_t i = 0; i < 8; ++i) {
+        HuffmanImpl::BatchJob job;
+        job.input = (dir / "in" / names[0]).string();
+        job.output = (dir / "warm" / (std::to_string(i) + ".huf")).string();
+        encodes.push_back(job);
+        job.input = job.output;
+        job.output = (dir / "warm" / std::to_string(i)).string();
+        decodes.push_back(job);
+    }
+    auto batch_allocations = [&](const std::vector<HuffmanImpl::BatchJob>& all,
+                                 std::size_t count, bool encode) {
+        std::vector<HuffmanImpl::BatchJob> some(all.begin(),
+                                                all.begin() + count);
+        std::size_t before = allocations;
+        HuffmanImpl::run_batch(some, encode, HuffmanArchiver::Options(), 1,
+                               memory);
+        return allocations - before;
+    };
+    CHECK(batch_allocations(encodes, 8, true) ==
+          batch_allocations(encodes, 2, true));
+    CHECK(batch_allocations(decodes, 8, false) ==
+          batch_allocations(decodes, 2, false));
+
+    fs::remove_all(dir);
+}
+
+void HuffmanArchiverTest::span_test() {
+    std::string input;
+    for (std::size_t i = 0; i < 200000; ++i) {
+        input.push_back('a' + rand() % (i / 20000 + 2));
+    }
+    const unsigned char* data =
+            reinterpret_cast<const unsigned char*>(input.data());
+
+    const std::size_t block_sizes[3] = {0, 30000, 1 << 20};
+    for (std::size_t i = 0; i < 3; ++i) {
+        HuffmanArchiver::Options options;
+        options.block_size = block_sizes[i];
+        options.threads = 3;
+
+        std::stringstream input_stream(input, bit_mask);
+        std::stringstream encoder_stream(bit_mask);
+        std::uint64_t input_size, output_size, header_size;
+        HuffmanArchiver::encode(input_stream, encoder_stream,
+                                input_size, output_size, header_size, options);
+
+        std::string archive(
+                HuffmanImpl::max_archive_size(input.size(), options), '\0');
+        unsigned char* dest = reinterpret_cast<unsigned char*>(&archive[0]);
+        std::uint64_t span_header_size;
+        archive.resize(HuffmanImpl::encode_span(data, input.size(), dest,
+                                                options, span_header_size));
+        CHECK(archive == encoder_stream.str());
+        CHECK(span_header_size == header_size);
+
+        const unsigned char* source =
+                reinterpret_cast<const unsigned char*>(archive.data());
+        CHECK(HuffmanImpl::decoded_size(source, archive.size()) == input.size());
+        std::string output(input.size(), '\0');
+        std::size_t used = HuffmanImpl::decode_span(
+                source, archive.size(),
+                reinterpret_cast<unsigned char*>(&output[0]),
+                options, span_header_size);
+        CHECK(used == archive.size());
+        CHECK(output == input);
+    }
+}
+
+void HuffmanArchiverTest::buffer_api_test() {
+    std::vector<unsigned char> input;
+    for (std::size_t i = 0; i < 100000; ++i) {
+        input.push_back('a' + rand() % 7);
+    }
+
+    std::vector<unsigned char> archive = {'x', 'y'};
+    HuffmanArchiver::encode(input.data(), input.size(), archive);
+    CHECK(archive.size() - 2 <= 
+          HuffmanArchiver::max_compressed_size(input.size()));
+    CHECK(archive[0] == 'x' && archive[1] == 'y');
+    archive.erase(archive.begin(), archive.begin() + 2);
+
+    CHECK(HuffmanArchiver::decompressed_size(archive.data(), archive.size()) 
+          == input.size());
+    std::vector<unsigned char> output;
+    HuffmanArchiver::decode(archive.data(), archive.size(), output);
+    CHECK(output == input);
+
+    // an exactly sized buffer is enough, one byte less is not
+    std::vector<unsigned char> exact(archive.size());
+    CHECK(HuffmanArchiver::encode(input.data(), input.size(), 
+                                  exact.data(), exact.size()) == exact.size());
+    CHECK(exact == archive);
+    bool thrown = false;
+    try {
+        HuffmanArchiver::encode(input.data(), input.size(),
+                                exact.data(), exact.size() - 1);
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    output.assign(input.size() - 1, 0);
+    thrown = false;
+    try {
+        HuffmanArchiver::decode(archive.data(), archive.size(), 
+                                output.data(), output.size());
+    } catch (const HuffmanArchiver::IO_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    std::vector<unsigned char> empty;
+    HuffmanArchiver::encode(nullptr, 0, empty);
+    HuffmanArchiver::decode(empty.data(), empty.size(), output);
+    CHECK(output.size() == input.size() - 1);
+}
+
+void HuffmanArchiverTest::reusable_contexts_test() {
+    // text-like blocks, then bytes skewed enough for package-merge
+    std::vector<unsigned char> input;
+    for (std::size_t i = 0; i < 200000; ++i) {
+        input.push_back('a' + rand() % (i / 50000 + 3));
+    }
+    for (std::size_t i = 0; i < 60000; ++i) {
+        unsigned char byte = 0;
+        while (byte < 40 && rand() % 2) {
+            ++byte;
+        }
+        input.push_back(byte);
+    }
+
+    HuffmanArchiver::Options blocks;
+    blocks.block_size = 1 << 16;
+    blocks.index = true;
+    blocks.checksum = true;
+    HuffmanArchiver::Options canonical;
+    canonical.block_size = 0;
+    HuffmanArchiver::Options contexts;
+    contexts.block_size = 1 << 16;
+    contexts.context_groups = 4;
+
+    for (const HuffmanArchiver::Options* options: {&blocks, &canonical, &contexts}) {
+        HuffmanArchiver::EncoderContext encoder(*options);
+        HuffmanArchiver::DecoderContext decoder(*options);
+        std::vector<unsigned char> expected;
+        HuffmanArchiver::encode(input.data(), input.size(), expected, *options);
+        std::vector<unsigned char> archive(HuffmanArchiver::max_compressed_size(
+                input.size(), *options));
+        std::vector<unsigned char> output(input.size());
+
+        // the first round gets everything to size, the second must
+        // not allocate; tails of the input keep the skewed bytes
+        bool same = true;
+        std::size_t encode_allocations = 0;
+        std::size_t decode_allocations = 0;
+        for (int round = 0; round < 2; ++round) {
+            for (std::size_t size: {input.size(), input.size() / 3, std::size_t(1000)}) {
+                const unsigned char* data = input.data() + input.size() - size;
+                std::size_t before = allocations;
+                std::size_t archive_size = encoder.encode(data, size, archive.data(),
+                                                          archive.size());
+                // too small for the worst case, so it goes through staging
+                same = same && encoder.encode(data, size, archive.data(),
+                                              archive_size) == archive_size;
+                std::size_t middle = allocations;
+                same = same && decoder.decode(archive.data(), archive_size,
+                                              output.data(), output.size()) == size;
+                same = same && std::equal(data, data + size, output.data());
+                if (size == input.size()) {
+                    same = same && archive_size == expected.size() &&
+                           std::equal(expected.begin(), expected.end(), archive.data());
+                }
+                if (round == 1) {
+                    encode_allocations += middle - before;
+                    decode_allocations += allocations - middle;
+                }
+            }
+        }
+        CHECK(same);
+        CHECK(encode_allocations == 0);
+        CHECK(decode_allocations == 0);
+    }
+
+    bool thrown = false;
+    try {
+        HuffmanArchiver::Options bad;
+        bad.streams = 0;
+        HuffmanArchiver::EncoderContext encoder(bad);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::table_cache_test() {
+    // the same bytes in a new order each time: other archives, same tables
+    std::vector<unsigned char> sample;
+    for (std::size_t i = 0; i < 3000; ++i) {
+        sample.push_back('a' + rand() % 7 + (i % 3 == 0));
+    }
+    HuffmanArchiver::Options blocks;
+    blocks.streams = 1;
+    HuffmanArchiver::Options canonical;
+    canonical.block_size = 0;
+    std::vector<std::vector<unsigned char>> inputs;
+    std::vector<std::vector<unsigned char>> archives;
+    for (std::size_t k = 0; k < 32; ++k) {
+        for (std::size_t i = sample.size() - 1; i > 0; --i) {
+            std::swap(sample[i], sample[rand() % (i + 1)]);
+        }
+        inputs.push_back(sample);
+        archives.emplace_back();
+        HuffmanArchiver::encode(sample.data(), sample.size(), archives.back(),
+                                (k % 2) ? canonical : blocks);
+    }
+
+    HuffmanArchiver::TableCache cache(4);
+    HuffmanArchiver::Stats stats;
+    HuffmanArchiver::Options options;
+    options.table_cache = &cache;
+    options.stats = &stats;
+    bool same = true;
+    for (std::size_t k = 0; k < archives.size(); ++k) {
+        std::vector<unsigned char> output;
+        HuffmanArchiver::decode(archives[k].data(), archives[k].size(), output, options);
+        same = same && output == inputs[k];
+    }
+    // streams take the same tables
+    std::string archive(archives[1].begin(), archives[1].end());
+    std::istringstream in(archive);
+    std::ostringstream out;
+    std::uint64_t in_size, out_size, header_size;
+    HuffmanArchiver::decode(in, out, in_size, out_size, header_size, options);
+    same = same && out.str() == std::string(inputs[1].begin(), inputs[1].end());
+    CHECK(same);
+    CHECK(cache.misses() == 1 && cache.hits() == archives.size());
+    CHECK(cache.size() == 1);
+#if HUFFMAN_STATS
+    CHECK(stats.table_misses == 1 && stats.table_hits == archives.size());
+#endif
+
+    // threads sharing the cache all see the one table
+    std::atomic<bool> threads_same(true);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+            HuffmanArchiver::Options thread_options;
+            thread_options.table_cache = &cache;
+            for (std::size_t k = t; k < archives.size(); k += 4) {
+                std::vector<unsigned char> output;
+                HuffmanArchiver::decode(archives[k].data(), archives[k].size(),
+                                        output, thread_options);
+                if (output != inputs[k]) {
+                    threads_same = false;
+                }
+            }
+        });
+    }
+    for (std::thread& thread: threads) {
+        thread.join();
+    }
+    CHECK(threads_same);
+    CHECK(cache.misses() == 1 && cache.hits() == 2 * archives.size());
+
+    // more code lengths than room: the oldest go
+    for (std::size_t k = 0; k < 10; ++k) {
+        std::vector<unsigned char> data(2000);
+        for (std::size_t i = 0; i < data.size(); ++i) {
+            data[i] = 'A' + i % (k + 2);
+        }
+        std::vector<unsigned char> encoded, output;
+        HuffmanArchiver::encode(data.data(), data.size(), encoded, blocks);
+        HuffmanArchiver::decode(encoded.data(), encoded.size(), output, options);
+        same = same && output == data;
+    }
+    CHECK(same);
+    CHECK(cache.misses() == 11 && cache.size() <= 4);
+    cache.clear();
+    CHECK(cache.size() == 0);
+
+    bool thrown = false;
+    try {
+        HuffmanArchiver::TableCache empty(0);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void HuffmanArchiverTest::wide_symbols_test() {
+    // slowly drifting 16-bit samples, low byte first, and an odd byte out
+    std::vector<unsigned char> samples;
+    for (std::size_t i = 0; i < 200000; ++i) {
+        unsigned value = 30000 + (i / 50) % 400 + rand() % 64;
+        samples.push_back(value & 0xFF);
+        samples.push_back(value >> 8);
+    }
+    HuffmanArchiver::Options bytes;
+    HuffmanArchiver::Options wide;
+    wide.symbol_size = 2;
+    bool same = true;
+    for (std::size_t size: {samples.size(), samples.size() - 1,
+                            std::size_t(1), std::size_t(0)}) {
+        for (std::size_t streams: {1, 4}) {
+            wide.streams = streams;
+            bytes.streams = streams;
+            std::vector<unsigned char> byte_archive, archive, output;
+            HuffmanArchiver::encode(samples.data(), size, byte_archive, bytes);
+            HuffmanArchiver::encode(samples.data(), size, archive, wide);
+            CHECK(archive.size() <=
+                  HuffmanArchiver::max_compressed_size(size, wide));
+            if (size > 1000) {
+                CHECK(archive.size() < byte_archive.size());
+            }
+            HuffmanArchiver::decode(archive.data(), archive.size(), output);
+            same = same && output ==
+                   std::vector<unsigned char>(samples.begin(),
+                                              samples.begin() + size);
+        }
+    }
+    CHECK(same);
+
+    // Fibonacci counts make codes longer than the limit (other symbols
+    // would even the tree out), spread over the alphabet
+    std::vector<std::uint16_t> symbols;
+    std::size_t a = 1, b = 1;
+    for (std::uint16_t k = 0; k < 26; ++k) {
+        symbols.insert(symbols.end(), a, k * 2311);
+        std::swap(a, b);
+        b += a;
+    }
+    for (std::size_t i = symbols.size() - 1; i > 0; --i) {
+        std::swap(symbols[i], symbols[rand() % (i + 1)]);
+    }
+    std::vector<unsigned char> skewed;
+    for (std::uint16_t symbol: symbols) {
+        skewed.push_back(symbol & 0xFF);
+        skewed.push_back(symbol >> 8);
+    }
+    wide.streams = 4;
+    wide.block_size = skewed.size();
+    std::vector<unsigned char> byte_archive, archive, output;
+    HuffmanArchiver::encode(skewed.data(), skewed.size(), byte_archive);
+    HuffmanArchiver::encode(skewed.data(), skewed.size(), archive, wide);
+    CHECK(archive.size() < byte_archive.size());
+    HuffmanArchiver::decode(archive.data(), archive.size(), output);
+    CHECK(output == skewed);
+#if HUFFMAN_STATS
+    // their codes are reported as those of byte blocks are
+    HuffmanArchiver::Stats stats;
+    wide.stats = &stats;
+    archive.clear();
+    HuffmanArchiver::encode(skewed.data(), skewed.size(), archive, wide);
+    CHECK(stats.symbols == skewed.size());
+    CHECK(stats.code_bits >= stats.entropy_bits);
+    CHECK(stats.code_bits < stats.entropy_bits + stats.symbols / 2);
+    CHECK(stats.max_code_length == HuffmanImpl::WIDE_MAX_CODE_LENGTH);
+    wide.stats = nullptr;
+#endif
+
+    // streams take wide blocks as well
+    std::istringstream in(std::string(archive.begin(), archive.end()));
+    std::ostringstream out;
+    std::uint64_t in_size, out_size, header_size;
+    HuffmanArchiver::decode(in, out, in_size, out_size, header_size);
+    CHECK(out.str() == std::string(skewed.begin(), skewed.end()));
+
+    // a corrupted code table is caught; it follows the block header, a
+    // varint count and then a varint (gap to the symbol << 5) | length
+    // for each symbol
+    CHECK(archive[HuffmanImpl::ARCHIVE_HEADER_SIZE] == HuffmanImpl::BLOCK_WIDE);
+    const std::size_t table = HuffmanImpl::ARCHIVE_HEADER_SIZE +
+                              HuffmanImpl::BLOCK_HEADER_SIZE;
+    std::uint64_t used, value;
+    std::size_t pos = table + HuffmanImpl::get_varint(
+            archive.data() + table, archive.size() - table, used);
+    std::vector<std::size_t> entries;
+    for (std::uint64_t i = 0; i < used; ++i) {
+        entries.push_back(pos);
+        pos += HuffmanImpl::get_varint(archive.data() + pos,
+                                       archive.size() - pos, value);
+    }
+    CHECK(pos - entries.back() > 1);
+    // a length of 0, one past the limit, 1 for every symbol (more codes
+    // than fit) and the last gap running past the 16-bit symbols
+    bool thrown = true;
+    for (int corruption = 0; corruption < 4; ++corruption) {
+        std::vector<unsigned char> broken = archive;
+        for (std::size_t k = 0; k < entries.size(); ++k) {
+            unsigned char& low = broken[entries[k]];
+            if ((corruption == 0 && k == 0) || corruption == 2) {
+                low = (low & ~0x1F) | (corruption == 2);
+            } else if (corruption == 1 && k == 0) {
+                low = (low & ~0x1F) | (HuffmanImpl::WIDE_MAX_CODE_LENGTH + 1);
+            }
+        }
+        if (corruption == 3) {
+            broken[pos - 1] = 0x7F;
+        }
+        try {
+            HuffmanArchiver::decode(broken.data(), broken.size(), output);
+            thrown = false;
+        } catch (const HuffmanArchiver::IO_error& excep) {
+            thrown = thrown && std::string(excep.what()) ==
+                               "wrong header: bad code lengths";
+        }
+    }
+    CHECK(thrown);
+
+    for (std::size_t bad_case = 0; bad_case < 2; ++bad_case) {
+        HuffmanArchiver::Options bad;
+        bad.symbol_size = bad_case ? 2 : 3;
+        bad.block_size = bad_case ? 0 : bad.block_size;
+        thrown = false;
+        try {
+            HuffmanArchiver::encode(skewed.data(), skewed.size(), archive, bad);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        CHECK(thrown);
+    }
+}
+
+void HuffmanArchiverTest::dictionary_test() {
+    std::string corpus;
+    for (int i = 0; i < 300; ++i) {
+        corpus += "{\"id\":" + std::to_string(rand() % 1000) + 
+                  ",\"ok\":true}";
+    }
+    HuffmanArchiver::Frequencies samples;
+    samples.add(reinterpret_cast<const unsigned char*>(corpus.data()),
+                corpus.size());
+    HuffmanArchiver::Dictionary dictionary(samples);
+
+    std::stringstream saved(bit_mask);
+    dictionary.save(saved);
+    HuffmanArchiver::Dictionary loaded;
+    CHECK(loaded.id() != dictionary.id());
+    loaded.load_saved(saved);
+    CHECK(loaded.id() == dictionary.id());
+
+    HuffmanArchiver::Options options;
+    options.dictionary = &dictionary;
+    const std::string record = "{\"id\":417,\"ok\":true}";
+    const std::string unseen = "\x01\xFF~";
+    for (const std::string& input: {record, unseen, std::string()}) {
+        const unsigned char* data = 
+                reinterpret_cast<const unsigned char*>(input.data());
+        std::vector<unsigned char> archive;
+        HuffmanArchiver::encode(data, input.size(), archive, options);
+        CHECK(archive.size() <= 
+              HuffmanArchiver::max_compressed_size(input.size(), options));
+
+        HuffmanArchiver::Options decode_options;
+        decode_options.dictionary = &loaded;
+        std::vector<unsigned char> output;
+        HuffmanArchiver::decode(archive.data(), archive.size(), output, 
+                                decode_options);
+        CHECK(std::string(output.begin(), output.end()) == input);
+
+        std::stringstream input_stream(input, bit_mask);
+        std::stringstream encoder_stream(bit_mask);
+        std::stringstream decoder_stream(bit_mask);
+        std::uint64_t input_size, output_size, header_size;
+        HuffmanArchiver::encode(input_stream, encoder_stream,
+                                input_size, output_size, header_size, options);
+        CHECK(encoder_stream.str() == 
+              std::string(archive.begin(), archive.end()));
+        CHECK(header_size == HuffmanArchiver::SIGNATURE_SIZE + 6);
+        HuffmanArchiver::decode(encoder_stream, decoder_stream,
+                                input_size, output_size, header_size, 
+                                decode_options);
+        CHECK(decoder_stream.str() == input);
+        CHECK(input_size == archive.size());
+    }
+
+    // much smaller than coding the record on its own
+    std::vector<unsigned char> archive, plain;
+    HuffmanArchiver::encode(reinterpret_cast<const unsigned char*>(record.data()),
+                            record.size(), archive, options);
+    HuffmanArchiver::encode(reinterpret_cast<const unsigned char*>(record.data()),
+                            record.size(), plain);
+    CHECK(archive.size() - (HuffmanArchiver::SIGNATURE_SIZE + 6) < 
+          record.size());
+    CHECK(archive.size() < plain.size());
+
+    HuffmanArchiver::Dictionary other;
+    const HuffmanArchiver::Dictionary* wrong[2] = {nullptr, &other};
+    for (const HuffmanArchiver::Dictionary* dict: wrong) {
+        HuffmanArchiver::Options decode_options;
+        decode_options.dictionary = dict;
+        std::vector<unsigned char> output;
+        bool thrown = false;
+        try {
+            HuffmanArchiver::decode(archive.data(), archive.size(), output, 
+                                    decode_options);
+        } catch (const HuffmanArchiver::IO_error&) {
+            thrown = true;
+        }
+        CHECK(thrown);
+    }
+}